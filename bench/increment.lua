@@ -0,0 +1,57 @@
+-- Compares the closure-based lowering of ++/-- that Irradiant used to emit
+-- with the plain assignments and hoisted temporaries it emits now.
+-- Usage: lua bench/increment.lua [iterations]
+local iterations = tonumber(arg and arg[1]) or 1000000
+
+-- while (i < n) i++;
+local function discarded_closure(n)
+    local i = 0
+    while i < n do
+        local _ = (function() local _ = i; i = i + 1; return _ end)()
+    end
+    return i
+end
+
+local function discarded_plain(n)
+    local i = 0
+    while i < n do
+        i = i + 1
+    end
+    return i
+end
+
+-- while (i < n) sum += i++;
+local function used_closure(n)
+    local i, sum = 0, 0
+    while i < n do
+        sum = sum + (function() local _ = i; i = i + 1; return _ end)()
+    end
+    return sum
+end
+
+local function used_hoisted(n)
+    local i, sum = 0, 0
+    while i < n do
+        local _tmp1 = i
+        i = i + 1
+        sum = sum + _tmp1
+    end
+    return sum
+end
+
+local function measure(name, fn)
+    collectgarbage("collect")
+    collectgarbage("stop")
+    local before = collectgarbage("count")
+    local start = os.clock()
+    fn(iterations)
+    local elapsed = os.clock() - start
+    local allocated = collectgarbage("count") - before
+    collectgarbage("restart")
+    print(string.format("%-18s %8.3f s %12.1f KiB allocated", name, elapsed, allocated))
+end
+
+measure("discarded/closure", discarded_closure)
+measure("discarded/plain", discarded_plain)
+measure("used/closure", used_closure)
+measure("used/hoisted", used_hoisted)
@@ -0,0 +1,48 @@
+// Inserts pseudo-random integers into an open addressing hash table, looks
+// up another run of them, and prints how many were distinct and found.
+#include <stdio.h>
+
+#define TABLE_SIZE 524288
+#define COUNT 300000
+
+int keys[TABLE_SIZE];
+int used[TABLE_SIZE];
+
+// Returns the slot that holds key, or the empty slot it would go in
+int find_slot(int key)
+{
+    int slot = key % TABLE_SIZE;
+    while (used[slot] && keys[slot] != key)
+        slot = (slot + 1) % TABLE_SIZE;
+    return slot;
+}
+
+int main()
+{
+    // Park-Miller, whose products stay exact in a double
+    long long seed = 1;
+    int distinct = 0;
+    for (int i = 0; i < COUNT; i++)
+    {
+        seed = seed * 16807 % 2147483647;
+        int key = (int)(seed % 1000000);
+        int slot = find_slot(key);
+        if (!used[slot])
+        {
+            used[slot] = 1;
+            keys[slot] = key;
+            distinct++;
+        }
+    }
+
+    int found = 0;
+    for (int i = 0; i < COUNT; i++)
+    {
+        seed = seed * 16807 % 2147483647;
+        if (used[find_slot((int)(seed % 1000000))])
+            found++;
+    }
+
+    printf("%d distinct, %d found\n", distinct, found);
+    return 0;
+}
@@ -0,0 +1,86 @@
+// Hashes buffers of pseudo-random words with FNV-1a and the MurmurHash3
+// finaliser in 32 bits and a polynomial hash in 64, and prints the digests.
+//
+// Lua doesn't wrap + and * on overflow, and before 5.3 computes in doubles,
+// so the 32-bit hashes mask each step back to 32 bits and keep every product
+// below 2^53, where it's still exact. That changes nothing natively.
+#include <stdio.h>
+
+#define WORDS 65536
+#define ROUNDS 4
+
+unsigned data[WORDS];
+
+// a * b mod 2^32, as two products of at most 48 bits
+unsigned mul32(unsigned a, unsigned b)
+{
+    return ((((a * (b >> 16)) & 0xFFFF) << 16) + a * (b & 0xFFFF)) & 0xFFFFFFFF;
+}
+
+// FNV-1a over the bytes of each word, least significant first. The multiply
+// by the FNV prime, 2^24 + 2^8 + 0x93, is spelt as shifts and adds, as in the
+// reference implementation.
+unsigned fnv1a32(void)
+{
+    unsigned h = 2166136261u;
+    for (int i = 0; i < WORDS; i++)
+    {
+        unsigned word = data[i];
+        for (int byte = 0; byte < 4; byte++)
+        {
+            h ^= word & 0xFF;
+            h = (h + (h << 1) + (h << 4) + (h << 7) + (h << 8) + (h << 24)) & 0xFFFFFFFF;
+            word >>= 8;
+        }
+    }
+    return h;
+}
+
+// MurmurHash3's fmix32, which every bit of the input affects every bit of
+unsigned fmix32(unsigned h)
+{
+    h ^= h >> 16;
+    h = mul32(h, 0x85EBCA6B);
+    h ^= h >> 13;
+    h = mul32(h, 0xC2B2AE35);
+    h ^= h >> 16;
+    return h;
+}
+
+// Chains the words through fmix32, as a hash of the whole buffer
+unsigned murmur32(void)
+{
+    unsigned h = 0;
+    for (int i = 0; i < WORDS; i++)
+        h = fmix32(h ^ data[i]);
+    return h;
+}
+
+// A polynomial hash of the words mod the Mersenne prime 2^31 - 1, whose
+// products stay below 2^53
+unsigned long long poly64(void)
+{
+    unsigned long long h = 0;
+    for (int i = 0; i < WORDS; i++)
+        h = (h * 1000003 + data[i]) % 2147483647;
+    return h;
+}
+
+int main()
+{
+    // xorshift32, which only needs the bitwise operators
+    unsigned seed = 2463534242u;
+    for (int round = 0; round < ROUNDS; round++)
+    {
+        for (int i = 0; i < WORDS; i++)
+        {
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            data[i] = seed;
+        }
+
+        printf("%08x %08x %d\n", fnv1a32(), murmur32(), (int)poly64());
+    }
+    return 0;
+}
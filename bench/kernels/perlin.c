@@ -0,0 +1,20 @@
+// Samples a plane of Perlin noise, and prints the sum of the samples.
+#include <stdio.h>
+#define STB_PERLIN_IMPLEMENTATION
+#include "../../test/stb_perlin.h"
+
+#define SIZE 384
+
+int main()
+{
+    // Lua computes the noise in doubles rather than floats, so the sum is
+    // printed to a precision both agree on
+    double sum = 0;
+    for (int y = 0; y < SIZE; y++)
+    {
+        for (int x = 0; x < SIZE; x++)
+            sum += stb_perlin_noise3(x * 0.05f, y * 0.05f, 0.5f, 0, 0, 0);
+    }
+    printf("%.1f\n", sum);
+    return 0;
+}
@@ -0,0 +1,73 @@
+// Sorts pseudo-random integers with quicksort, and prints a checksum of the
+// sorted array.
+#include <stdio.h>
+
+#define COUNT 200000
+
+int data[COUNT];
+
+void quicksort(int lo, int hi)
+{
+    while (lo < hi)
+    {
+        int pivot = data[lo + (hi - lo) / 2];
+        int i = lo;
+        int j = hi;
+        while (i <= j)
+        {
+            while (data[i] < pivot)
+                i++;
+            while (data[j] > pivot)
+                j--;
+            if (i <= j)
+            {
+                int t = data[i];
+                data[i] = data[j];
+                data[j] = t;
+                i++;
+                j--;
+            }
+        }
+
+        // Recurse into the smaller half and loop on the larger, so the stack
+        // stays shallow
+        if (j - lo < hi - i)
+        {
+            quicksort(lo, j);
+            lo = i;
+        }
+        else
+        {
+            quicksort(i, hi);
+            hi = j;
+        }
+    }
+}
+
+int main()
+{
+    // Park-Miller, whose products stay exact in a double
+    long long seed = 42;
+    for (int i = 0; i < COUNT; i++)
+    {
+        seed = seed * 16807 % 2147483647;
+        data[i] = (int)(seed % 1000000);
+    }
+
+    quicksort(0, COUNT - 1);
+
+    for (int i = 1; i < COUNT; i++)
+    {
+        if (data[i - 1] > data[i])
+        {
+            printf("not sorted at %d\n", i);
+            return 1;
+        }
+    }
+
+    long long checksum = 0;
+    for (int i = 0; i < COUNT; i++)
+        checksum = (checksum * 31 + data[i]) % 1000000007;
+    printf("%d\n", (int)checksum);
+    return 0;
+}
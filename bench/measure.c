@@ -0,0 +1,49 @@
+// Runs a command, and writes its exit code, wall time in seconds and peak
+// resident set size in KiB to a file. bench/run.py runs every program through
+// this rather than directly, as a process's peak RSS includes that of the
+// process it was forked from, which for Python dwarfs most programs.
+// Usage: measure <report> <command> [args...]
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+int main(int argc, char** argv)
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "Usage: %s <report> <command> [args...]\n", argv[0]);
+        return 2;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        execvp(argv[2], argv + 2);
+        _exit(127);
+    }
+    if (pid < 0)
+        return 2;
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0)
+        return 2;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    FILE* report = fopen(argv[1], "w");
+    if (!report)
+        return 2;
+    int code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(report, "%d %.9f %ld\n", code, seconds, usage.ru_maxrss);
+    fclose(report);
+    return 0;
+}
@@ -0,0 +1,165 @@
+#!/usr/bin/env python3
+"""Compares each test program and benchmark kernel compiled natively with the
+same program transpiled by Irradiant and run under every Lua found on the
+PATH. Checks that each Lua run prints what the native one does, and reports
+the runtime ratio and peak memory of each as JSON.
+
+Usage: python3 bench/run.py [--irradiant ./irradiant] [--output results.json]
+
+Run it from the repository root. Exits with 1 if any program fails to build,
+or any Lua run fails or prints something different, so it can gate CI.
+"""
+
+import argparse
+import glob
+import json
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+
+# Each Lua interpreter and the -target it runs
+INTERPRETERS = [
+    ("lua5.1", "lua51"),
+    ("lua5.2", "lua52"),
+    ("lua5.3", "lua53"),
+    ("luajit", "luajit"),
+]
+
+# What each program reads from stdin, by name
+STDIN = {
+    "rot13": b"The quick brown fox jumps over the lazy dog.\n" * 1000,
+}
+
+
+def run(measure_path, command, stdin):
+    """Runs command to completion through the measure helper, returning its
+    exit code, stdout, wall time in seconds and peak resident set size in
+    KiB."""
+    with tempfile.TemporaryFile() as stdin_file, tempfile.TemporaryFile() as stdout_file, \
+            tempfile.NamedTemporaryFile("r") as report:
+        stdin_file.write(stdin)
+        stdin_file.seek(0)
+        subprocess.run([measure_path, report.name] + command, stdin=stdin_file,
+                       stdout=stdout_file, stderr=subprocess.DEVNULL, check=True)
+        code, seconds, rss = report.read().split()
+        stdout_file.seek(0)
+        return int(code), stdout_file.read(), float(seconds), int(rss)
+
+
+def measure(measure_path, command, stdin, repeat):
+    """Runs command repeat times, keeping the fastest time and the largest
+    peak memory. The output is the first run's."""
+    code, output, best, peak = run(measure_path, command, stdin)
+    for _ in range(repeat - 1):
+        _, _, elapsed, rss = run(measure_path, command, stdin)
+        best = min(best, elapsed)
+        peak = max(peak, rss)
+    return {"exit_code": code, "seconds": best, "max_rss_kib": peak}, output
+
+
+def build_native(cc, source, path):
+    result = subprocess.run([cc, "-O2", "-w", "-o", path, source, "-lm"],
+                            stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+    return result.stderr.decode(errors="replace") if result.returncode else None
+
+
+def transpile(irradiant, flags, target, source, path):
+    command = [irradiant, "-target=" + target, "-bake-includes", "-o", path] + flags + [source]
+    result = subprocess.run(command, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+    return result.stderr.decode(errors="replace") if result.returncode else None
+
+
+def benchmark(source, args, interpreters, build_dir, measure_path):
+    name = os.path.splitext(os.path.basename(source))[0]
+    stdin = STDIN.get(name, b"")
+    entry = {"name": name, "source": source, "lua": {}}
+
+    native_path = os.path.join(build_dir, name)
+    error = build_native(args.cc, source, native_path)
+    if error is not None:
+        entry["error"] = "native build failed: " + error.strip()
+        return entry, False
+    entry["native"], expected = measure(measure_path, [native_path], stdin, args.repeat)
+
+    ok = True
+    for interpreter, target in interpreters:
+        script = os.path.join(build_dir, "%s.%s.lua" % (name, target))
+        error = transpile(args.irradiant, args.flag, target, source, script)
+        if error is not None:
+            entry["lua"][interpreter] = {"error": "transpile failed: " + error.strip()}
+            ok = False
+            continue
+
+        result, output = measure(measure_path, [interpreter, script], stdin, args.repeat)
+        result["output_matches"] = (output == expected and
+                                    result["exit_code"] == entry["native"]["exit_code"])
+        native_seconds = entry["native"]["seconds"]
+        result["ratio"] = result["seconds"] / native_seconds if native_seconds > 0 else None
+        entry["lua"][interpreter] = result
+        ok = ok and result["output_matches"]
+    return entry, ok
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("--irradiant", default="./irradiant")
+    parser.add_argument("--cc", default="cc")
+    parser.add_argument("--lua", action="append",
+                        help="only run this interpreter (lua5.1, lua5.2, lua5.3 or luajit); "
+                             "may be repeated")
+    parser.add_argument("--flag", action="append", default=[],
+                        help="pass this flag to Irradiant, e.g. --flag=-linear-memory; "
+                             "may be repeated")
+    parser.add_argument("--repeat", type=int, default=3,
+                        help="runs of each program, of which the fastest is kept")
+    parser.add_argument("--output", help="write the JSON here rather than to stdout")
+    parser.add_argument("programs", nargs="*",
+                        help="C files to run (default: test/*.c and bench/kernels/*.c)")
+    args = parser.parse_args()
+
+    interpreters = [(interpreter, target) for interpreter, target in INTERPRETERS
+                    if (args.lua is None or interpreter in args.lua) and
+                    shutil.which(interpreter)]
+    if not interpreters:
+        print("No Lua interpreters found", file=sys.stderr)
+        return 1
+
+    programs = args.programs or (sorted(glob.glob("test/*.c")) +
+                                 sorted(glob.glob("bench/kernels/*.c")))
+    results = {
+        "irradiant_flags": args.flag,
+        "interpreters": [interpreter for interpreter, _ in interpreters],
+        "programs": [],
+    }
+
+    ok = True
+    build_dir = tempfile.mkdtemp(prefix="irradiant-bench-")
+    try:
+        measure_path = os.path.join(build_dir, "measure")
+        error = build_native(args.cc, os.path.join(os.path.dirname(__file__), "measure.c"),
+                             measure_path)
+        if error is not None:
+            print("Failed to build bench/measure.c:\n" + error, file=sys.stderr)
+            return 1
+
+        for source in programs:
+            entry, passed = benchmark(source, args, interpreters, build_dir, measure_path)
+            results["programs"].append(entry)
+            ok = ok and passed
+            print("%-12s %s" % (entry["name"], "ok" if passed else "FAILED"), file=sys.stderr)
+    finally:
+        shutil.rmtree(build_dir)
+
+    text = json.dumps(results, indent=2, sort_keys=True)
+    if args.output:
+        with open(args.output, "w") as file:
+            file.write(text + "\n")
+    else:
+        print(text)
+    return 0 if ok else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,367 @@
+#include "lua_ast.h"
+
+using llvm::cast;
+using llvm::dyn_cast;
+
+namespace lua
+{
+
+bool IsAlwaysTruthy(Expr const& expr)
+{
+    switch (expr.kind)
+    {
+    case Expr::Kind::Number:
+    case Expr::Kind::String:
+    case Expr::Kind::Function:
+    case Expr::Kind::Table:
+        return true;
+    case Expr::Kind::Boolean:
+        return cast<Boolean>(expr).value;
+    case Expr::Kind::Paren:
+        return IsAlwaysTruthy(*cast<Paren>(expr).expr);
+    case Expr::Kind::Unary:
+        return cast<Unary>(expr).op != UnaryOp::Not;
+    case Expr::Kind::Binary:
+        switch (cast<Binary>(expr).op)
+        {
+        case BinaryOp::BitOr:
+        case BinaryOp::BitXor:
+        case BinaryOp::BitAnd:
+        case BinaryOp::Shl:
+        case BinaryOp::Shr:
+        case BinaryOp::Concat:
+        case BinaryOp::Add:
+        case BinaryOp::Sub:
+        case BinaryOp::Mul:
+        case BinaryOp::Div:
+        case BinaryOp::IDiv:
+        case BinaryOp::Mod:
+        case BinaryOp::Pow:
+            return true;
+        default:
+            return false;
+        }
+    default:
+        return false;
+    }
+}
+
+ExprPtr Negate(ExprPtr expr)
+{
+    if (auto boolean = dyn_cast<Boolean>(expr.get()))
+    {
+        boolean->value = !boolean->value;
+        return expr;
+    }
+
+    if (auto binary = dyn_cast<Binary>(expr.get()))
+    {
+        // Only equality can be flipped: not (a < b) is not a >= b for NaN
+        if (binary->op == BinaryOp::Eq)
+        {
+            binary->op = BinaryOp::Ne;
+            return expr;
+        }
+        if (binary->op == BinaryOp::Ne)
+        {
+            binary->op = BinaryOp::Eq;
+            return expr;
+        }
+    }
+
+    if (auto unary = dyn_cast<Unary>(expr.get()))
+    {
+        if (unary->op == UnaryOp::Not)
+            return std::move(unary->operand);
+    }
+
+    if (auto paren = dyn_cast<Paren>(expr.get()))
+        return Negate(std::move(paren->expr));
+
+    return Make<Unary>(UnaryOp::Not, std::move(expr));
+}
+
+ExprPtr Clone(Expr const& expr)
+{
+    switch (expr.kind)
+    {
+    case Expr::Kind::Nil:
+        return Make<Nil>();
+    case Expr::Kind::Boolean:
+        return Make<Boolean>(cast<Boolean>(expr).value);
+    case Expr::Kind::Number:
+        return Make<Number>(cast<Number>(expr).text);
+    case Expr::Kind::String:
+        return Make<String>(cast<String>(expr).value);
+    case Expr::Kind::Name:
+        return Make<Name>(cast<Name>(expr).name);
+    case Expr::Kind::Index:
+    {
+        auto& index = cast<Index>(expr);
+        return Make<Index>(Clone(*index.object), Clone(*index.key));
+    }
+    case Expr::Kind::Call:
+    {
+        auto& call = cast<Call>(expr);
+        ExprList args;
+        for (auto& arg : call.args)
+            args.push_back(Clone(*arg));
+        return Make<Call>(Clone(*call.callee), std::move(args));
+    }
+    case Expr::Kind::Function:
+    {
+        auto& function = cast<Function>(expr);
+        auto copy = Make<Function>();
+        copy->params = function.params;
+        copy->body = Clone(function.body);
+        return std::move(copy);
+    }
+    case Expr::Kind::Binary:
+    {
+        auto& binary = cast<Binary>(expr);
+        return Make<Binary>(binary.op, Clone(*binary.lhs), Clone(*binary.rhs));
+    }
+    case Expr::Kind::Unary:
+    {
+        auto& unary = cast<Unary>(expr);
+        return Make<Unary>(unary.op, Clone(*unary.operand));
+    }
+    case Expr::Kind::Paren:
+        return Make<Paren>(Clone(*cast<Paren>(expr).expr));
+    case Expr::Kind::Table:
+    {
+        auto table = Make<Table>();
+        for (auto& item : cast<Table>(expr).items)
+            table->items.push_back(Clone(*item));
+        table->keys = cast<Table>(expr).keys;
+        return std::move(table);
+    }
+    }
+    return Make<Nil>();
+}
+
+namespace
+{
+
+StmtPtr CloneKind(Stmt const& stmt)
+{
+    switch (stmt.kind)
+    {
+    case Stmt::Kind::Local:
+    {
+        auto& local = cast<Local>(stmt);
+        auto copy = Make<Local>();
+        copy->names = local.names;
+        for (auto& value : local.values)
+            copy->values.push_back(Clone(*value));
+        return std::move(copy);
+    }
+    case Stmt::Kind::Assign:
+    {
+        auto& assign = cast<Assign>(stmt);
+        auto copy = Make<Assign>();
+        for (auto& target : assign.targets)
+            copy->targets.push_back(Clone(*target));
+        for (auto& value : assign.values)
+            copy->values.push_back(Clone(*value));
+        return std::move(copy);
+    }
+    case Stmt::Kind::CallStmt:
+        return Make<CallStmt>(Clone(*cast<CallStmt>(stmt).call));
+    case Stmt::Kind::Do:
+    {
+        auto copy = Make<Do>();
+        copy->body = Clone(cast<Do>(stmt).body);
+        return std::move(copy);
+    }
+    case Stmt::Kind::While:
+    {
+        auto& whileStmt = cast<While>(stmt);
+        auto copy = Make<While>(Clone(*whileStmt.cond));
+        copy->body = Clone(whileStmt.body);
+        return std::move(copy);
+    }
+    case Stmt::Kind::Repeat:
+    {
+        auto& repeat = cast<Repeat>(stmt);
+        auto copy = Make<Repeat>();
+        copy->body = Clone(repeat.body);
+        copy->cond = Clone(*repeat.cond);
+        return std::move(copy);
+    }
+    case Stmt::Kind::NumericFor:
+    {
+        auto& numericFor = cast<NumericFor>(stmt);
+        auto copy = Make<NumericFor>(numericFor.var);
+        copy->start = Clone(*numericFor.start);
+        copy->limit = Clone(*numericFor.limit);
+        if (numericFor.step)
+            copy->step = Clone(*numericFor.step);
+        copy->body = Clone(numericFor.body);
+        return std::move(copy);
+    }
+    case Stmt::Kind::If:
+    {
+        auto& ifStmt = cast<If>(stmt);
+        auto copy = Make<If>();
+        for (auto& clause : ifStmt.clauses)
+        {
+            IfClause clauseCopy;
+            clauseCopy.cond = Clone(*clause.cond);
+            clauseCopy.body = Clone(clause.body);
+            copy->clauses.push_back(std::move(clauseCopy));
+        }
+        copy->elseBody = Clone(ifStmt.elseBody);
+        return std::move(copy);
+    }
+    case Stmt::Kind::Return:
+    {
+        auto copy = Make<Return>();
+        for (auto& value : cast<Return>(stmt).values)
+            copy->values.push_back(Clone(*value));
+        return std::move(copy);
+    }
+    case Stmt::Kind::Break:
+        return Make<Break>();
+    case Stmt::Kind::Goto:
+        return Make<Goto>(cast<Goto>(stmt).label);
+    case Stmt::Kind::Label:
+        return Make<Label>(cast<Label>(stmt).name);
+    case Stmt::Kind::FunctionDecl:
+    {
+        auto& functionDecl = cast<FunctionDecl>(stmt);
+        auto copy = Make<FunctionDecl>(functionDecl.name);
+        copy->isLocal = functionDecl.isLocal;
+        copy->params = functionDecl.params;
+        copy->body = Clone(functionDecl.body);
+        return std::move(copy);
+    }
+    case Stmt::Kind::Comment:
+        return Make<Comment>(cast<Comment>(stmt).text);
+    case Stmt::Kind::Raw:
+        return Make<Raw>(cast<Raw>(stmt).text);
+    }
+    return Make<Comment>("");
+}
+
+} // namespace
+
+StmtPtr Clone(Stmt const& stmt)
+{
+    auto copy = CloneKind(stmt);
+    copy->line = stmt.line;
+    return copy;
+}
+
+Block Clone(Block const& block)
+{
+    Block copy;
+    for (auto& stmt : block.stmts)
+        copy.stmts.push_back(Clone(*stmt));
+    return copy;
+}
+
+void TreeTransform::TransformBlock(Block& block)
+{
+    for (auto& stmt : block.stmts)
+        TransformStmt(stmt);
+}
+
+void TreeTransform::TransformStmt(StmtPtr& stmt)
+{
+    if (auto local = dyn_cast<Local>(stmt.get()))
+    {
+        for (auto& value : local->values)
+            TransformExpr(value);
+    }
+    else if (auto assign = dyn_cast<Assign>(stmt.get()))
+    {
+        for (auto& target : assign->targets)
+            TransformExpr(target);
+        for (auto& value : assign->values)
+            TransformExpr(value);
+    }
+    else if (auto callStmt = dyn_cast<CallStmt>(stmt.get()))
+    {
+        TransformExpr(callStmt->call);
+    }
+    else if (auto doStmt = dyn_cast<Do>(stmt.get()))
+    {
+        TransformBlock(doStmt->body);
+    }
+    else if (auto whileStmt = dyn_cast<While>(stmt.get()))
+    {
+        TransformExpr(whileStmt->cond);
+        TransformBlock(whileStmt->body);
+    }
+    else if (auto repeat = dyn_cast<Repeat>(stmt.get()))
+    {
+        TransformBlock(repeat->body);
+        TransformExpr(repeat->cond);
+    }
+    else if (auto numericFor = dyn_cast<NumericFor>(stmt.get()))
+    {
+        TransformExpr(numericFor->start);
+        TransformExpr(numericFor->limit);
+        if (numericFor->step)
+            TransformExpr(numericFor->step);
+        TransformBlock(numericFor->body);
+    }
+    else if (auto ifStmt = dyn_cast<If>(stmt.get()))
+    {
+        for (auto& clause : ifStmt->clauses)
+        {
+            TransformExpr(clause.cond);
+            TransformBlock(clause.body);
+        }
+        TransformBlock(ifStmt->elseBody);
+    }
+    else if (auto returnStmt = dyn_cast<Return>(stmt.get()))
+    {
+        for (auto& value : returnStmt->values)
+            TransformExpr(value);
+    }
+    else if (auto functionDecl = dyn_cast<FunctionDecl>(stmt.get()))
+    {
+        TransformBlock(functionDecl->body);
+    }
+}
+
+void TreeTransform::TransformExpr(ExprPtr& expr)
+{
+    if (auto index = dyn_cast<Index>(expr.get()))
+    {
+        TransformExpr(index->object);
+        TransformExpr(index->key);
+    }
+    else if (auto call = dyn_cast<Call>(expr.get()))
+    {
+        TransformExpr(call->callee);
+        for (auto& arg : call->args)
+            TransformExpr(arg);
+    }
+    else if (auto function = dyn_cast<Function>(expr.get()))
+    {
+        TransformBlock(function->body);
+    }
+    else if (auto binary = dyn_cast<Binary>(expr.get()))
+    {
+        TransformExpr(binary->lhs);
+        TransformExpr(binary->rhs);
+    }
+    else if (auto unary = dyn_cast<Unary>(expr.get()))
+    {
+        TransformExpr(unary->operand);
+    }
+    else if (auto paren = dyn_cast<Paren>(expr.get()))
+    {
+        TransformExpr(paren->expr);
+    }
+    else if (auto table = dyn_cast<Table>(expr.get()))
+    {
+        for (auto& item : table->items)
+            TransformExpr(item);
+    }
+}
+
+} // namespace lua
@@ -0,0 +1,423 @@
+#pragma once
+
+#include "llvm/Support/Casting.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+// A minimal Lua syntax tree. DumpVisitor lowers the Clang AST into this,
+// passes rewrite it, and the Printer turns it back into source.
+namespace lua
+{
+
+template <typename T, typename... Args>
+std::unique_ptr<T> Make(Args&&... args)
+{
+    return std::unique_ptr<T>(new T(std::forward<Args>(args)...));
+}
+
+struct Expr;
+struct Stmt;
+
+typedef std::unique_ptr<Expr> ExprPtr;
+typedef std::unique_ptr<Stmt> StmtPtr;
+typedef std::vector<ExprPtr> ExprList;
+
+struct Block
+{
+    std::vector<StmtPtr> stmts;
+};
+
+//
+// Expressions
+//
+
+struct Expr
+{
+    enum class Kind
+    {
+        Nil,
+        Boolean,
+        Number,
+        String,
+        Name,
+        Index,
+        Call,
+        Function,
+        Binary,
+        Unary,
+        Paren,
+        Table
+    };
+
+    explicit Expr(Kind kind) : kind(kind) {}
+    virtual ~Expr() = default;
+
+    Kind const kind;
+};
+
+struct Nil : Expr
+{
+    Nil() : Expr(Kind::Nil) {}
+    static bool classof(Expr const* expr) { return expr->kind == Kind::Nil; }
+};
+
+struct Boolean : Expr
+{
+    explicit Boolean(bool value) : Expr(Kind::Boolean), value(value) {}
+    static bool classof(Expr const* expr) { return expr->kind == Kind::Boolean; }
+
+    bool value;
+};
+
+// Numbers are kept as their textual representation, exactly as they should
+// appear in the output.
+struct Number : Expr
+{
+    explicit Number(std::string text) : Expr(Kind::Number), text(std::move(text)) {}
+    static bool classof(Expr const* expr) { return expr->kind == Kind::Number; }
+
+    std::string text;
+};
+
+// Unescaped contents; the printer is responsible for quoting.
+struct String : Expr
+{
+    explicit String(std::string value) : Expr(Kind::String), value(std::move(value)) {}
+    static bool classof(Expr const* expr) { return expr->kind == Kind::String; }
+
+    std::string value;
+};
+
+struct Name : Expr
+{
+    explicit Name(std::string name) : Expr(Kind::Name), name(std::move(name)) {}
+    static bool classof(Expr const* expr) { return expr->kind == Kind::Name; }
+
+    std::string name;
+};
+
+// object[key]; printed as object.key when key is a string that is a valid identifier
+struct Index : Expr
+{
+    Index(ExprPtr object, ExprPtr key)
+        : Expr(Kind::Index), object(std::move(object)), key(std::move(key))
+    {
+    }
+    static bool classof(Expr const* expr) { return expr->kind == Kind::Index; }
+
+    ExprPtr object;
+    ExprPtr key;
+};
+
+struct Call : Expr
+{
+    Call(ExprPtr callee, ExprList args)
+        : Expr(Kind::Call), callee(std::move(callee)), args(std::move(args))
+    {
+    }
+    static bool classof(Expr const* expr) { return expr->kind == Kind::Call; }
+
+    ExprPtr callee;
+    ExprList args;
+};
+
+struct Function : Expr
+{
+    Function() : Expr(Kind::Function) {}
+    static bool classof(Expr const* expr) { return expr->kind == Kind::Function; }
+
+    std::vector<std::string> params;
+    Block body;
+};
+
+// The bitwise operators (BitOr to Shr) and IDiv need Lua 5.3
+enum class BinaryOp
+{
+    Or,
+    And,
+    Lt,
+    Gt,
+    Le,
+    Ge,
+    Ne,
+    Eq,
+    BitOr,
+    BitXor,
+    BitAnd,
+    Shl,
+    Shr,
+    Concat,
+    Add,
+    Sub,
+    Mul,
+    Div,
+    IDiv,
+    Mod,
+    Pow
+};
+
+struct Binary : Expr
+{
+    Binary(BinaryOp op, ExprPtr lhs, ExprPtr rhs)
+        : Expr(Kind::Binary), op(op), lhs(std::move(lhs)), rhs(std::move(rhs))
+    {
+    }
+    static bool classof(Expr const* expr) { return expr->kind == Kind::Binary; }
+
+    BinaryOp op;
+    ExprPtr lhs;
+    ExprPtr rhs;
+};
+
+// The bitwise operators need Lua 5.3
+enum class UnaryOp
+{
+    Neg,
+    Not,
+    Len,
+    BitNot
+};
+
+struct Unary : Expr
+{
+    Unary(UnaryOp op, ExprPtr operand) : Expr(Kind::Unary), op(op), operand(std::move(operand)) {}
+    static bool classof(Expr const* expr) { return expr->kind == Kind::Unary; }
+
+    UnaryOp op;
+    ExprPtr operand;
+};
+
+// Parentheses that were present in the C source. The printer adds any
+// further parentheses required by Lua's precedence rules on its own.
+struct Paren : Expr
+{
+    explicit Paren(ExprPtr expr) : Expr(Kind::Paren), expr(std::move(expr)) {}
+    static bool classof(Expr const* expr) { return expr->kind == Kind::Paren; }
+
+    ExprPtr expr;
+};
+
+// Table constructor: {a, b, c} when keys is empty, and {x = a, y = b, z = c}
+// (one key per item) otherwise
+struct Table : Expr
+{
+    Table() : Expr(Kind::Table) {}
+    static bool classof(Expr const* expr) { return expr->kind == Kind::Table; }
+
+    ExprList items;
+    std::vector<std::string> keys;
+};
+
+//
+// Statements
+//
+
+struct Stmt
+{
+    enum class Kind
+    {
+        Local,
+        Assign,
+        CallStmt,
+        Do,
+        While,
+        Repeat,
+        NumericFor,
+        If,
+        Return,
+        Break,
+        Goto,
+        Label,
+        FunctionDecl,
+        Comment,
+        Raw
+    };
+
+    explicit Stmt(Kind kind) : kind(kind) {}
+    virtual ~Stmt() = default;
+
+    Kind const kind;
+    // The line of the C source the statement was lowered from, or 0
+    uint32_t line = 0;
+};
+
+struct Local : Stmt
+{
+    Local() : Stmt(Kind::Local) {}
+    static bool classof(Stmt const* stmt) { return stmt->kind == Kind::Local; }
+
+    std::vector<std::string> names;
+    ExprList values;
+};
+
+struct Assign : Stmt
+{
+    Assign() : Stmt(Kind::Assign) {}
+    Assign(ExprPtr target, ExprPtr value) : Stmt(Kind::Assign)
+    {
+        targets.push_back(std::move(target));
+        values.push_back(std::move(value));
+    }
+    static bool classof(Stmt const* stmt) { return stmt->kind == Kind::Assign; }
+
+    ExprList targets;
+    ExprList values;
+};
+
+// A call evaluated for its side effects; call is always a Call
+struct CallStmt : Stmt
+{
+    explicit CallStmt(ExprPtr call) : Stmt(Kind::CallStmt), call(std::move(call)) {}
+    static bool classof(Stmt const* stmt) { return stmt->kind == Kind::CallStmt; }
+
+    ExprPtr call;
+};
+
+struct Do : Stmt
+{
+    Do() : Stmt(Kind::Do) {}
+    static bool classof(Stmt const* stmt) { return stmt->kind == Kind::Do; }
+
+    Block body;
+};
+
+struct While : Stmt
+{
+    explicit While(ExprPtr cond) : Stmt(Kind::While), cond(std::move(cond)) {}
+    static bool classof(Stmt const* stmt) { return stmt->kind == Kind::While; }
+
+    ExprPtr cond;
+    Block body;
+};
+
+// repeat body until cond
+struct Repeat : Stmt
+{
+    Repeat() : Stmt(Kind::Repeat) {}
+    static bool classof(Stmt const* stmt) { return stmt->kind == Kind::Repeat; }
+
+    Block body;
+    ExprPtr cond;
+};
+
+// for var = start, limit, step do body end; step is omitted when null
+struct NumericFor : Stmt
+{
+    explicit NumericFor(std::string var) : Stmt(Kind::NumericFor), var(std::move(var)) {}
+    static bool classof(Stmt const* stmt) { return stmt->kind == Kind::NumericFor; }
+
+    std::string var;
+    ExprPtr start;
+    ExprPtr limit;
+    ExprPtr step;
+    Block body;
+};
+
+struct IfClause
+{
+    ExprPtr cond;
+    Block body;
+};
+
+// if/elseif chain; the else block is omitted when empty
+struct If : Stmt
+{
+    If() : Stmt(Kind::If) {}
+    static bool classof(Stmt const* stmt) { return stmt->kind == Kind::If; }
+
+    std::vector<IfClause> clauses;
+    Block elseBody;
+};
+
+struct Return : Stmt
+{
+    Return() : Stmt(Kind::Return) {}
+    explicit Return(ExprPtr value) : Stmt(Kind::Return) { values.push_back(std::move(value)); }
+    static bool classof(Stmt const* stmt) { return stmt->kind == Kind::Return; }
+
+    ExprList values;
+};
+
+struct Break : Stmt
+{
+    Break() : Stmt(Kind::Break) {}
+    static bool classof(Stmt const* stmt) { return stmt->kind == Kind::Break; }
+};
+
+// goto label; requires Lua 5.2 or LuaJIT
+struct Goto : Stmt
+{
+    explicit Goto(std::string label) : Stmt(Kind::Goto), label(std::move(label)) {}
+    static bool classof(Stmt const* stmt) { return stmt->kind == Kind::Goto; }
+
+    std::string label;
+};
+
+// ::name::
+struct Label : Stmt
+{
+    explicit Label(std::string name) : Stmt(Kind::Label), name(std::move(name)) {}
+    static bool classof(Stmt const* stmt) { return stmt->kind == Kind::Label; }
+
+    std::string name;
+};
+
+// function name(params) body end
+struct FunctionDecl : Stmt
+{
+    explicit FunctionDecl(std::string name) : Stmt(Kind::FunctionDecl), name(std::move(name)) {}
+    static bool classof(Stmt const* stmt) { return stmt->kind == Kind::FunctionDecl; }
+
+    std::string name;
+    bool isLocal = false;
+    std::vector<std::string> params;
+    Block body;
+};
+
+// A single line comment, without the leading "--"
+struct Comment : Stmt
+{
+    explicit Comment(std::string text) : Stmt(Kind::Comment), text(std::move(text)) {}
+    static bool classof(Stmt const* stmt) { return stmt->kind == Kind::Comment; }
+
+    std::string text;
+};
+
+// Lua source that is emitted verbatim (e.g. baked shim files)
+struct Raw : Stmt
+{
+    explicit Raw(std::string text) : Stmt(Kind::Raw), text(std::move(text)) {}
+    static bool classof(Stmt const* stmt) { return stmt->kind == Kind::Raw; }
+
+    std::string text;
+};
+
+// True if expr can never evaluate to nil or false, e.g. a number or the
+// result of arithmetic
+bool IsAlwaysTruthy(Expr const& expr);
+
+// Builds `not expr` for use as a condition, folding it into expr where that
+// is exact (e.g. == to ~=)
+ExprPtr Negate(ExprPtr expr);
+
+ExprPtr Clone(Expr const& expr);
+StmtPtr Clone(Stmt const& stmt);
+Block Clone(Block const& block);
+
+// Walks a tree, allowing any node to be replaced in place. Passes override
+// the hooks they care about and call the base implementation to recurse.
+class TreeTransform
+{
+  public:
+    virtual ~TreeTransform() = default;
+
+    virtual void TransformBlock(Block& block);
+    virtual void TransformStmt(StmtPtr& stmt);
+    virtual void TransformExpr(ExprPtr& expr);
+};
+
+} // namespace lua
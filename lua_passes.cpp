@@ -0,0 +1,1571 @@
+#include "lua_passes.h"
+
+#include <algorithm>
+#include <cctype>
+#include <functional>
+#include <iterator>
+
+using llvm::dyn_cast;
+using llvm::isa;
+
+namespace lua
+{
+
+void PassManager::AddPass(std::unique_ptr<Pass> pass) { passes.push_back(std::move(pass)); }
+
+void PassManager::Run(Block& chunk)
+{
+    for (auto& pass : passes)
+        pass->Run(chunk);
+}
+
+namespace
+{
+
+// The global and member a use of a cached global reads, e.g. mem and
+// make_array; member is empty for a plain global
+struct GlobalUse
+{
+    std::string global;
+    std::string member;
+
+    std::string GetLocalName() const { return member.empty() ? global : global + "_" + member; }
+
+    bool operator<(GlobalUse const& other) const
+    {
+        return global != other.global ? global < other.global : member < other.member;
+    }
+};
+
+bool IsMemberName(std::string const& name)
+{
+    if (name.empty() || std::isdigit(static_cast<unsigned char>(name[0])))
+        return false;
+
+    for (auto c : name)
+    {
+        if (!std::isalnum(static_cast<unsigned char>(c)) && c != '_')
+            return false;
+    }
+    return true;
+}
+
+// Counts the uses of each global, and every name the chunk binds or assigns
+class CountGlobalUses : public TreeTransform
+{
+  public:
+    explicit CountGlobalUses(std::set<std::string> const& globals) : globals(globals) {}
+
+    virtual void TransformStmt(StmtPtr& stmt) override
+    {
+        if (auto local = dyn_cast<Local>(stmt.get()))
+            bound.insert(local->names.begin(), local->names.end());
+        else if (auto numericFor = dyn_cast<NumericFor>(stmt.get()))
+            bound.insert(numericFor->var);
+        else if (auto functionDecl = dyn_cast<FunctionDecl>(stmt.get()))
+        {
+            bound.insert(functionDecl->name);
+            bound.insert(functionDecl->params.begin(), functionDecl->params.end());
+        }
+        else if (auto assign = dyn_cast<Assign>(stmt.get()))
+        {
+            for (auto& target : assign->targets)
+            {
+                if (auto name = dyn_cast<Name>(target.get()))
+                    bound.insert(name->name);
+            }
+        }
+
+        TreeTransform::TransformStmt(stmt);
+    }
+
+    virtual void TransformExpr(ExprPtr& expr) override
+    {
+        if (auto name = dyn_cast<Name>(expr.get()))
+        {
+            names.insert(name->name);
+            if (globals.count(name->name))
+                ++uses[GlobalUse{name->name, ""}];
+            return;
+        }
+
+        if (auto index = dyn_cast<Index>(expr.get()))
+        {
+            auto object = dyn_cast<Name>(index->object.get());
+            auto key = dyn_cast<String>(index->key.get());
+            if (object && key && globals.count(object->name) && IsMemberName(key->value))
+            {
+                names.insert(object->name);
+                ++uses[GlobalUse{object->name, key->value}];
+                return;
+            }
+        }
+
+        if (auto function = dyn_cast<Function>(expr.get()))
+            bound.insert(function->params.begin(), function->params.end());
+
+        TreeTransform::TransformExpr(expr);
+    }
+
+    std::set<std::string> const& globals;
+    std::map<GlobalUse, size_t> uses;
+    std::set<std::string> names;
+    std::set<std::string> bound;
+};
+
+// Replaces reads of cached members with their locals
+class ReplaceMembers : public TreeTransform
+{
+  public:
+    explicit ReplaceMembers(std::set<GlobalUse> const& cached) : cached(cached) {}
+
+    virtual void TransformExpr(ExprPtr& expr) override
+    {
+        if (auto index = dyn_cast<Index>(expr.get()))
+        {
+            auto object = dyn_cast<Name>(index->object.get());
+            auto key = dyn_cast<String>(index->key.get());
+            if (object && key)
+            {
+                GlobalUse use{object->name, key->value};
+                if (cached.count(use))
+                {
+                    expr = Make<Name>(use.GetLocalName());
+                    return;
+                }
+            }
+        }
+
+        TreeTransform::TransformExpr(expr);
+    }
+
+    std::set<GlobalUse> const& cached;
+};
+
+// Adds a use of name, and of every table it's a member of: a.b.c also uses
+// a.b and a
+void AddUse(std::set<std::string>& uses, std::string const& name)
+{
+    uses.insert(name);
+    for (auto dot = name.rfind('.'); dot != std::string::npos && dot > 0; dot = name.rfind('.', dot - 1))
+        uses.insert(name.substr(0, dot));
+}
+
+// Collects every name a tree mentions, and the members of them it indexes
+// as name.member
+class CollectNames : public TreeTransform
+{
+  public:
+    virtual void TransformExpr(ExprPtr& expr) override
+    {
+        if (auto name = dyn_cast<Name>(expr.get()))
+            AddUse(names, name->name);
+
+        if (auto index = dyn_cast<Index>(expr.get()))
+        {
+            auto object = dyn_cast<Name>(index->object.get());
+            auto key = dyn_cast<String>(index->key.get());
+            if (object && key && IsMemberName(key->value))
+                AddUse(names, object->name + "." + key->value);
+        }
+
+        TreeTransform::TransformExpr(expr);
+    }
+
+    std::set<std::string> names;
+};
+
+// True if evaluating expr can't have any effect other than producing its
+// value. The shims' array constructors only allocate.
+bool IsPure(Expr const& expr)
+{
+    switch (expr.kind)
+    {
+    case Expr::Kind::Nil:
+    case Expr::Kind::Boolean:
+    case Expr::Kind::Number:
+    case Expr::Kind::String:
+    case Expr::Kind::Name:
+    case Expr::Kind::Function:
+        return true;
+    case Expr::Kind::Paren:
+        return IsPure(*llvm::cast<Paren>(expr).expr);
+    case Expr::Kind::Unary:
+        return IsPure(*llvm::cast<Unary>(expr).operand);
+    case Expr::Kind::Binary:
+    {
+        auto& binary = llvm::cast<Binary>(expr);
+        return IsPure(*binary.lhs) && IsPure(*binary.rhs);
+    }
+    case Expr::Kind::Table:
+        for (auto& item : llvm::cast<Table>(expr).items)
+        {
+            if (!IsPure(*item))
+                return false;
+        }
+        return true;
+    case Expr::Kind::Call:
+    {
+        auto& call = llvm::cast<Call>(expr);
+        auto index = dyn_cast<Index>(call.callee.get());
+        auto object = index ? dyn_cast<Name>(index->object.get()) : nullptr;
+        auto key = index ? dyn_cast<String>(index->key.get()) : nullptr;
+        if (!object || !key || (object->name != "mem" && object->name != "heap"))
+            return false;
+
+        auto& member = key->value;
+        bool allocates = member.size() > 6 && member.compare(member.size() - 6, 6, "_array") == 0;
+        if (!allocates && member != "make_array_of")
+            return false;
+
+        for (auto& arg : call.args)
+        {
+            if (!IsPure(*arg))
+                return false;
+        }
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+// The name stmt declares, if declaring it is all stmt does; otherwise empty
+std::string GetDeclaredName(Stmt const& stmt)
+{
+    if (auto functionDecl = dyn_cast<FunctionDecl>(&stmt))
+        return functionDecl->name;
+
+    if (auto assign = dyn_cast<Assign>(&stmt))
+    {
+        auto name = assign->targets.size() == 1 ? dyn_cast<Name>(assign->targets[0].get()) : nullptr;
+        if (name && assign->values.size() == 1 && IsPure(*assign->values[0]))
+            return name->name;
+    }
+
+    if (auto local = dyn_cast<Local>(&stmt))
+    {
+        if (local->names.size() == 1 && local->values.size() == 1 && IsPure(*local->values[0]))
+            return local->names[0];
+    }
+
+    return "";
+}
+
+// A top-level statement of a shim file, with the comments and blank lines
+// above it
+struct ShimSection
+{
+    std::string text;
+    std::string defines; // Empty unless it's a definition
+    std::set<std::string> uses;
+    bool isKept = false;
+};
+
+bool StartsWithWord(std::string const& line, std::string const& word)
+{
+    if (line.compare(0, word.size(), word) != 0)
+        return false;
+
+    return line.size() == word.size() || !IsMemberName(line.substr(word.size(), 1));
+}
+
+// True if line continues the statement above it
+bool IsContinuation(std::string const& line)
+{
+    if (line[0] == ' ' || line[0] == '\t' || line[0] == '}' || line[0] == ')')
+        return true;
+
+    return StartsWithWord(line, "end") || StartsWithWord(line, "else") || StartsWithWord(line, "elseif") ||
+           StartsWithWord(line, "until");
+}
+
+// Reads a name such as a or a.b at position, advancing past it
+std::string ReadDottedName(std::string const& text, size_t& position)
+{
+    auto start = position;
+    while (position < text.size())
+    {
+        auto c = static_cast<unsigned char>(text[position]);
+        if (std::isalnum(c) || c == '_')
+            ++position;
+        else if (c == '.' && position > start && position + 1 < text.size() &&
+                 IsMemberName(text.substr(position + 1, 1)))
+            ++position;
+        else
+            break;
+    }
+    return text.substr(start, position - start);
+}
+
+// The global that the first line of a statement defines: the name in
+// `function name(` or `name = value`
+std::string GetShimDefinition(std::string const& line)
+{
+    size_t position = 0;
+    if (StartsWithWord(line, "function"))
+    {
+        position = line.find_first_not_of(' ', 8);
+        if (position == std::string::npos)
+            return "";
+
+        auto name = ReadDottedName(line, position);
+        return position < line.size() && line[position] == '(' ? name : "";
+    }
+
+    if (!IsMemberName(line.substr(0, 1)) || StartsWithWord(line, "local"))
+        return "";
+
+    auto name = ReadDottedName(line, position);
+    position = line.find_first_not_of(' ', position);
+    if (position == std::string::npos || line[position] != '=' || line.compare(position, 2, "==") == 0)
+        return "";
+    return name;
+}
+
+// Every name mentioned in code, other than in comments
+std::set<std::string> FindShimNames(std::string const& code)
+{
+    std::set<std::string> names;
+    char quote = 0;
+    for (size_t position = 0; position < code.size();)
+    {
+        auto c = code[position];
+        if (quote)
+        {
+            if (c == '\\')
+                ++position;
+            else if (c == quote || c == '\n')
+                quote = 0;
+            ++position;
+        }
+        else if (c == '"' || c == '\'')
+        {
+            quote = c;
+            ++position;
+        }
+        else if (code.compare(position, 2, "--") == 0)
+        {
+            position = code.find('\n', position);
+        }
+        else if (IsMemberName(std::string(1, c)))
+        {
+            AddUse(names, ReadDottedName(code, position));
+        }
+        else
+        {
+            ++position;
+        }
+    }
+    return names;
+}
+
+std::vector<ShimSection> SplitShim(std::string const& text)
+{
+    std::vector<ShimSection> sections;
+
+    // Comments and blank lines, until the statement they precede
+    std::string pending;
+    for (size_t start = 0; start < text.size();)
+    {
+        auto end = text.find('\n', start);
+        end = end == std::string::npos ? text.size() : end + 1;
+        auto line = text.substr(start, end - start);
+        start = end;
+
+        if (line.find_first_not_of(" \t\r\n") == std::string::npos || line.compare(0, 2, "--") == 0)
+        {
+            pending += line;
+            continue;
+        }
+
+        if (IsContinuation(line) && !sections.empty())
+        {
+            sections.back().text += pending + line;
+        }
+        else
+        {
+            ShimSection section;
+            section.text = pending + line;
+            section.defines = GetShimDefinition(line);
+            sections.push_back(std::move(section));
+        }
+        pending.clear();
+    }
+
+    if (!pending.empty())
+    {
+        ShimSection section;
+        section.text = pending;
+        sections.push_back(std::move(section));
+    }
+
+    for (auto& section : sections)
+        section.uses = FindShimNames(section.text);
+    return sections;
+}
+
+// Counts the statements and expressions in a tree
+class CountNodes : public TreeTransform
+{
+  public:
+    virtual void TransformStmt(StmtPtr& stmt) override
+    {
+        ++count;
+        TreeTransform::TransformStmt(stmt);
+    }
+
+    virtual void TransformExpr(ExprPtr& expr) override
+    {
+        ++count;
+        TreeTransform::TransformExpr(expr);
+    }
+
+    size_t count = 0;
+};
+
+// Finds the statements that stop a function body being copied into another
+// function: gotos and labels, which could clash with the caller's, and
+// function declarations
+class FindUninlinable : public TreeTransform
+{
+  public:
+    virtual void TransformStmt(StmtPtr& stmt) override
+    {
+        if (isa<Goto>(stmt.get()) || isa<Label>(stmt.get()) || isa<FunctionDecl>(stmt.get()))
+            found = true;
+        else
+            TreeTransform::TransformStmt(stmt);
+    }
+
+    bool found = false;
+};
+
+// Finds the returns in a tree, other than those of the functions in it
+class FindReturns : public TreeTransform
+{
+  public:
+    virtual void TransformStmt(StmtPtr& stmt) override
+    {
+        if (isa<Return>(stmt.get()))
+            found = true;
+        else
+            TreeTransform::TransformStmt(stmt);
+    }
+
+    virtual void TransformExpr(ExprPtr& expr) override
+    {
+        if (!isa<Function>(expr.get()))
+            TreeTransform::TransformExpr(expr);
+    }
+
+    bool found = false;
+};
+
+// Finds the expressions of a kind in a tree, other than in the bodies of the
+// functions in it
+class FindExprs : public TreeTransform
+{
+  public:
+    explicit FindExprs(Expr::Kind kind) : kind(kind) {}
+
+    virtual void TransformExpr(ExprPtr& expr) override
+    {
+        if (expr->kind == kind)
+            found = true;
+        else if (!isa<Function>(expr.get()))
+            TreeTransform::TransformExpr(expr);
+    }
+
+    Expr::Kind kind;
+    bool found = false;
+};
+
+bool ContainsReturn(StmtPtr& stmt)
+{
+    FindReturns finder;
+    finder.TransformStmt(stmt);
+    return finder.found;
+}
+
+bool ContainsCall(ExprPtr& expr)
+{
+    FindExprs finder(Expr::Kind::Call);
+    finder.TransformExpr(expr);
+    return finder.found;
+}
+
+// Calls visit on each expression of a statement, innermost first, other
+// than those in its nested blocks and the bodies of functions
+class ForEachExpr : public TreeTransform
+{
+  public:
+    explicit ForEachExpr(std::function<void(ExprPtr&)> visit) : visit(std::move(visit)) {}
+
+    virtual void TransformBlock(Block&) override {}
+
+    virtual void TransformExpr(ExprPtr& expr) override
+    {
+        if (!isa<Function>(expr.get()))
+            TreeTransform::TransformExpr(expr);
+        visit(expr);
+    }
+
+  private:
+    std::function<void(ExprPtr&)> visit;
+};
+
+// Collects the names a tree declares: its locals, loop variables and the
+// parameters of the functions in it
+class CollectBoundNames : public TreeTransform
+{
+  public:
+    virtual void TransformStmt(StmtPtr& stmt) override
+    {
+        if (auto local = dyn_cast<Local>(stmt.get()))
+            names.insert(local->names.begin(), local->names.end());
+        else if (auto numericFor = dyn_cast<NumericFor>(stmt.get()))
+            names.insert(numericFor->var);
+
+        TreeTransform::TransformStmt(stmt);
+    }
+
+    virtual void TransformExpr(ExprPtr& expr) override
+    {
+        if (auto function = dyn_cast<Function>(expr.get()))
+            names.insert(function->params.begin(), function->params.end());
+
+        TreeTransform::TransformExpr(expr);
+    }
+
+    std::set<std::string> names;
+};
+
+// Counts the uses of each name, and how many of them are calls to it
+class CountNameUses : public TreeTransform
+{
+  public:
+    virtual void TransformExpr(ExprPtr& expr) override
+    {
+        if (auto name = dyn_cast<Name>(expr.get()))
+            ++uses[name->name];
+        else if (auto call = dyn_cast<Call>(expr.get()))
+        {
+            if (auto callee = dyn_cast<Name>(call->callee.get()))
+                ++calls[callee->name];
+        }
+
+        TreeTransform::TransformExpr(expr);
+    }
+
+    std::map<std::string, size_t> uses;
+    std::map<std::string, size_t> calls;
+};
+
+// Gives the locals a function body declares, starting with its parameters,
+// unique names by adding prefix to them, and collects the names it uses
+// without declaring them
+class RenameLocals : public TreeTransform
+{
+  public:
+    explicit RenameLocals(std::string prefix) : prefix(std::move(prefix)) { scopes.emplace_back(); }
+
+    std::string Declare(std::string const& name)
+    {
+        auto renamed = prefix + name;
+        scopes.back()[name] = renamed;
+        return renamed;
+    }
+
+    virtual void TransformBlock(Block& block) override
+    {
+        scopes.emplace_back();
+        TreeTransform::TransformBlock(block);
+        scopes.pop_back();
+    }
+
+    virtual void TransformStmt(StmtPtr& stmt) override
+    {
+        if (auto local = dyn_cast<Local>(stmt.get()))
+        {
+            for (auto& value : local->values)
+                TransformExpr(value);
+            for (auto& name : local->names)
+                name = Declare(name);
+        }
+        else if (auto repeat = dyn_cast<Repeat>(stmt.get()))
+        {
+            // The condition is in the scope of the body's locals
+            scopes.emplace_back();
+            for (auto& bodyStmt : repeat->body.stmts)
+                TransformStmt(bodyStmt);
+            TransformExpr(repeat->cond);
+            scopes.pop_back();
+        }
+        else if (auto numericFor = dyn_cast<NumericFor>(stmt.get()))
+        {
+            TransformExpr(numericFor->start);
+            TransformExpr(numericFor->limit);
+            if (numericFor->step)
+                TransformExpr(numericFor->step);
+
+            scopes.emplace_back();
+            numericFor->var = Declare(numericFor->var);
+            TransformBlock(numericFor->body);
+            scopes.pop_back();
+        }
+        else
+        {
+            TreeTransform::TransformStmt(stmt);
+        }
+    }
+
+    virtual void TransformExpr(ExprPtr& expr) override
+    {
+        if (auto name = dyn_cast<Name>(expr.get()))
+        {
+            for (auto scope = scopes.rbegin(); scope != scopes.rend(); ++scope)
+            {
+                auto it = scope->find(name->name);
+                if (it != scope->end())
+                {
+                    name->name = it->second;
+                    return;
+                }
+            }
+            freeNames.insert(name->name);
+        }
+        else if (auto function = dyn_cast<Function>(expr.get()))
+        {
+            scopes.emplace_back();
+            for (auto& param : function->params)
+                param = Declare(param);
+            TransformBlock(function->body);
+            scopes.pop_back();
+        }
+        else
+        {
+            TreeTransform::TransformExpr(expr);
+        }
+    }
+
+    std::set<std::string> freeNames;
+
+  private:
+    std::string prefix;
+    std::vector<std::map<std::string, std::string>> scopes;
+};
+
+// Replaces the parameters of a function in an expression with the
+// arguments of a call to it
+class ReplaceParams : public TreeTransform
+{
+  public:
+    ReplaceParams(std::vector<std::string> const& params, ExprList const& args)
+        : params(params), args(args)
+    {
+    }
+
+    virtual void TransformExpr(ExprPtr& expr) override
+    {
+        if (auto name = dyn_cast<Name>(expr.get()))
+        {
+            auto it = std::find(params.begin(), params.end(), name->name);
+            if (it != params.end())
+                expr = Clone(*args[it - params.begin()]);
+            return;
+        }
+
+        TreeTransform::TransformExpr(expr);
+    }
+
+  private:
+    std::vector<std::string> const& params;
+    ExprList const& args;
+};
+
+// Counts the uses of name in expr, and how many of them are evaluated
+// whenever expr is, rather than behind an and or an or
+void CountUsesOf(Expr const& expr, std::string const& name, bool isConditional, size_t& uses,
+                 size_t& unconditionalUses)
+{
+    auto count = [&](ExprPtr const& child, bool isChildConditional) {
+        CountUsesOf(*child, name, isConditional || isChildConditional, uses, unconditionalUses);
+    };
+
+    if (auto nameExpr = dyn_cast<Name>(&expr))
+    {
+        if (nameExpr->name == name)
+        {
+            ++uses;
+            if (!isConditional)
+                ++unconditionalUses;
+        }
+    }
+    else if (auto index = dyn_cast<Index>(&expr))
+    {
+        count(index->object, false);
+        count(index->key, false);
+    }
+    else if (auto call = dyn_cast<Call>(&expr))
+    {
+        count(call->callee, false);
+        for (auto& arg : call->args)
+            count(arg, false);
+    }
+    else if (auto binary = dyn_cast<Binary>(&expr))
+    {
+        count(binary->lhs, false);
+        count(binary->rhs, binary->op == BinaryOp::And || binary->op == BinaryOp::Or);
+    }
+    else if (auto unary = dyn_cast<Unary>(&expr))
+    {
+        count(unary->operand, false);
+    }
+    else if (auto paren = dyn_cast<Paren>(&expr))
+    {
+        count(paren->expr, false);
+    }
+    else if (auto table = dyn_cast<Table>(&expr))
+    {
+        for (auto& item : table->items)
+            count(item, false);
+    }
+}
+
+// True if every way through block ends in a return
+bool AlwaysReturns(Block const& block)
+{
+    if (block.stmts.empty())
+        return false;
+
+    auto last = block.stmts.back().get();
+    if (isa<Return>(last))
+        return true;
+    if (auto doStmt = dyn_cast<Do>(last))
+        return AlwaysReturns(doStmt->body);
+    if (auto ifStmt = dyn_cast<If>(last))
+    {
+        for (auto& clause : ifStmt->clauses)
+        {
+            if (!AlwaysReturns(clause.body))
+                return false;
+        }
+        return AlwaysReturns(ifStmt->elseBody);
+    }
+    return false;
+}
+
+// Rewrites a function body to only return from its end: from its last
+// statement, or the ends of the ifs and do blocks that end it. An if whose
+// every clause returns takes the statements after it as its else, so `if c
+// then return a end; rest` becomes `if c then return a else rest end`.
+// Returns false if that isn't possible, e.g. for a return from a loop, or
+// one with more than one value.
+bool MoveReturnsToTail(Block& block)
+{
+    for (size_t i = 0; i < block.stmts.size(); ++i)
+    {
+        auto& stmt = block.stmts[i];
+        bool isLast = i + 1 == block.stmts.size();
+        if (auto ifStmt = dyn_cast<If>(stmt.get()))
+        {
+            if (!isLast && ContainsReturn(stmt))
+            {
+                for (auto& clause : ifStmt->clauses)
+                {
+                    if (!AlwaysReturns(clause.body))
+                        return false;
+                }
+
+                // Anything after an else that returns is unreachable
+                auto rest = block.stmts.begin() + i + 1;
+                if (!AlwaysReturns(ifStmt->elseBody))
+                    std::move(rest, block.stmts.end(), std::back_inserter(ifStmt->elseBody.stmts));
+                block.stmts.erase(rest, block.stmts.end());
+                isLast = true;
+            }
+
+            if (isLast)
+            {
+                for (auto& clause : ifStmt->clauses)
+                {
+                    if (!MoveReturnsToTail(clause.body))
+                        return false;
+                }
+                if (!MoveReturnsToTail(ifStmt->elseBody))
+                    return false;
+
+                // An else that's only an if continues the chain as elseifs
+                auto& elseStmts = ifStmt->elseBody.stmts;
+                if (elseStmts.size() == 1 && isa<If>(elseStmts[0].get()))
+                {
+                    auto nested = std::move(elseStmts[0]);
+                    auto& nestedIf = llvm::cast<If>(*nested);
+                    std::move(nestedIf.clauses.begin(), nestedIf.clauses.end(),
+                              std::back_inserter(ifStmt->clauses));
+                    ifStmt->elseBody = std::move(nestedIf.elseBody);
+                }
+                return true;
+            }
+        }
+
+        if (isLast)
+        {
+            if (auto doStmt = dyn_cast<Do>(stmt.get()))
+                return MoveReturnsToTail(doStmt->body);
+            if (auto returnStmt = dyn_cast<Return>(stmt.get()))
+                return returnStmt->values.size() <= 1;
+        }
+
+        if (ContainsReturn(stmt))
+            return false;
+    }
+    return true;
+}
+
+// Replaces the returns at the end of a body MoveReturnsToTail has rewritten
+// with assignments of their value to target, or if target is null, with
+// statements that evaluate it, if that has any effect
+void ReplaceTailReturns(Block& block, Expr const* target)
+{
+    if (block.stmts.empty())
+        return;
+
+    auto& last = block.stmts.back();
+    if (auto ifStmt = dyn_cast<If>(last.get()))
+    {
+        for (auto& clause : ifStmt->clauses)
+            ReplaceTailReturns(clause.body, target);
+        ReplaceTailReturns(ifStmt->elseBody, target);
+    }
+    else if (auto doStmt = dyn_cast<Do>(last.get()))
+    {
+        ReplaceTailReturns(doStmt->body, target);
+    }
+    else if (auto returnStmt = dyn_cast<Return>(last.get()))
+    {
+        if (returnStmt->values.empty())
+        {
+            block.stmts.pop_back();
+            return;
+        }
+
+        auto line = returnStmt->line;
+        auto value = std::move(returnStmt->values[0]);
+        if (target)
+        {
+            last = Make<Assign>(Clone(*target), std::move(value));
+        }
+        else if (isa<Call>(value.get()))
+        {
+            last = Make<CallStmt>(std::move(value));
+        }
+        else if (ContainsCall(value))
+        {
+            auto local = Make<Local>();
+            local->names.push_back("_");
+            local->values.push_back(std::move(value));
+            last = std::move(local);
+        }
+        else
+        {
+            block.stmts.pop_back();
+            return;
+        }
+        last->line = line;
+    }
+}
+
+// A function whose calls can be replaced with its body
+struct InlineCandidate
+{
+    std::vector<std::string> params;
+    // The body, rewritten by MoveReturnsToTail
+    Block body;
+    // The expression returned, if returning it is all the body does
+    Expr const* value = nullptr;
+    // The names the body uses without declaring them
+    std::set<std::string> freeNames;
+    bool hasCall = false;
+    // The index of the function's declaration in the chunk
+    size_t position = 0;
+};
+
+// The temporaries a function can be given for the results of calls hoisted
+// out of expressions; Lua allows 200 locals per function
+size_t const maxInlineTemps = 32;
+
+// Does the work of InlineFunctions on a chunk
+class Inliner
+{
+  public:
+    Inliner(Block& chunk, std::set<std::string> const& exported, size_t maxSize)
+        : chunk(chunk), maxSize(maxSize)
+    {
+        for (size_t i = 0; i < chunk.stmts.size(); ++i)
+        {
+            if (auto functionDecl = dyn_cast<FunctionDecl>(chunk.stmts[i].get()))
+            {
+                auto function = std::make_pair(functionDecl->name, std::make_pair(functionDecl, i));
+                if (!functions.insert(function).second)
+                    redeclared.insert(functionDecl->name);
+            }
+            else if (auto local = dyn_cast<Local>(chunk.stmts[i].get()))
+            {
+                for (auto& name : local->names)
+                    topLevelLocals[name].push_back(i);
+            }
+        }
+
+        CountNameUses counter;
+        counter.TransformBlock(chunk);
+        for (auto& function : functions)
+        {
+            auto& name = function.first;
+            if (!exported.count(name) && counter.uses[name] == 1 && counter.calls[name] == 1)
+                calledOnce.insert(name);
+        }
+    }
+
+    // Inlines into each function in the order they're declared, so a
+    // function is inlined as it is once the calls in it have been
+    void Run()
+    {
+        size_t position = 0;
+        for (size_t i = 0; i < chunk.stmts.size(); ++i, ++position)
+        {
+            callerPosition = position;
+            CollectBoundNames bound;
+            bound.TransformStmt(chunk.stmts[i]);
+            callerBound = std::move(bound.names);
+
+            if (auto functionDecl = dyn_cast<FunctionDecl>(chunk.stmts[i].get()))
+            {
+                callerBound.insert(functionDecl->params.begin(), functionDecl->params.end());
+                tempsLeft = maxInlineTemps;
+                InlineBlock(functionDecl->body);
+                candidates.erase(functionDecl->name);
+            }
+            else
+            {
+                // Temporaries would be globals, or locals of the chunk
+                tempsLeft = 0;
+                i = InlineStmt(chunk, i);
+            }
+        }
+    }
+
+  private:
+    void InlineBlock(Block& block)
+    {
+        for (size_t i = 0; i < block.stmts.size(); ++i)
+            i = InlineStmt(block, i);
+    }
+
+    // Inlines the calls in the statement at i, returning the index of the
+    // last statement it became
+    size_t InlineStmt(Block& block, size_t i)
+    {
+        ForEachExpr visitor([this](ExprPtr& expr) {
+            if (auto function = dyn_cast<Function>(expr.get()))
+                InlineBlock(function->body);
+            else if (isa<Call>(expr.get()))
+                SubstituteCall(expr);
+        });
+        visitor.TransformStmt(block.stmts[i]);
+
+        // A goto mustn't jump into the scope of a temporary
+        bool canHoist = true;
+        for (size_t j = i + 1; j < block.stmts.size(); ++j)
+        {
+            if (isa<Label>(block.stmts[j].get()))
+                canHoist = false;
+        }
+
+        // A call whose result is discarded and that was replaced with an
+        // expression, e.g. add(1, 2), isn't a statement any more: only the
+        // calls in the expression need to be kept
+        if (auto callStmt = dyn_cast<CallStmt>(block.stmts[i].get()))
+        {
+            if (!isa<Call>(callStmt->call.get()))
+            {
+                if (!ContainsCall(callStmt->call))
+                {
+                    // The caller's increment undoes the wrap when i is 0
+                    block.stmts.erase(block.stmts.begin() + i);
+                    return i - 1;
+                }
+
+                auto line = callStmt->line;
+                auto local = Make<Local>();
+                local->names.push_back("_");
+                local->values.push_back(std::move(callStmt->call));
+                local->line = line;
+                if (canHoist)
+                {
+                    block.stmts[i] = std::move(local);
+                }
+                else
+                {
+                    auto doStmt = Make<Do>();
+                    doStmt->body.stmts.push_back(std::move(local));
+                    doStmt->line = line;
+                    block.stmts[i] = std::move(doStmt);
+                }
+                return i;
+            }
+        }
+
+        // The expressions evaluated once, before anything else the statement
+        // does, and the one whose value the whole statement uses
+        std::vector<ExprPtr*> slots;
+        ExprPtr* root = nullptr;
+        auto stmt = block.stmts[i].get();
+        if (auto local = dyn_cast<Local>(stmt))
+        {
+            if (local->values.size() == 1)
+            {
+                slots.push_back(&local->values[0]);
+
+                // The expansion declares the local first, so in local x =
+                // f(x) the argument would read the new x
+                CollectNames names;
+                names.TransformExpr(local->values[0]);
+                if (local->names.size() == 1 && !names.names.count(local->names[0]))
+                    root = slots.back();
+            }
+        }
+        else if (auto assign = dyn_cast<Assign>(stmt))
+        {
+            if (assign->values.size() == 1 && assign->targets.size() == 1)
+                root = &assign->values[0];
+            if (assign->values.size() == 1)
+                slots.push_back(&assign->values[0]);
+        }
+        else if (auto callStmt = dyn_cast<CallStmt>(stmt))
+        {
+            slots.push_back(&callStmt->call);
+            root = slots.back();
+        }
+        else if (auto returnStmt = dyn_cast<Return>(stmt))
+        {
+            if (returnStmt->values.size() == 1)
+            {
+                slots.push_back(&returnStmt->values[0]);
+                root = slots.back();
+            }
+        }
+        else if (auto ifStmt = dyn_cast<If>(stmt))
+        {
+            slots.push_back(&ifStmt->clauses[0].cond);
+        }
+        else if (auto numericFor = dyn_cast<NumericFor>(stmt))
+        {
+            slots.push_back(&numericFor->start);
+            slots.push_back(&numericFor->limit);
+            if (numericFor->step)
+                slots.push_back(&numericFor->step);
+        }
+
+        auto line = stmt->line;
+        for (auto slot : slots)
+        {
+            while (auto found = FindCall(*slot, root, canHoist && tempsLeft > 0))
+            {
+                auto& call = llvm::cast<Call>(**found);
+                auto& candidate = *GetCallee(call);
+                if (found != root)
+                {
+                    auto temp = "_inl" + std::to_string(++counter);
+                    auto local = Make<Local>();
+                    local->names.push_back(temp);
+                    local->line = line;
+                    Name target(temp);
+                    auto expansion = Expand(call, candidate, &target, false, line);
+                    *found = Make<Name>(temp);
+                    --tempsLeft;
+
+                    block.stmts.insert(block.stmts.begin() + i, std::move(local));
+                    block.stmts.insert(block.stmts.begin() + i + 1, std::move(expansion));
+                    i += 2;
+                    continue;
+                }
+
+                if (auto local = dyn_cast<Local>(stmt))
+                {
+                    // local x = f(a) becomes local x; do ... x = v end
+                    Name target(local->names[0]);
+                    auto expansion = Expand(call, candidate, &target, false, line);
+                    local->values.clear();
+                    block.stmts.insert(block.stmts.begin() + i + 1, std::move(expansion));
+                    return i + 1;
+                }
+
+                StmtPtr expansion;
+                if (auto assign = dyn_cast<Assign>(stmt))
+                    expansion = Expand(call, candidate, assign->targets[0].get(), false, line);
+                else
+                    expansion = Expand(call, candidate, nullptr, isa<Return>(stmt), line);
+                block.stmts[i] = std::move(expansion);
+                return i;
+            }
+        }
+
+        InlineNestedBlocks(*block.stmts[i]);
+        return i;
+    }
+
+    void InlineNestedBlocks(Stmt& stmt)
+    {
+        if (auto doStmt = dyn_cast<Do>(&stmt))
+            InlineBlock(doStmt->body);
+        else if (auto whileStmt = dyn_cast<While>(&stmt))
+            InlineBlock(whileStmt->body);
+        else if (auto repeat = dyn_cast<Repeat>(&stmt))
+            InlineBlock(repeat->body);
+        else if (auto numericFor = dyn_cast<NumericFor>(&stmt))
+            InlineBlock(numericFor->body);
+        else if (auto ifStmt = dyn_cast<If>(&stmt))
+        {
+            for (auto& clause : ifStmt->clauses)
+                InlineBlock(clause.body);
+            InlineBlock(ifStmt->elseBody);
+        }
+    }
+
+    // The first call in expr, innermost first, that can be inlined and that
+    // is evaluated whenever expr is. Calls other than root need a temporary.
+    ExprPtr* FindCall(ExprPtr& expr, ExprPtr* root, bool canUseTemp)
+    {
+        ExprPtr* found = nullptr;
+        auto find = [&](ExprPtr& child) {
+            if (!found)
+                found = FindCall(child, root, canUseTemp);
+        };
+
+        if (auto index = dyn_cast<Index>(expr.get()))
+        {
+            find(index->object);
+            find(index->key);
+        }
+        else if (auto call = dyn_cast<Call>(expr.get()))
+        {
+            find(call->callee);
+            for (auto& arg : call->args)
+                find(arg);
+            if (!found && (&expr == root || canUseTemp) && GetCallee(*call))
+                found = &expr;
+        }
+        else if (auto binary = dyn_cast<Binary>(expr.get()))
+        {
+            find(binary->lhs);
+            if (binary->op != BinaryOp::And && binary->op != BinaryOp::Or)
+                find(binary->rhs);
+        }
+        else if (auto unary = dyn_cast<Unary>(expr.get()))
+        {
+            find(unary->operand);
+        }
+        else if (auto paren = dyn_cast<Paren>(expr.get()))
+        {
+            find(paren->expr);
+        }
+        else if (auto table = dyn_cast<Table>(expr.get()))
+        {
+            for (auto& item : table->items)
+                find(item);
+        }
+        return found;
+    }
+
+    // Builds `do local params = args; body end` for a call, with the body's
+    // returns replaced by assignments to target, or by evaluating their
+    // value if target is null; with keepReturns, they're left as they are
+    StmtPtr Expand(Call& call, InlineCandidate const& candidate, Expr const* target,
+                   bool keepReturns, uint32_t line)
+    {
+        RenameLocals renamer("_inl" + std::to_string(++counter) + "_");
+        auto expansion = Make<Do>();
+        expansion->line = line;
+        if (!candidate.params.empty())
+        {
+            auto params = Make<Local>();
+            for (auto& param : candidate.params)
+                params->names.push_back(renamer.Declare(param));
+            params->values = std::move(call.args);
+            params->line = line;
+            expansion->body.stmts.push_back(std::move(params));
+        }
+
+        auto body = Clone(candidate.body);
+        renamer.TransformBlock(body);
+        if (!keepReturns)
+            ReplaceTailReturns(body, target);
+        else if (!AlwaysReturns(body))
+            body.stmts.push_back(Make<Return>());
+
+        for (auto& stmt : body.stmts)
+            expansion->body.stmts.push_back(std::move(stmt));
+        return std::move(expansion);
+    }
+
+    // Replaces a call to a function that only returns an expression with
+    // that expression, if evaluating it in place of the call is exact: each
+    // argument must be a constant or a variable, or be used at most once,
+    // and then only if it would be evaluated before anything the body calls
+    void SubstituteCall(ExprPtr& expr)
+    {
+        auto& call = llvm::cast<Call>(*expr);
+        auto candidate = GetCallee(call);
+        if (!candidate || !candidate->value)
+            return;
+
+        for (size_t i = 0; i < call.args.size(); ++i)
+        {
+            auto arg = call.args[i].get();
+            if (isa<Nil>(arg) || isa<Boolean>(arg) || isa<Number>(arg) || isa<String>(arg))
+                continue;
+
+            // Only the caller itself can assign its locals
+            auto name = dyn_cast<Name>(arg);
+            if (name && (!candidate->hasCall || callerBound.count(name->name)))
+                continue;
+            if (candidate->hasCall)
+                return;
+
+            size_t uses = 0, unconditionalUses = 0;
+            CountUsesOf(*candidate->value, candidate->params[i], false, uses, unconditionalUses);
+            if (ContainsCall(call.args[i]) ? uses != 1 || unconditionalUses != 1 : uses > 1)
+                return;
+        }
+
+        auto value = Clone(*candidate->value);
+        ReplaceParams replacer(candidate->params, call.args);
+        replacer.TransformExpr(value);
+        expr = std::move(value);
+    }
+
+    // The function call calls, if it can be inlined there
+    InlineCandidate const* GetCallee(Call const& call)
+    {
+        auto name = dyn_cast<Name>(call.callee.get());
+        auto candidate = name ? GetCandidate(name->name) : nullptr;
+        if (!candidate || candidate->params.size() != call.args.size())
+            return nullptr;
+
+        // Each name the body uses has to mean the same at the call
+        for (auto& freeName : candidate->freeNames)
+        {
+            if (callerBound.count(freeName) ||
+                GetVisibleLocal(freeName, candidate->position) !=
+                    GetVisibleLocal(freeName, callerPosition))
+                return nullptr;
+        }
+        return candidate;
+    }
+
+    InlineCandidate const* GetCandidate(std::string const& name)
+    {
+        auto it = candidates.find(name);
+        if (it == candidates.end())
+            it = candidates.insert(std::make_pair(name, MakeCandidate(name))).first;
+        return it->second.get();
+    }
+
+    std::unique_ptr<InlineCandidate> MakeCandidate(std::string const& name)
+    {
+        // main is only called once, by the chunk
+        auto it = functions.find(name);
+        if (it == functions.end() || redeclared.count(name) || name == "main")
+            return nullptr;
+
+        auto& functionDecl = *it->second.first;
+        auto& params = functionDecl.params;
+        if (std::find(params.begin(), params.end(), "...") != params.end())
+            return nullptr;
+
+        CollectNames names;
+        names.TransformBlock(functionDecl.body);
+        FindUninlinable finder;
+        finder.TransformBlock(functionDecl.body);
+        if (names.names.count(name) || finder.found)
+            return nullptr;
+
+        CountNodes counter;
+        counter.TransformBlock(functionDecl.body);
+        if (counter.count > maxSize && !calledOnce.count(name))
+            return nullptr;
+
+        std::unique_ptr<InlineCandidate> candidate(new InlineCandidate);
+        candidate->params = params;
+        candidate->body = Clone(functionDecl.body);
+        candidate->position = it->second.second;
+        if (!MoveReturnsToTail(candidate->body))
+            return nullptr;
+
+        RenameLocals renamer("");
+        for (auto& param : params)
+            renamer.Declare(param);
+        auto body = Clone(candidate->body);
+        renamer.TransformBlock(body);
+        candidate->freeNames = std::move(renamer.freeNames);
+
+        FindExprs callFinder(Expr::Kind::Call);
+        callFinder.TransformBlock(candidate->body);
+        candidate->hasCall = callFinder.found;
+
+        auto& stmts = candidate->body.stmts;
+        auto returnStmt = stmts.size() == 1 ? dyn_cast<Return>(stmts[0].get()) : nullptr;
+        if (returnStmt && returnStmt->values.size() == 1)
+        {
+            FindExprs functionFinder(Expr::Kind::Function);
+            functionFinder.TransformExpr(returnStmt->values[0]);
+            if (!functionFinder.found)
+                candidate->value = returnStmt->values[0].get();
+        }
+        return candidate;
+    }
+
+    // The index of the top-level local called name that code in the
+    // top-level statement at position sees, or npos for the global
+    size_t GetVisibleLocal(std::string const& name, size_t position) const
+    {
+        auto visible = std::string::npos;
+        auto it = topLevelLocals.find(name);
+        if (it != topLevelLocals.end())
+        {
+            for (auto declared : it->second)
+            {
+                if (declared < position)
+                    visible = declared;
+            }
+        }
+        return visible;
+    }
+
+    Block& chunk;
+    size_t maxSize;
+
+    // The top-level functions by name, with their positions in the chunk
+    std::map<std::string, std::pair<FunctionDecl*, size_t>> functions;
+    std::set<std::string> redeclared;
+    std::set<std::string> calledOnce;
+    std::map<std::string, std::vector<size_t>> topLevelLocals;
+    std::map<std::string, std::unique_ptr<InlineCandidate>> candidates;
+
+    // The top-level statement being inlined into, and the names declared
+    // anywhere in it
+    size_t callerPosition = 0;
+    std::set<std::string> callerBound;
+    size_t tempsLeft = 0;
+    size_t counter = 0;
+};
+
+} // namespace
+
+void CacheGlobals::Run(Block& chunk)
+{
+    CountGlobalUses counter(globals);
+    counter.TransformBlock(chunk);
+
+    std::vector<std::pair<GlobalUse, size_t>> candidates;
+    for (auto& entry : counter.uses)
+    {
+        auto& use = entry.first;
+        if (counter.bound.count(use.global))
+            continue;
+
+        // The local for a member mustn't shadow anything the chunk uses
+        if (!use.member.empty() && (counter.names.count(use.GetLocalName()) ||
+                                    counter.bound.count(use.GetLocalName())))
+            continue;
+
+        candidates.push_back(entry);
+    }
+
+    std::stable_sort(candidates.begin(), candidates.end(),
+                     [](std::pair<GlobalUse, size_t> const& a, std::pair<GlobalUse, size_t> const& b) {
+                         return a.second > b.second;
+                     });
+    if (candidates.size() > maxCached)
+        candidates.resize(maxCached);
+    if (candidates.empty())
+        return;
+
+    // Keep the declaration in a stable, readable order
+    std::set<GlobalUse> cached;
+    for (auto& candidate : candidates)
+        cached.insert(candidate.first);
+
+    auto local = Make<Local>();
+    for (auto& use : cached)
+    {
+        local->names.push_back(use.GetLocalName());
+        if (use.member.empty())
+            local->values.push_back(Make<Name>(use.global));
+        else
+            local->values.push_back(Make<Index>(Make<Name>(use.global), Make<String>(use.member)));
+    }
+
+    ReplaceMembers replacer(cached);
+    replacer.TransformBlock(chunk);
+
+    chunk.stmts.insert(chunk.stmts.begin(), std::move(local));
+}
+
+void InlineFunctions::Run(Block& chunk)
+{
+    Inliner inliner(chunk, exported, maxSize);
+    inliner.Run();
+}
+
+void RemoveUnusedDecls::Run(Block& chunk)
+{
+    // The declarations that can be removed, by name, and what each uses
+    std::map<std::string, std::vector<size_t>> declarations;
+    std::vector<std::set<std::string>> uses(chunk.stmts.size());
+    std::vector<bool> isKept(chunk.stmts.size(), true);
+
+    std::set<std::string> reached;
+    std::vector<std::string> worklist;
+    auto reach = [&](std::string const& name) {
+        if (reached.insert(name).second)
+            worklist.push_back(name);
+    };
+
+    for (size_t i = 0; i < chunk.stmts.size(); ++i)
+    {
+        CollectNames collector;
+        collector.TransformStmt(chunk.stmts[i]);
+
+        auto name = GetDeclaredName(*chunk.stmts[i]);
+        if (!name.empty() && !exported.count(name))
+        {
+            declarations[name].push_back(i);
+            uses[i] = std::move(collector.names);
+            isKept[i] = false;
+        }
+        else
+        {
+            for (auto& use : collector.names)
+                reach(use);
+        }
+    }
+
+    while (!worklist.empty())
+    {
+        auto name = worklist.back();
+        worklist.pop_back();
+
+        auto it = declarations.find(name);
+        if (it == declarations.end())
+            continue;
+
+        for (auto i : it->second)
+        {
+            isKept[i] = true;
+            for (auto& use : uses[i])
+                reach(use);
+        }
+    }
+
+    std::vector<StmtPtr> kept;
+    for (size_t i = 0; i < chunk.stmts.size(); ++i)
+    {
+        if (isKept[i])
+            kept.push_back(std::move(chunk.stmts[i]));
+    }
+    chunk.stmts = std::move(kept);
+}
+
+void RemoveUnusedShimCode::Run(Block& chunk)
+{
+    std::map<Raw*, std::vector<ShimSection>> shims;
+    std::map<std::string, std::vector<ShimSection*>> definitions;
+
+    std::set<std::string> reached;
+    std::vector<std::string> worklist;
+    auto reach = [&](std::set<std::string> const& names) {
+        for (auto& name : names)
+        {
+            if (reached.insert(name).second)
+                worklist.push_back(name);
+        }
+    };
+
+    for (auto& stmt : chunk.stmts)
+    {
+        if (auto raw = dyn_cast<Raw>(stmt.get()))
+        {
+            shims[raw] = SplitShim(raw->text);
+            continue;
+        }
+
+        CollectNames collector;
+        collector.TransformStmt(stmt);
+        reach(collector.names);
+    }
+
+    // Set up the definitions once the sections won't move in memory again
+    for (auto& shim : shims)
+    {
+        for (auto& section : shim.second)
+        {
+            if (section.defines.empty())
+            {
+                section.isKept = true;
+                reach(section.uses);
+            }
+            else
+            {
+                definitions[section.defines].push_back(&section);
+            }
+        }
+    }
+
+    while (!worklist.empty())
+    {
+        auto name = worklist.back();
+        worklist.pop_back();
+
+        auto it = definitions.find(name);
+        if (it == definitions.end())
+            continue;
+
+        for (auto section : it->second)
+        {
+            section->isKept = true;
+            reach(section->uses);
+        }
+    }
+
+    std::vector<StmtPtr> kept;
+    for (auto& stmt : chunk.stmts)
+    {
+        if (auto raw = dyn_cast<Raw>(stmt.get()))
+        {
+            raw->text.clear();
+            for (auto& section : shims[raw])
+            {
+                if (section.isKept)
+                    raw->text += section.text;
+            }
+
+            // Leading blank lines are left over from removed sections. A file
+            // that's left empty goes, along with the comment naming it.
+            auto start = raw->text.find_first_not_of('\n');
+            if (start == std::string::npos)
+            {
+                if (!kept.empty() && isa<Comment>(kept.back().get()))
+                    kept.pop_back();
+                continue;
+            }
+            raw->text.erase(0, start);
+        }
+        kept.push_back(std::move(stmt));
+    }
+    chunk.stmts = std::move(kept);
+}
+
+} // namespace lua
@@ -0,0 +1,114 @@
+#pragma once
+
+#include "lua_ast.h"
+
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace lua
+{
+
+// A transformation over a whole chunk, run after the C AST has been lowered
+class Pass
+{
+  public:
+    virtual ~Pass() = default;
+
+    virtual char const* GetName() const = 0;
+    virtual void Run(Block& chunk) = 0;
+};
+
+class PassManager
+{
+  public:
+    void AddPass(std::unique_ptr<Pass> pass);
+    void Run(Block& chunk);
+
+  private:
+    std::vector<std::unique_ptr<Pass>> passes;
+};
+
+// Reads the globals the chunk uses from the shims into locals at the top of
+// the chunk, so each use is a register or upvalue access rather than a table
+// lookup. Members of shim tables are cached too: mem.make_array becomes
+// mem_make_array. Globals the chunk assigns or binds itself are left alone,
+// and at most maxCached are cached (Lua 5.1 allows 60 upvalues per function),
+// most used first.
+class CacheGlobals : public Pass
+{
+  public:
+    explicit CacheGlobals(std::set<std::string> globals) : globals(std::move(globals)) {}
+
+    virtual char const* GetName() const override { return "cache-globals"; }
+    virtual void Run(Block& chunk) override;
+
+    static size_t const maxCached = 48;
+
+  private:
+    std::set<std::string> globals;
+};
+
+// Replaces calls to top-level functions with their bodies. A function is
+// inlined if its body has at most maxSize statements and expressions, or if
+// it isn't exported and its only use is a single call, whatever its size.
+// A call whose value is used in place, e.g. `local x = f(a)` or `return
+// f(a)`, becomes a do block holding the body, in which the parameters are
+// locals and each return assigns the result; one nested in an expression is
+// first hoisted into a temporary, as long as it's evaluated unconditionally
+// before the statement. A function that only returns an expression has it
+// substituted for the call wherever that's exact, e.g. `add(x, 1)` becomes
+// `x + 1`. Functions that call themselves, have a goto or return from
+// anywhere but their end (e.g. from a loop) are left alone, as are calls
+// that would see a different variable for a name the body uses.
+class InlineFunctions : public Pass
+{
+  public:
+    InlineFunctions(std::set<std::string> exported, size_t maxSize)
+        : exported(std::move(exported)), maxSize(maxSize)
+    {
+    }
+
+    virtual char const* GetName() const override { return "inline-functions"; }
+    virtual void Run(Block& chunk) override;
+
+  private:
+    std::set<std::string> exported;
+    size_t maxSize;
+};
+
+// Removes top-level functions, and globals and locals initialised without
+// side effects, that nothing reachable from the rest of the chunk uses.
+// Reachability is by name, so a use that's actually of a different variable
+// with the same name keeps a declaration, but never the other way around.
+// The exported names are always kept.
+class RemoveUnusedDecls : public Pass
+{
+  public:
+    explicit RemoveUnusedDecls(std::set<std::string> exported) : exported(std::move(exported)) {}
+
+    virtual char const* GetName() const override { return "remove-unused-decls"; }
+    virtual void Run(Block& chunk) override;
+
+  private:
+    std::set<std::string> exported;
+};
+
+// Removes the definitions in baked shim files (the chunk's Raw statements)
+// that neither the rest of the chunk nor another definition that is kept
+// uses. A shim file is split into its top-level statements by indentation:
+// each starts at the beginning of a line, and the lines after it that are
+// indented or close a block (e.g. `end`) belong to it, as do the comments
+// above it. Only `function name(...)` and `name = value` are definitions;
+// any other statement is always kept. Uses are found by looking for names
+// anywhere in the code, so they're overestimated rather than missed.
+class RemoveUnusedShimCode : public Pass
+{
+  public:
+    virtual char const* GetName() const override { return "remove-unused-shim-code"; }
+    virtual void Run(Block& chunk) override;
+};
+
+} // namespace lua
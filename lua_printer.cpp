@@ -0,0 +1,726 @@
+#include "lua_printer.h"
+
+#include "llvm/ADT/SmallString.h"
+
+#include <algorithm>
+#include <cctype>
+#include <sstream>
+
+using llvm::cast;
+using llvm::dyn_cast;
+using llvm::isa;
+
+namespace lua
+{
+
+namespace
+{
+
+// Function literals are printed on a single line when they are this short
+uint32_t const SingleLineFunctionLimit = 80;
+
+int const UnaryPrecedence = 12;
+int const PrimaryPrecedence = 100;
+
+int GetPrecedence(BinaryOp op)
+{
+    switch (op)
+    {
+    case BinaryOp::Or:
+        return 1;
+    case BinaryOp::And:
+        return 2;
+    case BinaryOp::Lt:
+    case BinaryOp::Gt:
+    case BinaryOp::Le:
+    case BinaryOp::Ge:
+    case BinaryOp::Ne:
+    case BinaryOp::Eq:
+        return 3;
+    case BinaryOp::BitOr:
+        return 4;
+    case BinaryOp::BitXor:
+        return 5;
+    case BinaryOp::BitAnd:
+        return 6;
+    case BinaryOp::Shl:
+    case BinaryOp::Shr:
+        return 7;
+    case BinaryOp::Concat:
+        return 9;
+    case BinaryOp::Add:
+    case BinaryOp::Sub:
+        return 10;
+    case BinaryOp::Mul:
+    case BinaryOp::Div:
+    case BinaryOp::IDiv:
+    case BinaryOp::Mod:
+        return 11;
+    case BinaryOp::Pow:
+        return 14;
+    }
+    return 0;
+}
+
+bool IsRightAssociative(BinaryOp op) { return op == BinaryOp::Concat || op == BinaryOp::Pow; }
+
+char const* GetSpelling(BinaryOp op)
+{
+    switch (op)
+    {
+    case BinaryOp::Or:
+        return "or";
+    case BinaryOp::And:
+        return "and";
+    case BinaryOp::Lt:
+        return "<";
+    case BinaryOp::Gt:
+        return ">";
+    case BinaryOp::Le:
+        return "<=";
+    case BinaryOp::Ge:
+        return ">=";
+    case BinaryOp::Ne:
+        return "~=";
+    case BinaryOp::Eq:
+        return "==";
+    case BinaryOp::BitOr:
+        return "|";
+    case BinaryOp::BitXor:
+        return "~";
+    case BinaryOp::BitAnd:
+        return "&";
+    case BinaryOp::Shl:
+        return "<<";
+    case BinaryOp::Shr:
+        return ">>";
+    case BinaryOp::Concat:
+        return "..";
+    case BinaryOp::Add:
+        return "+";
+    case BinaryOp::Sub:
+        return "-";
+    case BinaryOp::Mul:
+        return "*";
+    case BinaryOp::Div:
+        return "/";
+    case BinaryOp::IDiv:
+        return "//";
+    case BinaryOp::Mod:
+        return "%";
+    case BinaryOp::Pow:
+        return "^";
+    }
+    return "";
+}
+
+int GetPrecedence(Expr const& expr)
+{
+    if (auto binary = dyn_cast<Binary>(&expr))
+        return GetPrecedence(binary->op);
+
+    if (isa<Unary>(&expr))
+        return UnaryPrecedence;
+
+    if (auto number = dyn_cast<Number>(&expr))
+        return number->text[0] == '-' ? UnaryPrecedence : PrimaryPrecedence;
+
+    return PrimaryPrecedence;
+}
+
+bool StartsWithMinus(Expr const& expr)
+{
+    if (auto unary = dyn_cast<Unary>(&expr))
+        return unary->op == UnaryOp::Neg;
+
+    if (auto number = dyn_cast<Number>(&expr))
+        return number->text[0] == '-';
+
+    return false;
+}
+
+// Only names, indexing, calls and parenthesised expressions may be called or indexed
+bool IsPrefixExpr(Expr const& expr)
+{
+    return isa<Name>(&expr) || isa<Index>(&expr) || isa<Call>(&expr) || isa<Paren>(&expr);
+}
+
+bool StartsWithParen(Expr const& expr)
+{
+    if (isa<Paren>(&expr))
+        return true;
+
+    if (auto call = dyn_cast<Call>(&expr))
+        return !IsPrefixExpr(*call->callee) || StartsWithParen(*call->callee);
+
+    if (auto index = dyn_cast<Index>(&expr))
+        return !IsPrefixExpr(*index->object) || StartsWithParen(*index->object);
+
+    return false;
+}
+
+bool StartsWithParen(Stmt const& stmt)
+{
+    if (auto callStmt = dyn_cast<CallStmt>(&stmt))
+        return StartsWithParen(*callStmt->call);
+
+    if (auto assign = dyn_cast<Assign>(&stmt))
+        return !assign->targets.empty() && StartsWithParen(*assign->targets.front());
+
+    return false;
+}
+
+bool IsKeyword(std::string const& name)
+{
+    static char const* const keywords[] = {
+        "and",   "break", "do",  "else", "elseif", "end",    "false", "for",  "function",
+        "goto",  "if",    "in",  "local", "nil",   "not",    "or",    "repeat", "return",
+        "then",  "true",  "until", "while"};
+
+    for (auto keyword : keywords)
+    {
+        if (name == keyword)
+            return true;
+    }
+    return false;
+}
+
+bool IsIdentifier(std::string const& name)
+{
+    if (name.empty() || std::isdigit(static_cast<unsigned char>(name[0])))
+        return false;
+
+    for (auto c : name)
+    {
+        if (!std::isalnum(static_cast<unsigned char>(c)) && c != '_')
+            return false;
+    }
+
+    return !IsKeyword(name);
+}
+
+bool CanPrintOnSingleLine(Block const& block);
+
+bool CanPrintOnSingleLine(Stmt const& stmt)
+{
+    switch (stmt.kind)
+    {
+    case Stmt::Kind::Comment:
+    case Stmt::Kind::Raw:
+    case Stmt::Kind::FunctionDecl:
+        return false;
+    case Stmt::Kind::Do:
+        return CanPrintOnSingleLine(cast<Do>(stmt).body);
+    case Stmt::Kind::While:
+        return CanPrintOnSingleLine(cast<While>(stmt).body);
+    case Stmt::Kind::Repeat:
+        return CanPrintOnSingleLine(cast<Repeat>(stmt).body);
+    case Stmt::Kind::NumericFor:
+        return CanPrintOnSingleLine(cast<NumericFor>(stmt).body);
+    case Stmt::Kind::If:
+    {
+        auto& ifStmt = cast<If>(stmt);
+        for (auto& clause : ifStmt.clauses)
+        {
+            if (!CanPrintOnSingleLine(clause.body))
+                return false;
+        }
+        return CanPrintOnSingleLine(ifStmt.elseBody);
+    }
+    default:
+        return true;
+    }
+}
+
+bool CanPrintOnSingleLine(Block const& block)
+{
+    for (auto& stmt : block.stmts)
+    {
+        if (!CanPrintOnSingleLine(*stmt))
+            return false;
+    }
+    return true;
+}
+
+} // namespace
+
+std::string EscapeString(std::string const& input)
+{
+    std::ostringstream ss;
+    for (auto c : input)
+    {
+        switch (c)
+        {
+        case '\\':
+            ss << "\\\\";
+            break;
+        case '"':
+            ss << "\\\"";
+            break;
+        case '\b':
+            ss << "\\b";
+            break;
+        case '\f':
+            ss << "\\f";
+            break;
+        case '\n':
+            ss << "\\n";
+            break;
+        case '\r':
+            ss << "\\r";
+            break;
+        case '\t':
+            ss << "\\t";
+            break;
+        default:
+            ss << c;
+            break;
+        }
+    }
+    return ss.str();
+}
+
+void Printer::PrintChunk(Block const& chunk)
+{
+    for (auto& stmt : chunk.stmts)
+    {
+        AddSourceMapping(*stmt, true);
+        WriteDepth();
+        if (StartsWithParen(*stmt))
+            out << ";";
+
+        PrintBlockItem(*stmt, &stmt == &chunk.stmts.back());
+        WriteNewLine();
+
+        // Separate top-level functions from whatever follows them
+        if (isa<FunctionDecl>(stmt.get()))
+            WriteNewLine();
+    }
+}
+
+void Printer::PrintBlock(Block const& block)
+{
+    if (singleLine)
+    {
+        out << " ";
+        bool first = true;
+        for (auto& stmt : block.stmts)
+        {
+            if (!first)
+                out << "; ";
+
+            PrintBlockItem(*stmt, &stmt == &block.stmts.back());
+            first = false;
+        }
+        if (!block.stmts.empty())
+            out << " ";
+        return;
+    }
+
+    WriteNewLine();
+    depth++;
+    for (auto& stmt : block.stmts)
+    {
+        AddSourceMapping(*stmt, false);
+        WriteDepth();
+        // Avoid the statement being parsed as a call on the previous line
+        if (StartsWithParen(*stmt))
+            out << ";";
+
+        PrintBlockItem(*stmt, &stmt == &block.stmts.back());
+        WriteNewLine();
+    }
+    depth--;
+    WriteDepth();
+}
+
+// return (and in Lua 5.1, break) has to be the last statement of a block, so
+// one followed by unreachable code is given a block of its own
+void Printer::PrintBlockItem(Stmt const& stmt, bool isLast)
+{
+    if (!isLast && (isa<Return>(&stmt) || isa<Break>(&stmt)))
+    {
+        out << "do ";
+        PrintStmt(stmt);
+        out << " end";
+        return;
+    }
+
+    PrintStmt(stmt);
+}
+
+void Printer::PrintStmt(Stmt const& stmt)
+{
+    switch (stmt.kind)
+    {
+    case Stmt::Kind::Local:
+    {
+        auto& local = cast<Local>(stmt);
+        out << "local ";
+        bool first = true;
+        for (auto& name : local.names)
+        {
+            if (!first)
+                out << ", ";
+
+            out << name;
+            first = false;
+        }
+        if (!local.values.empty())
+        {
+            out << " = ";
+            PrintExprList(local.values);
+        }
+        break;
+    }
+    case Stmt::Kind::Assign:
+    {
+        auto& assign = cast<Assign>(stmt);
+        PrintExprList(assign.targets);
+        out << " = ";
+        PrintExprList(assign.values);
+        break;
+    }
+    case Stmt::Kind::CallStmt:
+        PrintExpr(*cast<CallStmt>(stmt).call);
+        break;
+    case Stmt::Kind::Do:
+        out << "do";
+        PrintBlock(cast<Do>(stmt).body);
+        out << "end";
+        break;
+    case Stmt::Kind::While:
+    {
+        auto& whileStmt = cast<While>(stmt);
+        out << "while ";
+        PrintExpr(*whileStmt.cond);
+        out << " do";
+        PrintBlock(whileStmt.body);
+        out << "end";
+        break;
+    }
+    case Stmt::Kind::Repeat:
+    {
+        auto& repeat = cast<Repeat>(stmt);
+        out << "repeat";
+        PrintBlock(repeat.body);
+        out << "until ";
+        PrintExpr(*repeat.cond);
+        break;
+    }
+    case Stmt::Kind::NumericFor:
+    {
+        auto& numericFor = cast<NumericFor>(stmt);
+        out << "for " << numericFor.var << " = ";
+        PrintExpr(*numericFor.start);
+        out << ", ";
+        PrintExpr(*numericFor.limit);
+        if (numericFor.step)
+        {
+            out << ", ";
+            PrintExpr(*numericFor.step);
+        }
+        out << " do";
+        PrintBlock(numericFor.body);
+        out << "end";
+        break;
+    }
+    case Stmt::Kind::If:
+    {
+        auto& ifStmt = cast<If>(stmt);
+        bool first = true;
+        for (auto& clause : ifStmt.clauses)
+        {
+            out << (first ? "if " : "elseif ");
+            PrintExpr(*clause.cond);
+            out << " then";
+            PrintBlock(clause.body);
+            first = false;
+        }
+        if (!ifStmt.elseBody.stmts.empty())
+        {
+            out << "else";
+            PrintBlock(ifStmt.elseBody);
+        }
+        out << "end";
+        break;
+    }
+    case Stmt::Kind::Return:
+    {
+        auto& returnStmt = cast<Return>(stmt);
+        out << "return";
+        if (!returnStmt.values.empty())
+        {
+            out << " ";
+            PrintExprList(returnStmt.values);
+        }
+        break;
+    }
+    case Stmt::Kind::Break:
+        out << "break";
+        break;
+    case Stmt::Kind::Goto:
+        out << "goto " << cast<Goto>(stmt).label;
+        break;
+    case Stmt::Kind::Label:
+        out << "::" << cast<Label>(stmt).name << "::";
+        break;
+    case Stmt::Kind::FunctionDecl:
+    {
+        auto& functionDecl = cast<FunctionDecl>(stmt);
+        if (functionDecl.isLocal)
+            out << "local ";
+        out << "function " << functionDecl.name;
+        auto outer = function;
+        function = functionDecl.name;
+        PrintFunctionBody(functionDecl.params, functionDecl.body, false);
+        function = outer;
+        break;
+    }
+    case Stmt::Kind::Comment:
+        out << "-- " << cast<Comment>(stmt).text;
+        break;
+    case Stmt::Kind::Raw:
+    {
+        auto text = cast<Raw>(stmt).text;
+        if (!text.empty() && text.back() == '\n')
+            text.pop_back();
+        out << text;
+        line += std::count(text.begin(), text.end(), '\n');
+        break;
+    }
+    }
+}
+
+void Printer::PrintExpr(Expr const& expr, int minPrecedence)
+{
+    auto precedence = GetPrecedence(expr);
+    if (precedence < minPrecedence)
+    {
+        out << "(";
+        PrintExpr(expr);
+        out << ")";
+        return;
+    }
+
+    switch (expr.kind)
+    {
+    case Expr::Kind::Nil:
+        out << "nil";
+        break;
+    case Expr::Kind::Boolean:
+        out << (cast<Boolean>(expr).value ? "true" : "false");
+        break;
+    case Expr::Kind::Number:
+        out << cast<Number>(expr).text;
+        break;
+    case Expr::Kind::String:
+        out << '"' << EscapeString(cast<String>(expr).value) << '"';
+        break;
+    case Expr::Kind::Name:
+        out << cast<Name>(expr).name;
+        break;
+    case Expr::Kind::Index:
+    {
+        auto& index = cast<Index>(expr);
+        PrintPrefixExpr(*index.object);
+
+        auto key = dyn_cast<String>(index.key.get());
+        if (key && IsIdentifier(key->value))
+        {
+            out << "." << key->value;
+        }
+        else
+        {
+            out << "[";
+            PrintExpr(*index.key);
+            out << "]";
+        }
+        break;
+    }
+    case Expr::Kind::Call:
+    {
+        auto& call = cast<Call>(expr);
+        PrintPrefixExpr(*call.callee);
+        out << "(";
+        PrintExprList(call.args);
+        out << ")";
+        break;
+    }
+    case Expr::Kind::Function:
+    {
+        auto& function = cast<Function>(expr);
+        out << "function";
+        PrintFunctionBody(function.params, function.body, true);
+        break;
+    }
+    case Expr::Kind::Binary:
+    {
+        auto& binary = cast<Binary>(expr);
+        auto rightAssociative = IsRightAssociative(binary.op);
+        PrintExpr(*binary.lhs, rightAssociative ? precedence + 1 : precedence);
+        out << " " << GetSpelling(binary.op) << " ";
+        PrintExpr(*binary.rhs, rightAssociative ? precedence : precedence + 1);
+        break;
+    }
+    case Expr::Kind::Unary:
+    {
+        auto& unary = cast<Unary>(expr);
+        switch (unary.op)
+        {
+        case UnaryOp::Neg:
+        {
+            out << "-";
+            // "--" would start a comment
+            if (StartsWithMinus(*unary.operand))
+            {
+                out << "(";
+                PrintExpr(*unary.operand);
+                out << ")";
+            }
+            else
+            {
+                PrintExpr(*unary.operand, UnaryPrecedence);
+            }
+            break;
+        }
+        case UnaryOp::Not:
+            out << "not ";
+            PrintExpr(*unary.operand, UnaryPrecedence);
+            break;
+        case UnaryOp::Len:
+            out << "#";
+            PrintExpr(*unary.operand, UnaryPrecedence);
+            break;
+        case UnaryOp::BitNot:
+            out << "~";
+            PrintExpr(*unary.operand, UnaryPrecedence);
+            break;
+        }
+        break;
+    }
+    case Expr::Kind::Paren:
+        out << "(";
+        PrintExpr(*cast<Paren>(expr).expr);
+        out << ")";
+        break;
+    case Expr::Kind::Table:
+    {
+        auto& table = cast<Table>(expr);
+        out << "{";
+        if (table.keys.empty())
+        {
+            PrintExprList(table.items);
+        }
+        else
+        {
+            for (size_t i = 0; i < table.items.size(); ++i)
+            {
+                if (i > 0)
+                    out << ", ";
+
+                if (IsIdentifier(table.keys[i]))
+                    out << table.keys[i] << " = ";
+                else
+                    out << "[\"" << EscapeString(table.keys[i]) << "\"] = ";
+                PrintExpr(*table.items[i]);
+            }
+        }
+        out << "}";
+        break;
+    }
+    }
+}
+
+void Printer::PrintPrefixExpr(Expr const& expr)
+{
+    if (IsPrefixExpr(expr))
+    {
+        PrintExpr(expr);
+    }
+    else
+    {
+        out << "(";
+        PrintExpr(expr);
+        out << ")";
+    }
+}
+
+void Printer::PrintExprList(ExprList const& exprs)
+{
+    bool first = true;
+    for (auto& expr : exprs)
+    {
+        if (!first)
+            out << ", ";
+
+        PrintExpr(*expr);
+        first = false;
+    }
+}
+
+void Printer::PrintFunctionBody(std::vector<std::string> const& params, Block const& body,
+                                bool allowSingleLine)
+{
+    out << "(";
+    bool first = true;
+    for (auto& param : params)
+    {
+        if (!first)
+            out << ", ";
+
+        out << param;
+        first = false;
+    }
+    out << ")";
+
+    // Short closures read better on one line, as they were written before
+    // this printer existed: (function() if c then return a else return b end end)()
+    if (allowSingleLine && !singleLine && CanPrintOnSingleLine(body))
+    {
+        llvm::SmallString<128> text;
+        llvm::raw_svector_ostream ss(text);
+        Printer printer(ss);
+        printer.singleLine = true;
+        printer.PrintBlock(body);
+        ss.flush();
+
+        if (text.size() <= SingleLineFunctionLimit)
+        {
+            out << text << "end";
+            return;
+        }
+    }
+
+    PrintBlock(body);
+    out << "end";
+}
+
+void Printer::WriteDepth()
+{
+    if (singleLine)
+        return;
+
+    out.indent(depth * 4);
+}
+
+void Printer::WriteNewLine()
+{
+    out << "\n";
+    line++;
+}
+
+// Statements that weren't lowered from C are left out, so they're taken to
+// be part of the statement before them, other than at the top level, where
+// they're marked as not coming from C at all
+void Printer::AddSourceMapping(Stmt const& stmt, bool isTopLevel)
+{
+    if (!sourceMap || (!stmt.line && !isTopLevel))
+        return;
+
+    auto functionDecl = dyn_cast<FunctionDecl>(&stmt);
+    sourceMap->push_back(
+        SourceMapping{line, stmt.line, functionDecl && stmt.line ? functionDecl->name : function});
+}
+
+} // namespace lua
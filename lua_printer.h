@@ -0,0 +1,58 @@
+#pragma once
+
+#include "lua_ast.h"
+
+#include "llvm/Support/raw_ostream.h"
+
+#include <cstdint>
+
+namespace lua
+{
+
+std::string EscapeString(std::string const& input);
+
+// A line of the printed source that starts a statement, the C line the
+// statement was lowered from, and the function it's in. The C line is 0
+// for a top-level statement that wasn't lowered from C, such as a shim.
+struct SourceMapping
+{
+    uint32_t outputLine;
+    uint32_t sourceLine;
+    std::string function;
+};
+
+// Turns a Lua tree back into source. Parentheses are inserted wherever Lua's
+// precedence rules require them, so the tree does not need to carry them.
+class Printer
+{
+  public:
+    explicit Printer(llvm::raw_ostream& out) : out(out) {}
+
+    // Records where each statement is printed into mappings
+    void SetSourceMap(std::vector<SourceMapping>* mappings) { sourceMap = mappings; }
+
+    void PrintChunk(Block const& chunk);
+
+  private:
+    void PrintBlock(Block const& block);
+    void PrintBlockItem(Stmt const& stmt, bool isLast);
+    void PrintStmt(Stmt const& stmt);
+    void PrintExpr(Expr const& expr, int minPrecedence = 0);
+    void PrintPrefixExpr(Expr const& expr);
+    void PrintExprList(ExprList const& exprs);
+    void PrintFunctionBody(std::vector<std::string> const& params, Block const& body,
+                           bool allowSingleLine);
+
+    void WriteDepth();
+    void WriteNewLine();
+    void AddSourceMapping(Stmt const& stmt, bool isTopLevel);
+
+    llvm::raw_ostream& out;
+    uint32_t depth = 0;
+    bool singleLine = false;
+    uint32_t line = 1;
+    std::string function;
+    std::vector<SourceMapping>* sourceMap = nullptr;
+};
+
+} // namespace lua
@@ -1,92 +1,226 @@
+#include "clang/AST/AST.h"
 #include "clang/AST/ASTConsumer.h"
-#include "clang/AST/RecursiveASTVisitor.h"
+#include "clang/Basic/Version.h"
 #include "clang/Frontend/CompilerInstance.h"
 #include "clang/Frontend/FrontendAction.h"
+#include "clang/Frontend/FrontendActions.h"
 #include "clang/Tooling/CommonOptionsParser.h"
 #include "clang/Tooling/Tooling.h"
 #include "clang/Lex/Preprocessor.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "lua_ast.h"
+#include "lua_passes.h"
+#include "lua_printer.h"
 
-#include <iostream>
 #include <sstream>
 #include <fstream>
 #include <deque>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <iomanip>
+#include <atomic>
+#include <map>
+#include <set>
+#include <mutex>
+#include <thread>
+#include <chrono>
+
+#include <sys/resource.h>
 
 using namespace clang;
 using namespace clang::tooling;
 
 namespace cl = llvm::cl;
 
+enum class LuaTarget
+{
+    Lua51,
+    Lua52,
+    Lua53,
+    LuaJIT
+};
+
+static cl::opt<LuaTarget> Target("target", cl::init(LuaTarget::Lua52), cl::NotHidden,
+    cl::desc("The version of Lua to generate code for:"),
+    cl::values(clEnumValN(LuaTarget::Lua51, "lua51", "Lua 5.1, with the LuaBitOp library"),
+               clEnumValN(LuaTarget::Lua52, "lua52", "Lua 5.2 (default)"),
+               clEnumValN(LuaTarget::Lua53, "lua53", "Lua 5.3"),
+               clEnumValN(LuaTarget::LuaJIT, "luajit", "LuaJIT 2"),
+               clEnumValEnd));
+
+enum class ArrayBackend
+{
+    Table,
+    FFI
+};
+
+static cl::opt<ArrayBackend> ArrayBackendOption("array-backend", cl::init(ArrayBackend::Table),
+    cl::NotHidden, cl::desc("How to store C arrays:"),
+    cl::values(clEnumValN(ArrayBackend::Table, "table", "Lua tables, indexed from 1 (default)"),
+               clEnumValN(ArrayBackend::FFI, "ffi",
+                          "LuaJIT FFI arrays, indexed from 0, for arrays of numbers"),
+               clEnumValEnd));
+
+static cl::opt<bool> LinearMemory("linear-memory", cl::init(false), cl::NotHidden,
+    cl::desc("Lower pointers to addresses into a single flat heap, with malloc and free"));
+
+static cl::opt<bool> KeepUnused("keep-unused", cl::init(false), cl::NotHidden,
+    cl::desc("Emit every function and shim definition, including those nothing uses"));
+
+static cl::opt<bool> Instrument("instrument", cl::init(false), cl::NotHidden,
+    cl::desc("Count the calls to each function and time them, printing the totals to stderr once "
+             "main returns."));
+
+static cl::opt<unsigned> InlineLimit("inline-limit", cl::init(40), cl::NotHidden, cl::value_desc("N"),
+    cl::desc("Inline functions of up to N statements and expressions at their calls (0 turns inlining "
+             "off). Functions only called once are inlined whatever their size."));
+
+static cl::opt<bool> SourceMapOption("source-map", cl::init(false), cl::NotHidden,
+    cl::desc("Write a map from the lines of each script back to the C source to <script>.map."));
+
+static cl::opt<bool> Profile("profile", cl::init(false), cl::NotHidden,
+    cl::desc("Sample the stack while main runs, and write it to <script>.folded by C file, line and "
+             "function, for flamegraph.pl. Implies -source-map."));
+
 static cl::opt<bool> BakeIncludes("bake-includes", cl::init(false), cl::NotHidden,
     cl::desc("Controls whether includes should be baked into the resulting script."));
 
-std::string EscapeString(std::string const& input)
+enum class EmitKind
+{
+    Source,
+    Bytecode
+};
+
+static cl::opt<EmitKind> EmitOption("emit", cl::init(EmitKind::Source), cl::NotHidden,
+    cl::desc("What to write for each file:"),
+    cl::values(clEnumValN(EmitKind::Source, "source", "Lua source (default)"),
+               clEnumValN(EmitKind::Bytecode, "bytecode",
+                          "Stripped bytecode for the target, with the shims baked in"),
+               clEnumValEnd));
+
+static cl::opt<std::string> LuaCompiler("luac", cl::NotHidden, cl::value_desc("path"),
+    cl::desc("The compiler -emit=bytecode runs (default: luac5.1, luac5.2 or luac5.3 for the target, or luajit)."));
+
+static cl::opt<bool> PrecompileShims("precompile-shims", cl::init(false), cl::NotHidden,
+    cl::desc("Parses the shim/c headers once, into a precompiled header shared by every file."));
+
+static cl::opt<std::string> CacheDirectory("cache-dir", cl::NotHidden, cl::value_desc("dir"),
+    cl::desc("Caches the resulting script for each file under <dir>, keyed on its preprocessed source."));
+
+static cl::opt<std::string> OutputFilename("o", cl::NotHidden, cl::value_desc("file"),
+    cl::desc("Write the resulting script to <file> instead of stdout."));
+
+static cl::opt<std::string> OutputDirectory("output-dir", cl::NotHidden, cl::value_desc("dir"),
+    cl::desc("Write the script for each source file to its own file under <dir>."));
+
+static cl::opt<bool> TimeReportOption("time-report", cl::init(false), cl::NotHidden,
+    cl::desc("Print the time and peak memory each phase of transpiling takes, and the time taken "
+             "to lower each function, to stderr."));
+
+static cl::opt<std::string> TimeReportFile("time-report-json", cl::NotHidden, cl::value_desc("file"),
+    cl::desc("Write the -time-report for every file to <file> as JSON."));
+
+static cl::opt<unsigned> Jobs("j", cl::init(1), cl::NotHidden, cl::value_desc("N"),
+    cl::desc("Transpile N source files at once (0 uses every core)."));
+
+// True when a single file is being transpiled, so that if it has main() it's
+// the whole program, and nothing else can use what it doesn't
+static bool WholeProgram = false;
+
+// Reads a file to be baked into the output. Every translation unit includes
+// the same shim files, so each is only read once and then shared between
+// them (and between threads). Returns null if the file can't be read.
+std::string const* ReadIncludeFile(std::string const& path)
 {
-    std::ostringstream ss;
-    for (auto c : input)
+    static std::mutex mutex;
+    static std::map<std::string, std::unique_ptr<std::string>> cache;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = cache.find(path);
+    if (it != cache.end())
+        return it->second.get();
+
+    std::unique_ptr<std::string> contents;
+    std::fstream file(path);
+    if (!file.fail())
     {
-        switch (c)
-        {
-        case '\\':
-            ss << "\\\\";
-            break;
-        case '"':
-            ss << "\\\"";
-            break;
-        case '/':
-            ss << "\\/";
-            break;
-        case '\b':
-            ss << "\\b";
-            break;
-        case '\f':
-            ss << "\\f";
-            break;
-        case '\n':
-            ss << "\\n";
-            break;
-        case '\r':
-            ss << "\\r";
-            break;
-        case '\t':
-            ss << "\\t";
-            break;
-        default:
-            ss << c;
-            break;
-        }
+        contents.reset(new std::string());
+
+        file.seekg(0, std::ios::end);
+        contents->resize(file.tellg());
+        file.seekg(0, std::ios::beg);
+
+        file.read(&(*contents)[0], contents->size());
     }
-    return ss.str();
+
+    return cache.emplace(path, std::move(contents)).first->second.get();
 }
 
-void IncludeFile(std::string const& path)
+void IncludeFile(std::string const& path, lua::Block& chunk)
 {
     if (BakeIncludes)
     {
-        std::fstream file(path);
-
-        if (file.fail())
+        auto contents = ReadIncludeFile(path);
+        if (!contents)
         {
-            std::cout << "-- Failed to read file: " << path << "\n";
+            chunk.stmts.push_back(lua::Make<lua::Comment>("Failed to read file: " + path));
             return;
         }
 
-        std::string str;
-
-        file.seekg(0, std::ios::end);
-        str.resize(file.tellg());
-        file.seekg(0, std::ios::beg);
-
-        file.read(&str[0], str.size());
-
-        std::cout << "-- " << path << "\n";
-        std::cout << str;
+        chunk.stmts.push_back(lua::Make<lua::Comment>(path));
+        chunk.stmts.push_back(lua::Make<lua::Raw>(*contents));
     }
     else
     {
-        std::cout << "dofile \"" << path << "\"\n";
+        lua::ExprList args;
+        args.push_back(lua::Make<lua::String>(path));
+        chunk.stmts.push_back(lua::Make<lua::CallStmt>(
+            lua::Make<lua::Call>(lua::Make<lua::Name>("dofile"), std::move(args))));
     }
 }
 
+// Shim files every script needs, whatever the source file includes
+std::vector<char const*> GetAlwaysIncludedFiles()
+{
+    std::vector<char const*> files;
+    files.push_back("shim/lua/memory.lua");
+    if (Target == LuaTarget::Lua51)
+        files.push_back("shim/lua/bitwise.lua");
+    if (ArrayBackendOption == ArrayBackend::FFI)
+        files.push_back("shim/lua/ffi_arrays.lua");
+    if (LinearMemory)
+        files.push_back("shim/lua/heap.lua");
+    if (Instrument)
+        files.push_back("shim/lua/instrument.lua");
+    if (Profile)
+        files.push_back("shim/lua/profile.lua");
+    return files;
+}
+
+// The Lua file that replaces a C include: <stdio.h> becomes shim/lua/stdio.lua
+std::string GetLuaPathForInclude(StringRef fileName, bool isAngled)
+{
+    auto path = fileName.str();
+    path = path.substr(0, path.find_last_of('.'));
+    path += ".lua";
+
+    if (isAngled)
+        path = "shim/lua/" + path;
+
+    return path;
+}
+
 template <typename T>
 T* RecurseUntilType(Stmt* stmt)
 {
@@ -103,896 +237,4208 @@ T* RecurseUntilType(Stmt* stmt)
     return nullptr;
 }
 
-class DumpVisitor : public RecursiveASTVisitor<DumpVisitor>
+// Builds `object.member`
+lua::ExprPtr MakeMember(std::string const& object, std::string const& member)
 {
-  public:
-    explicit DumpVisitor(ASTContext* context) : context(context) {}
+    return lua::Make<lua::Index>(lua::Make<lua::Name>(object), lua::Make<lua::String>(member));
+}
 
-    void TraverseNewScope(Stmt* stmt)
-    {
-        if (!isa<CompoundStmt>(stmt))
-        {
-            depth++;
-            WriteDepth();
-        }
+lua::ExprPtr MakeCall(lua::ExprPtr callee, lua::ExprPtr arg0 = nullptr, lua::ExprPtr arg1 = nullptr)
+{
+    lua::ExprList args;
+    if (arg0)
+        args.push_back(std::move(arg0));
+    if (arg1)
+        args.push_back(std::move(arg1));
+    return lua::Make<lua::Call>(std::move(callee), std::move(args));
+}
 
-        TraverseStmt(stmt);
+lua::StmtPtr MakeLocal(std::string const& name, lua::ExprPtr value)
+{
+    auto local = lua::Make<lua::Local>();
+    local->names.push_back(name);
+    local->values.push_back(std::move(value));
+    return std::move(local);
+}
 
-        if (!isa<CompoundStmt>(stmt))
-        {
-            std::cout << "\n";
-            depth--;
-        }
-    }
+// True if evaluating expr again costs no more than reading a temporary: a
+// name, a constant, or a name plus or minus a constant (e.g. the `i + 1` of
+// an array index)
+bool IsCheapToRepeat(lua::Expr const& expr)
+{
+    if (isa<lua::Name>(&expr) || isa<lua::Number>(&expr) || isa<lua::String>(&expr))
+        return true;
+
+    auto binary = dyn_cast<lua::Binary>(&expr);
+    return binary && (binary->op == lua::BinaryOp::Add || binary->op == lua::BinaryOp::Sub) &&
+           isa<lua::Name>(binary->lhs.get()) && isa<lua::Number>(binary->rhs.get());
+}
+
+// Calls a function literal straight away: (function() ... end)()
+lua::ExprPtr MakeClosureCall(std::unique_ptr<lua::Function> function)
+{
+    return lua::Make<lua::Call>(std::move(function), lua::ExprList());
+}
 
-    void TraverseCondition(Stmt* stmt)
+// The variable expr names, looking through parentheses and implicit casts
+VarDecl* GetReferencedVar(Expr* expr)
+{
+    auto declRefExpr = dyn_cast<DeclRefExpr>(expr->IgnoreParenImpCasts());
+    return declRefExpr ? dyn_cast<VarDecl>(declRefExpr->getDecl()) : nullptr;
+}
+
+// True if var is mentioned anywhere in stmt, other than inside excluded
+bool ReferencesVar(Stmt* stmt, VarDecl* var, Stmt* excluded = nullptr)
+{
+    if (!stmt || stmt == excluded)
+        return false;
+
+    if (auto declRefExpr = dyn_cast<DeclRefExpr>(stmt))
     {
-        handlingAssignmentInCondition = true;
-        TraverseStmt(stmt);
-        handlingAssignmentInCondition = false;
+        if (declRefExpr->getDecl() == var)
+            return true;
     }
 
-    std::string GetNameForVarDecl(VarDecl* varDecl)
+    for (auto child : stmt->children())
     {
-        auto name = varDecl->getNameAsString();
+        if (ReferencesVar(child, var, excluded))
+            return true;
+    }
 
-        if (varDecl->isStaticLocal() && !name.empty())
-        {
-            std::string prefix = "_";
-            for (auto& string : scopeStack)
-                prefix += string + "_";
-            name = prefix + name;
-        }
+    return false;
+}
 
-        return name;
+// True if any of vars is mentioned anywhere in stmt
+bool ReferencesAnyVar(Stmt* stmt, std::set<VarDecl*> const& vars)
+{
+    if (!stmt)
+        return false;
+
+    if (auto declRefExpr = dyn_cast<DeclRefExpr>(stmt))
+    {
+        auto varDecl = dyn_cast<VarDecl>(declRefExpr->getDecl());
+        if (varDecl && vars.count(varDecl->getCanonicalDecl()))
+            return true;
     }
 
-    bool TraverseStmt(Stmt* stmt)
+    for (auto child : stmt->children())
     {
-        if (!stmt)
-            return RecursiveASTVisitor::TraverseStmt(stmt);
+        if (ReferencesAnyVar(child, vars))
+            return true;
+    }
 
-        if (auto compoundStmt = dyn_cast<CompoundStmt>(stmt))
-        {
-            depth++;
-            for (auto stmt : compoundStmt->body())
-            {
-                if (!stmt || isa<NullStmt>(stmt))
-                    continue;
+    return false;
+}
 
-                WriteDepth();
-                // HACK: Fix precedence issues with closures being called straight away
-                if (isa<UnaryOperator>(stmt))
-                    std::cout << ";";
+// True if stmt may modify var: assigns it, increments it, or takes its address
+bool WritesVar(Stmt* stmt, VarDecl* var)
+{
+    if (!stmt)
+        return false;
 
-                TraverseStmt(stmt);
-                std::cout << "\n";
-            }
-            depth--;
+    if (auto binaryOperator = dyn_cast<BinaryOperator>(stmt))
+    {
+        if (binaryOperator->isAssignmentOp() && GetReferencedVar(binaryOperator->getLHS()) == var)
             return true;
-        }
+    }
 
-        if (auto callExpr = dyn_cast<CallExpr>(stmt))
-        {
-            TraverseStmt(callExpr->getCallee());
-            bool first = true;
-            std::cout << "(";
-            for (auto param : callExpr->arguments())
-            {
-                if (!first)
-                    std::cout << ", ";
+    if (auto unaryOperator = dyn_cast<UnaryOperator>(stmt))
+    {
+        if ((unaryOperator->isIncrementDecrementOp() || unaryOperator->getOpcode() == UO_AddrOf) &&
+            GetReferencedVar(unaryOperator->getSubExpr()) == var)
+            return true;
+    }
 
-                TraverseStmt(param);
-                first = false;
-            }
-            std::cout << ")";
+    for (auto child : stmt->children())
+    {
+        if (WritesVar(child, var))
             return true;
-        }
+    }
 
-        if (auto ifStmt = dyn_cast<IfStmt>(stmt))
-        {
-            std::cout << "if ";
-            TraverseCondition(ifStmt->getCond());
-            std::cout << " then\n";
+    return false;
+}
 
-            TraverseNewScope(ifStmt->getThen());
+// True if expr evaluates to the same value every time body has run. Only
+// constants, enumerators and locals that body doesn't write qualify; globals
+// and memory could be changed by any call.
+bool IsLoopInvariant(Expr* expr, Stmt* body)
+{
+    expr = expr->IgnoreParenCasts();
 
-            WriteDepth();
-            auto elseStmt = ifStmt->getElse();
-            if (elseStmt)
-            {
-                std::cout << "else";
-                if (isa<IfStmt>(elseStmt))
-                {
-                    TraverseStmt(elseStmt);
-                }
-                else
-                {
-                    std::cout << "\n";
-                    TraverseNewScope(elseStmt);
+    if (isa<IntegerLiteral>(expr) || isa<CharacterLiteral>(expr))
+        return true;
 
-                    WriteDepth();
-                    std::cout << "end";
-                }
-            }
-            else
-            {
-                std::cout << "end";
-            }
+    if (auto declRefExpr = dyn_cast<DeclRefExpr>(expr))
+    {
+        if (isa<EnumConstantDecl>(declRefExpr->getDecl()))
             return true;
-        }
 
-        if (auto switchStmt = dyn_cast<SwitchStmt>(stmt))
+        auto varDecl = dyn_cast<VarDecl>(declRefExpr->getDecl());
+        return varDecl && varDecl->hasLocalStorage() && !WritesVar(body, varDecl);
+    }
+
+    if (auto unaryOperator = dyn_cast<UnaryOperator>(expr))
+    {
+        switch (unaryOperator->getOpcode())
         {
-            // Save counter in the event we have nested switches
-            auto currentCounter = counter;
-            std::cout << "local _switchTempTable" << currentCounter << " = {}\n";
-            Stmt* defaultStmtBody = nullptr;
+        case UO_Minus:
+        case UO_Plus:
+        case UO_Not:
+            return IsLoopInvariant(unaryOperator->getSubExpr(), body);
+        default:
+            return false;
+        }
+    }
 
-            if (auto compoundStmt = dyn_cast<CompoundStmt>(switchStmt->getBody()))
-            {
-                bool first = true;
-                for (auto stmt : compoundStmt->body())
-                {
-                    if (isa<CaseStmt>(stmt))
-                        TraverseStmt(stmt);
-                    else if (auto defaultStmt = dyn_cast<DefaultStmt>(stmt))
-                        defaultStmtBody = defaultStmt->getSubStmt();
-                }
-            }
+    if (auto binaryOperator = dyn_cast<BinaryOperator>(expr))
+    {
+        if (binaryOperator->isAssignmentOp() || binaryOperator->getOpcode() == BO_Comma)
+            return false;
+
+        return IsLoopInvariant(binaryOperator->getLHS(), body) &&
+               IsLoopInvariant(binaryOperator->getRHS(), body);
+    }
 
-            WriteDepth();
-            std::cout << "if _switchTempTable" << currentCounter << "[";
-            TraverseStmt(switchStmt->getCond());
-            std::cout << "] ~= nil then\n";
+    return false;
+}
 
-            ++depth;
-            WriteDepth();
-            std::cout << "_switchTempTable" << currentCounter << "[";
-            TraverseStmt(switchStmt->getCond());
-            std::cout << "]()\n";
-            --depth;
+// True if expr is a comparison, && or ||, or !, whose result C uses as a truth value
+bool IsTruthValue(Expr* expr)
+{
+    expr = expr->IgnoreParenImpCasts();
 
-            if (defaultStmtBody)
-            {
-                WriteDepth();
-                std::cout << "else\n";
-                TraverseNewScope(defaultStmtBody);
-            }
+    if (auto binaryOperator = dyn_cast<BinaryOperator>(expr))
+        return binaryOperator->isComparisonOp() || binaryOperator->isLogicalOp();
+
+    if (auto unaryOperator = dyn_cast<UnaryOperator>(expr))
+        return unaryOperator->getOpcode() == UO_LNot;
+
+    return false;
+}
 
-            WriteDepth();
-            std::cout << "end";
-            ++counter;
+// True if expr can't be negative: it has an unsigned type, is an unsigned
+// value promoted to a wider type, or is a non-negative constant
+bool IsKnownNonNegative(Expr* expr, ASTContext& context)
+{
+    expr = expr->IgnoreParens();
+    if (expr->getType()->isUnsignedIntegerType())
+        return true;
 
+    auto castExpr = dyn_cast<ImplicitCastExpr>(expr);
+    if (castExpr && castExpr->getCastKind() == CK_IntegralCast)
+    {
+        auto fromType = castExpr->getSubExpr()->getType();
+        if (fromType->isUnsignedIntegerType() &&
+            context.getIntWidth(fromType) < context.getIntWidth(expr->getType()))
             return true;
-        }
+    }
 
-        if (auto caseStmt = dyn_cast<CaseStmt>(stmt))
-        {
-            // Save counter in the event we have nested switches
-            auto currentCounter = counter;
-            auto body = caseStmt->getSubStmt();
+    llvm::APSInt value;
+    return !expr->HasSideEffects(context) && expr->EvaluateAsInt(value, context) &&
+           !value.isNegative();
+}
 
-            Expr* prevCaseLHS = nullptr;
+// True if every value expr can take is known to be representable in type: a
+// constant in range, or a choice between such constants
+bool IsKnownToFit(Expr* expr, QualType type, ASTContext& context)
+{
+    expr = expr->IgnoreParenImpCasts();
+    if (auto conditionalOperator = dyn_cast<ConditionalOperator>(expr))
+    {
+        return IsKnownToFit(conditionalOperator->getTrueExpr(), type, context) &&
+               IsKnownToFit(conditionalOperator->getFalseExpr(), type, context);
+    }
 
-            if (isa<CaseStmt>(body))
-            {
-                TraverseStmt(body);
-                prevCaseLHS = dyn_cast<CaseStmt>(body)->getLHS();
-            }
+    llvm::APSInt value;
+    if (expr->HasSideEffects(context) || !expr->EvaluateAsInt(value, context))
+        return false;
+    if (value.isUnsigned() && value.getActiveBits() > 63)
+        return false;
 
-            WriteDepth();
-            std::cout << "_switchTempTable" << currentCounter << "[";
-            TraverseStmt(caseStmt->getLHS());
-            std::cout << "] = ";
+    auto width = context.getIntWidth(type);
+    if (width >= 64)
+        return true;
 
-            if (!isa<CaseStmt>(body))
-            {
-                std::cout << "function()\n";
-                TraverseNewScope(body);
-                WriteDepth();
-                std::cout << "end";
-            }
-            else if (prevCaseLHS)
-            {
-                std::cout << "_switchTempTable" << currentCounter << "[";
-                TraverseStmt(prevCaseLHS);
-                std::cout << "]";
-            }
-            else
-            {
-                // Unhandled catch-all
-                std::cout << "function() end";
-            }
+    auto number = value.getExtValue();
+    if (type->isUnsignedIntegerType())
+        return number >= 0 && number < (int64_t(1) << width);
+    return number >= -(int64_t(1) << (width - 1)) && number < (int64_t(1) << (width - 1));
+}
 
-            std::cout << "\n";
+// True if every value of the integer type from is also a value of to
+bool IsRangeContained(QualType from, QualType to, ASTContext& context)
+{
+    auto fromWidth = context.getIntWidth(from);
+    auto toWidth = context.getIntWidth(to);
+    bool fromUnsigned = from->isUnsignedIntegerType();
+    bool toUnsigned = to->isUnsignedIntegerType();
+
+    if (fromUnsigned == toUnsigned)
+        return toWidth >= fromWidth;
+    return fromUnsigned && toWidth > fromWidth;
+}
 
-            return true;
-        }
+// The mem function that creates FFI arrays of elementType, e.g. int32_array,
+// or an empty string if they're kept in tables. With -array-backend=ffi that
+// is every number type but plain char, whose arrays hold strings, and 64-bit
+// integers, which LuaJIT boxes.
+std::string GetFFIArrayConstructor(QualType elementType, ASTContext& context)
+{
+    if (ArrayBackendOption != ArrayBackend::FFI)
+        return "";
 
-        if (auto doStmt = dyn_cast<DoStmt>(stmt))
-        {
-            std::cout << "repeat\n";
+    if (elementType->isSpecificBuiltinType(BuiltinType::Float))
+        return "float_array";
+    if (elementType->isSpecificBuiltinType(BuiltinType::Double))
+        return "double_array";
 
-            TraverseNewScope(doStmt->getBody());
+    if (!elementType->isIntegerType() || elementType->isBooleanType() ||
+        elementType->isSpecificBuiltinType(BuiltinType::Char_S) ||
+        elementType->isSpecificBuiltinType(BuiltinType::Char_U))
+        return "";
 
-            WriteDepth();
-            std::cout << "until not (";
-            TraverseCondition(doStmt->getCond());
-            std::cout << ")";
-            return true;
-        }
+    auto width = context.getIntWidth(elementType);
+    if (width != 8 && width != 16 && width != 32)
+        return "";
 
-        if (auto whileStmt = dyn_cast<WhileStmt>(stmt))
-        {
-            std::cout << "while ";
-            TraverseCondition(whileStmt->getCond());
-            std::cout << " do\n";
+    return (elementType->isUnsignedIntegerType() ? "uint" : "int") + std::to_string(width) + "_array";
+}
 
-            TraverseNewScope(whileStmt->getBody());
+// True if a struct of type (or each struct in an array of them) has arrays
+// of its own, which are in the heap under -linear-memory
+bool HasHeapArrays(QualType type)
+{
+    auto recordType = type->getBaseElementTypeUnsafe()->getAs<RecordType>();
+    if (!recordType)
+        return false;
 
-            WriteDepth();
-            std::cout << "end";
+    for (auto field : recordType->getDecl()->fields())
+    {
+        auto fieldType = field->getType();
+        if (fieldType->isConstantArrayType() &&
+            !fieldType->getBaseElementTypeUnsafe()->isRecordType())
             return true;
-        }
-
-        // Lower for loops to while loops, because C is a wonderful language
-        // in which anything can happen in a for loop's expressions >_>
-        if (auto forStmt = dyn_cast<ForStmt>(stmt))
-        {
-            TraverseStmt(forStmt->getInit());
-            std::cout << "\n";
-
-            WriteDepth();
-            std::cout << "while ";
-            TraverseCondition(forStmt->getCond());
-            std::cout << " do\n";
-
-            TraverseNewScope(forStmt->getBody());
-            ++depth;
-            WriteDepth();
-            std::cout << ";";
-            TraverseStmt(forStmt->getInc());
-            --depth;
-            std::cout << "\n";
-
-            WriteDepth();
-            std::cout << "end";
+        if (HasHeapArrays(fieldType))
             return true;
-        }
+    }
+    return false;
+}
+
+// True if child is a block or loop body of parent, which is given a frame
+// of its own on the heap's stack
+bool HasOwnFrame(Stmt* parent, Stmt* child)
+{
+    if (auto whileStmt = dyn_cast<WhileStmt>(parent))
+        return child == whileStmt->getBody();
+    if (auto doStmt = dyn_cast<DoStmt>(parent))
+        return child == doStmt->getBody();
+    if (auto forStmt = dyn_cast<ForStmt>(parent))
+        return child == forStmt->getBody();
+
+    // The cases of a switch are lowered as part of the enclosing block
+    return isa<CompoundStmt>(child) && !isa<SwitchStmt>(parent);
+}
 
-        if (auto arraySubscriptExpr = dyn_cast<ArraySubscriptExpr>(stmt))
+// True if stmt allocates on the heap's stack under -linear-memory, either
+// directly or (when recursive) in any nested block: it declares an array
+// or a local whose address is taken, or makes a struct that has arrays, by
+// declaring, copying or returning one
+bool AllocatesOnStack(Stmt* stmt, bool recursive, std::set<VarDecl*> const& heapLocals)
+{
+    if (auto declStmt = dyn_cast<DeclStmt>(stmt))
+    {
+        for (auto decl : declStmt->decls())
         {
-            TraverseStmt(arraySubscriptExpr->getBase());
-            std::cout << "[(";
-            TraverseStmt(arraySubscriptExpr->getIdx());
-            // Add 1 to compensate for 1-based indexing
-            std::cout << ")+1]";
-            return true;
+            // Arrays of structs are tables, rather than in the heap
+            auto varDecl = dyn_cast<VarDecl>(decl);
+            if (!varDecl || !varDecl->hasLocalStorage())
+                continue;
+            if (varDecl->getType()->isConstantArrayType() &&
+                !varDecl->getType()->getBaseElementTypeUnsafe()->isRecordType())
+                return true;
+            if (heapLocals.count(varDecl->getCanonicalDecl()) || HasHeapArrays(varDecl->getType()))
+                return true;
         }
+    }
+    else if (auto castExpr = dyn_cast<CastExpr>(stmt))
+    {
+        // Reading a struct copies it
+        if (castExpr->getCastKind() == CK_LValueToRValue && HasHeapArrays(castExpr->getType()))
+            return true;
+    }
+    else if (auto callExpr = dyn_cast<CallExpr>(stmt))
+    {
+        if (HasHeapArrays(callExpr->getType()))
+            return true;
+    }
+    else if (auto binaryOperator = dyn_cast<BinaryOperator>(stmt))
+    {
+        if (binaryOperator->getOpcode() == BO_Assign && HasHeapArrays(binaryOperator->getType()))
+            return true;
+    }
 
-        if (auto unaryOperator = dyn_cast<UnaryOperator>(stmt))
-        {
-            auto opcode = unaryOperator->getOpcode();
-            switch (opcode)
-            {
-            case UO_Minus:
-                std::cout << "-";
-                TraverseStmt(unaryOperator->getSubExpr());
-                break;
-            case UO_Not:
-                std::cout << "bit._not(";
-                TraverseStmt(unaryOperator->getSubExpr());
-                std::cout << ")";
-                break;
-            case UO_LNot:
-                std::cout << "not ";
-                TraverseStmt(unaryOperator->getSubExpr());
-                break;
-            case UO_Deref:
-            {
-                // Special case based on RHS type
-                auto declRefExpr = RecurseUntilType<DeclRefExpr>(unaryOperator->getSubExpr());
-                if (!declRefExpr)
-                    break;
+    for (auto child : stmt->children())
+    {
+        if (!child)
+            continue;
 
-                auto decl = declRefExpr->getDecl();
-                auto& type = *decl->getType();
-                if (type.isFunctionPointerType())
-                {
-                    // Emit the decl: no dereferencing required
-                    std::cout << decl->getNameAsString();
-                }
-                break;
-            }
-            // Lower pre/post operators to functions
-            // Pre: (function() expr = expr OP 1; return expr)()
-            // Post: (function() local _ = expr; expr = expr OP 1; return _)()
-            case UO_PreDec:
-                std::cout << "(function() ";
-                TraverseStmt(unaryOperator->getSubExpr());
-                std::cout << " = ";
-                TraverseStmt(unaryOperator->getSubExpr());
-                std::cout << " - 1; return ";
-                TraverseStmt(unaryOperator->getSubExpr());
-                std::cout << " end)()";
-                break;
-            case UO_PreInc:
-                std::cout << "(function() ";
-                TraverseStmt(unaryOperator->getSubExpr());
-                std::cout << " = ";
-                TraverseStmt(unaryOperator->getSubExpr());
-                std::cout << " + 1; return ";
-                TraverseStmt(unaryOperator->getSubExpr());
-                std::cout << " end)()";
-                break;
-            case UO_PostDec:
-                std::cout << "(function() local _ = ";
-                TraverseStmt(unaryOperator->getSubExpr());
-                std::cout << "; ";
-                TraverseStmt(unaryOperator->getSubExpr());
-                std::cout << " = ";
-                TraverseStmt(unaryOperator->getSubExpr());
-                std::cout << " - 1; return _ end)()";
-                break;
-            case UO_PostInc:
-                std::cout << "(function() local _ = ";
-                TraverseStmt(unaryOperator->getSubExpr());
-                std::cout << "; ";
-                TraverseStmt(unaryOperator->getSubExpr());
-                std::cout << " = ";
-                TraverseStmt(unaryOperator->getSubExpr());
-                std::cout << " + 1; return _ end)()";
-                break;
-            default:
-                break;
-            }
+        if (!recursive && HasOwnFrame(stmt, child))
+            continue;
+
+        if (AllocatesOnStack(child, recursive, heapLocals))
             return true;
-        }
+    }
+    return false;
+}
 
-        if (auto binaryOperator = dyn_cast<BinaryOperator>(stmt))
-        {
-            if (binaryOperator->isAssignmentOp() && handlingAssignmentInCondition)
-            {
-                std::cout << "(function() ";
-            }
+// The array in `array[i].field`, when array is a variable; null for any
+// other member access
+VarDecl* GetArrayOfMember(MemberExpr* memberExpr)
+{
+    if (memberExpr->isArrow())
+        return nullptr;
 
-            if (binaryOperator->isCompoundAssignmentOp())
+    auto arraySubscriptExpr = dyn_cast<ArraySubscriptExpr>(memberExpr->getBase()->IgnoreParens());
+    return arraySubscriptExpr ? GetReferencedVar(arraySubscriptExpr->getBase()) : nullptr;
+}
+
+// Collects every variable stmt refers to other than as `array[i].field`. An
+// array of structs that isn't collected never has an element used whole,
+// so nothing can point into it.
+void FindWholeArrayUses(Stmt* stmt, std::set<VarDecl*>& vars)
+{
+    if (!stmt)
+        return;
+
+    if (auto memberExpr = dyn_cast<MemberExpr>(stmt))
+    {
+        if (GetArrayOfMember(memberExpr))
+        {
+            auto arraySubscriptExpr = cast<ArraySubscriptExpr>(memberExpr->getBase()->IgnoreParens());
+            FindWholeArrayUses(arraySubscriptExpr->getIdx(), vars);
+            return;
+        }
+    }
+
+    // sizeof doesn't evaluate its operand
+    if (isa<UnaryExprOrTypeTraitExpr>(stmt))
+        return;
+
+    if (auto declRefExpr = dyn_cast<DeclRefExpr>(stmt))
+    {
+        if (auto varDecl = dyn_cast<VarDecl>(declRefExpr->getDecl()))
+            vars.insert(varDecl->getCanonicalDecl());
+    }
+
+    for (auto child : stmt->children())
+        FindWholeArrayUses(child, vars);
+}
+
+// Collects the scalar locals and parameters whose address stmt takes. Under
+// -linear-memory they're stored in the heap, so that the address is real.
+void FindAddressTakenLocals(Stmt* stmt, std::set<VarDecl*>& vars)
+{
+    if (!stmt)
+        return;
+
+    auto unaryOperator = dyn_cast<UnaryOperator>(stmt);
+    if (unaryOperator && unaryOperator->getOpcode() == UO_AddrOf)
+    {
+        auto varDecl = GetReferencedVar(unaryOperator->getSubExpr());
+        if (varDecl && varDecl->hasLocalStorage() && varDecl->getType()->isScalarType() &&
+            !varDecl->getType()->isFunctionPointerType())
+            vars.insert(varDecl->getCanonicalDecl());
+    }
+
+    for (auto child : stmt->children())
+        FindAddressTakenLocals(child, vars);
+}
+
+// True if type is an array of structs that could be split into an array per
+// field: it has one dimension, and every field is a named scalar
+bool IsSplittableStructArray(QualType type, ASTContext& context)
+{
+    auto arrayType = context.getAsConstantArrayType(type);
+    if (!arrayType)
+        return false;
+
+    auto recordType = arrayType->getElementType()->getAs<RecordType>();
+    if (!recordType || recordType->getDecl()->isUnion() || recordType->getDecl()->field_empty())
+        return false;
+
+    for (auto field : recordType->getDecl()->fields())
+    {
+        if (field->getName().empty() || !field->getType()->isScalarType())
+            return false;
+    }
+    return true;
+}
+
+// True if type is a pointer whose null value is always 0, rather than
+// possibly nil: every pointer under -linear-memory, and a pointer to a struct,
+// which is otherwise a reference to its table
+bool IsNullZero(QualType type)
+{
+    if (!type->isPointerType())
+        return false;
+
+    return LinearMemory || type->getPointeeType()->isRecordType();
+}
+
+// Formats a double with as few digits as will read back as the same value.
+// The result always reads as a float rather than an integer in Lua 5.3. Lua
+// has no literals for infinity or NaN, so those become a division.
+lua::ExprPtr MakeNumber(double value)
+{
+    if (std::isnan(value))
+    {
+        return lua::Make<lua::Binary>(lua::BinaryOp::Div, lua::Make<lua::Number>("0.0"),
+                                      lua::Make<lua::Number>("0.0"));
+    }
+
+    if (std::isinf(value))
+    {
+        auto infinity = lua::Make<lua::Binary>(lua::BinaryOp::Div, lua::Make<lua::Number>("1.0"),
+                                               lua::Make<lua::Number>("0.0"));
+        if (value > 0)
+            return std::move(infinity);
+
+        return lua::Make<lua::Unary>(lua::UnaryOp::Neg, lua::Make<lua::Paren>(std::move(infinity)));
+    }
+
+    std::string text;
+    for (int precision = 15; precision <= 17; ++precision)
+    {
+        std::ostringstream ss;
+        ss << std::setprecision(precision) << value;
+        text = ss.str();
+        if (std::strtod(text.c_str(), nullptr) == value)
+            break;
+    }
+
+    if (text.find_first_of(".e") == std::string::npos)
+        text += ".0";
+
+    return lua::Make<lua::Number>(text);
+}
+
+// Reads the value of a decimal integer literal
+bool GetIntegerValue(lua::Expr const& expr, int64_t& value)
+{
+    auto number = dyn_cast<lua::Number>(&expr);
+    if (!number || number->text.empty())
+        return false;
+
+    char* end = nullptr;
+    value = std::strtoll(number->text.c_str(), &end, 10);
+    return *end == '\0';
+}
+
+// Builds expr + delta, folding it when expr is an integer literal
+lua::ExprPtr AddConstant(lua::ExprPtr expr, int64_t delta)
+{
+    if (delta == 0)
+        return expr;
+
+    int64_t value;
+    if (GetIntegerValue(*expr, value))
+        return lua::Make<lua::Number>(std::to_string(value + delta));
+
+    auto op = delta > 0 ? lua::BinaryOp::Add : lua::BinaryOp::Sub;
+    return lua::Make<lua::Binary>(op, std::move(expr),
+                                  lua::Make<lua::Number>(std::to_string(delta > 0 ? delta : -delta)));
+}
+
+// Formats 2^exponent as a hexadecimal literal
+std::string PowerOfTwo(unsigned exponent, int64_t offset = 0)
+{
+    char text[32];
+    std::snprintf(text, sizeof(text), "0x%llX",
+                  static_cast<unsigned long long>((uint64_t(1) << exponent) + offset));
+    return text;
+}
+
+// Wraps an integer into the range of a C integer type of the given width:
+//   unsigned: x & 0xFF (Lua 5.3), x % 0x100 (otherwise)
+//   signed: (x + 0x80 & 0xFF) - 0x80 (Lua 5.3), (x + 0x80) % 0x100 - 0x80 (otherwise)
+// Only the native operators of Lua 5.3 can wrap 64-bit integers, so wider
+// types are left alone elsewhere.
+lua::ExprPtr WrapInteger(lua::ExprPtr expr, unsigned width, bool isUnsigned)
+{
+    if (width >= 64)
+        return expr;
+
+    auto wrap = [width](lua::ExprPtr value) -> lua::ExprPtr {
+        if (Target == LuaTarget::Lua53)
+            return lua::Make<lua::Binary>(lua::BinaryOp::BitAnd, std::move(value),
+                                          lua::Make<lua::Number>(PowerOfTwo(width, -1)));
+        return lua::Make<lua::Binary>(lua::BinaryOp::Mod, std::move(value),
+                                      lua::Make<lua::Number>(PowerOfTwo(width)));
+    };
+
+    if (isUnsigned)
+        return wrap(std::move(expr));
+
+    auto offset = lua::Make<lua::Binary>(lua::BinaryOp::Add, std::move(expr),
+                                         lua::Make<lua::Number>(PowerOfTwo(width - 1)));
+    return lua::Make<lua::Binary>(lua::BinaryOp::Sub, wrap(std::move(offset)),
+                                  lua::Make<lua::Number>(PowerOfTwo(width - 1)));
+}
+
+// Masking with a constant in [0, 0x7FFFFFFF] gives a result that is the same
+// whether it's read as signed or unsigned, so it never needs wrapping
+bool IsPositiveMask(lua::Expr const& expr)
+{
+    int64_t mask;
+    return GetIntegerValue(expr, mask) && mask >= 0 && mask <= 0x7FFFFFFF;
+}
+
+// The library the bitwise operators are lowered to on targets without native
+// ones: bit32 on Lua 5.2, and bit (built in to LuaJIT, LuaBitOp on 5.1)
+char const* GetBitLibrary()
+{
+    return Target == LuaTarget::Lua52 ? "bit32" : "bit";
+}
+
+// bit32 always returns unsigned results and bit always returns signed ones,
+// so a result of the other signedness is wrapped
+lua::ExprPtr FixLibrarySign(bool isUnsigned, lua::ExprPtr call)
+{
+    if (isUnsigned == (Target == LuaTarget::Lua52))
+        return call;
+
+    return WrapInteger(std::move(call), 32, isUnsigned);
+}
+
+// C's bitwise operators work on integers of the width of their type. Lua
+// 5.3's native operators work on 64-bit integers, so results of narrower types
+// are wrapped back into their width (which also makes any overflowing
+// arithmetic feeding them come out right), and 64-bit ones are already exact.
+// bit32 and bit work on 32 bits, and only need the sign of the result fixing.
+lua::ExprPtr MakeBitwise(BinaryOperatorKind opcode, QualType type, lua::ExprPtr lhs,
+                         lua::ExprPtr rhs, ASTContext& context)
+{
+    bool isUnsigned = type->isUnsignedIntegerType();
+    auto width = context.getIntWidth(type);
+
+    if (Target == LuaTarget::Lua53)
+    {
+        lua::BinaryOp op;
+        switch (opcode)
+        {
+        case BO_And:
+        case BO_AndAssign:
+            if (IsPositiveMask(*lhs) || IsPositiveMask(*rhs))
+                return lua::Make<lua::Binary>(lua::BinaryOp::BitAnd, std::move(lhs), std::move(rhs));
+
+            op = lua::BinaryOp::BitAnd;
+            break;
+        case BO_Or:
+        case BO_OrAssign:
+            op = lua::BinaryOp::BitOr;
+            break;
+        case BO_Xor:
+        case BO_XorAssign:
+            op = lua::BinaryOp::BitXor;
+            break;
+        case BO_Shl:
+        case BO_ShlAssign:
+            op = lua::BinaryOp::Shl;
+            break;
+        default:
+        {
+            // >> is a logical shift in Lua, so a signed (arithmetic) shift is
+            // a floor division by a power of two instead
+            if (isUnsigned)
+                return lua::Make<lua::Binary>(lua::BinaryOp::Shr,
+                                              WrapInteger(std::move(lhs), width, true),
+                                              std::move(rhs));
+
+            int64_t shift;
+            lua::ExprPtr divisor;
+            if (GetIntegerValue(*rhs, shift) && shift >= 0 && shift < 63)
+                divisor = lua::Make<lua::Number>(std::to_string(int64_t(1) << shift));
+            else
+                divisor = lua::Make<lua::Binary>(lua::BinaryOp::Shl, lua::Make<lua::Number>("1"),
+                                                 std::move(rhs));
+            return lua::Make<lua::Binary>(lua::BinaryOp::IDiv,
+                                          WrapInteger(std::move(lhs), width, false),
+                                          std::move(divisor));
+        }
+        }
+
+        auto result = lua::Make<lua::Binary>(op, std::move(lhs), std::move(rhs));
+        return WrapInteger(std::move(result), width, isUnsigned);
+    }
+
+    char const* function;
+    switch (opcode)
+    {
+    case BO_And:
+    case BO_AndAssign:
+        function = "band";
+        break;
+    case BO_Or:
+    case BO_OrAssign:
+        function = "bor";
+        break;
+    case BO_Xor:
+    case BO_XorAssign:
+        function = "bxor";
+        break;
+    case BO_Shl:
+    case BO_ShlAssign:
+        function = "lshift";
+        break;
+    default:
+        function = isUnsigned ? "rshift" : "arshift";
+        break;
+    }
+
+    bool isMasked = (opcode == BO_And || opcode == BO_AndAssign) &&
+                    (IsPositiveMask(*lhs) || IsPositiveMask(*rhs));
+
+    auto call = MakeCall(MakeMember(GetBitLibrary(), function), std::move(lhs), std::move(rhs));
+    return isMasked ? std::move(call) : FixLibrarySign(isUnsigned, std::move(call));
+}
+
+// ~x, wrapped in the same way as MakeBitwise
+lua::ExprPtr MakeBitNot(QualType type, lua::ExprPtr operand, ASTContext& context)
+{
+    bool isUnsigned = type->isUnsignedIntegerType();
+
+    if (Target == LuaTarget::Lua53)
+    {
+        auto result = lua::Make<lua::Unary>(lua::UnaryOp::BitNot, std::move(operand));
+        return WrapInteger(std::move(result), context.getIntWidth(type), isUnsigned);
+    }
+
+    return FixLibrarySign(isUnsigned,
+                          MakeCall(MakeMember(GetBitLibrary(), "bnot"), std::move(operand)));
+}
+
+// The statements of a switch from one run of case labels up to the next
+struct SwitchSection
+{
+    std::vector<CaseStmt*> cases;
+    bool isDefault = false;
+    std::vector<Stmt*> stmts;
+};
+
+// A single case label, for dispatching on its value
+struct CaseTarget
+{
+    int64_t value;
+    CaseStmt* caseStmt;
+    std::string label;
+};
+
+// Splits a switch body into its sections. Statements before the first label
+// can never run, and are dropped.
+std::vector<SwitchSection> GetSwitchSections(SwitchStmt* switchStmt)
+{
+    std::vector<Stmt*> stmts;
+    if (auto compoundStmt = dyn_cast<CompoundStmt>(switchStmt->getBody()))
+        stmts.assign(compoundStmt->body_begin(), compoundStmt->body_end());
+    else
+        stmts.push_back(switchStmt->getBody());
+
+    std::vector<SwitchSection> sections;
+    for (auto stmt : stmts)
+    {
+        // Consecutive labels are nested in each other: case 1: case 2: stmt
+        while (isa<SwitchCase>(stmt))
+        {
+            if (sections.empty() || !sections.back().stmts.empty())
+                sections.push_back(SwitchSection());
+
+            if (auto caseStmt = dyn_cast<CaseStmt>(stmt))
+                sections.back().cases.push_back(caseStmt);
+            else
+                sections.back().isDefault = true;
+
+            stmt = cast<SwitchCase>(stmt)->getSubStmt();
+        }
+
+        if (!sections.empty())
+            sections.back().stmts.push_back(stmt);
+    }
+
+    return sections;
+}
+
+// True if control can never reach the end of stmt, because every path ends
+// in a break or return
+bool EndsWithJump(Stmt* stmt)
+{
+    if (isa<BreakStmt>(stmt) || isa<ReturnStmt>(stmt))
+        return true;
+
+    if (auto compoundStmt = dyn_cast<CompoundStmt>(stmt))
+        return !compoundStmt->body_empty() && EndsWithJump(compoundStmt->body_back());
+
+    if (auto ifStmt = dyn_cast<IfStmt>(stmt))
+        return ifStmt->getElse() && EndsWithJump(ifStmt->getThen()) &&
+               EndsWithJump(ifStmt->getElse());
+
+    return false;
+}
+
+// True if stmt contains a break out of the enclosing switch that isn't the
+// last thing to run in its case (tail says whether stmt itself is)
+bool HasNonTailBreak(Stmt* stmt, bool tail)
+{
+    if (!stmt)
+        return false;
+
+    if (isa<BreakStmt>(stmt))
+        return !tail;
+
+    // Breaks in here belong to the inner statement
+    if (isa<ForStmt>(stmt) || isa<WhileStmt>(stmt) || isa<DoStmt>(stmt) || isa<SwitchStmt>(stmt))
+        return false;
+
+    if (auto compoundStmt = dyn_cast<CompoundStmt>(stmt))
+    {
+        for (auto it = compoundStmt->body_begin(); it != compoundStmt->body_end(); ++it)
+        {
+            if (HasNonTailBreak(*it, tail && it + 1 == compoundStmt->body_end()))
+                return true;
+        }
+        return false;
+    }
+
+    if (auto ifStmt = dyn_cast<IfStmt>(stmt))
+        return HasNonTailBreak(ifStmt->getThen(), tail) || HasNonTailBreak(ifStmt->getElse(), tail);
+
+    for (auto child : stmt->children())
+    {
+        if (HasNonTailBreak(child, false))
+            return true;
+    }
+
+    return false;
+}
+
+// Lowers the Clang AST of the main file into a Lua chunk. Statements are
+// appended to the block currently being built; expressions are returned.
+// An expression that needs statements of its own (e.g. `x++` used as a
+// value) hoists them into the current block, ahead of the statement that
+// will consume the expression.
+class DumpVisitor
+{
+  public:
+    DumpVisitor(ASTContext* context, lua::Block& chunk) : context(context), block(&chunk) {}
+
+    void TraverseNewScope(Stmt* stmt, lua::Block& target)
+    {
+        auto parent = block;
+        block = &target;
+        TraverseStmt(stmt);
+        block = parent;
+    }
+
+    // Lowers a C condition. A constant one becomes true or false, because Lua
+    // would consider 0 to be true
+    lua::ExprPtr TraverseCondition(Expr* expr)
+    {
+        bool value;
+        if (!expr->isValueDependent() && !expr->HasSideEffects(*context) &&
+            expr->EvaluateAsBooleanCondition(value, *context))
+            return lua::Make<lua::Boolean>(value);
+
+        // A null pointer is 0, which Lua considers true
+        if (IsNullZero(expr->IgnoreParenImpCasts()->getType()))
+            return lua::Make<lua::Binary>(lua::BinaryOp::Ne, TraverseExpr(expr), lua::Make<lua::Number>("0"));
+
+        return TraverseExpr(expr);
+    }
+
+    lua::ExprPtr TraverseConditionInto(Expr* expr, lua::Block& target)
+    {
+        auto parent = block;
+        block = &target;
+        auto value = TraverseCondition(expr);
+        block = parent;
+        return value;
+    }
+
+    // Lowers expr, hoisting anything it needs to evaluate beforehand into target
+    lua::ExprPtr TraverseExprInto(Expr* expr, lua::Block& target)
+    {
+        auto parent = block;
+        block = &target;
+        auto value = TraverseExpr(expr);
+        block = parent;
+        return value;
+    }
+
+    // Builds the loop for a C loop condition (null means forever). A condition
+    // that needs statements of its own must run them on every iteration, so
+    // they are moved into the top of the body:
+    //   while true do <statements> if not cond then break end ... end
+    std::unique_ptr<lua::While> MakeWhile(Expr* cond)
+    {
+        if (!cond)
+            return lua::Make<lua::While>(lua::Make<lua::Boolean>(true));
+
+        lua::Block pre;
+        auto value = TraverseConditionInto(cond, pre);
+        if (pre.stmts.empty())
+            return lua::Make<lua::While>(std::move(value));
+
+        auto luaWhile = lua::Make<lua::While>(lua::Make<lua::Boolean>(true));
+        luaWhile->body = std::move(pre);
+
+        auto breakIf = lua::Make<lua::If>();
+        lua::IfClause clause;
+        clause.cond = lua::Negate(std::move(value));
+        clause.body.stmts.push_back(lua::Make<lua::Break>());
+        breakIf->clauses.push_back(std::move(clause));
+        luaWhile->body.stmts.push_back(std::move(breakIf));
+
+        return luaWhile;
+    }
+
+    std::string NewTemporary() { return "_tmp" + std::to_string(++temporaryCounter); }
+
+    // Reports an error at location, which fails the file
+    void ReportError(SourceLocation location, char const* message)
+    {
+        auto& diagnostics = context->getDiagnostics();
+        diagnostics.Report(location, diagnostics.getCustomDiagID(DiagnosticsEngine::Error, "%0"))
+            << message;
+    }
+
+    std::string GetNameForVarDecl(VarDecl* varDecl)
+    {
+        auto name = varDecl->getNameAsString();
+
+        if (varDecl->isStaticLocal() && !name.empty())
+        {
+            std::string prefix = "_";
+            for (auto& string : scopeStack)
+                prefix += string + "_";
+            name = prefix + name;
+        }
+
+        return name;
+    }
+
+    // Lowers a statement of a block; nested blocks keep their own scope
+    void TraverseBlockItem(Stmt* stmt)
+    {
+        if (isa<CompoundStmt>(stmt))
+        {
+            auto doStmt = lua::Make<lua::Do>();
+            TraverseNewScope(stmt, doStmt->body);
+            Emit(std::move(doStmt));
+            return;
+        }
+
+        TraverseStmt(stmt);
+    }
+
+    void TraverseLoopBody(Stmt* body, lua::Block& target)
+    {
+        breakTargets.push_back(BreakTarget{true, ""});
+        auto parent = block;
+        block = &target;
+
+        // A body that isn't a block frees what each iteration allocates, as
+        // a block would
+        std::string frame;
+        if (LinearMemory && body && !isa<CompoundStmt>(body) &&
+            AllocatesOnStack(body, false, heapLocals))
+        {
+            frame = "_frame" + std::to_string(++frameCounter);
+            Emit(MakeLocal(frame, MakeCall(MakeMember("heap", "enter"))));
+        }
+
+        TraverseStmt(body);
+
+        if (!frame.empty())
+            EmitLeaveFrame(frame);
+        block = parent;
+        breakTargets.pop_back();
+    }
+
+    void TraverseStmt(Stmt* stmt)
+    {
+        if (!stmt || isa<NullStmt>(stmt))
+            return;
+
+        LineScope lineScope(*this, stmt->getLocStart());
+
+        if (auto expr = dyn_cast<Expr>(stmt))
+        {
+            TraverseDiscardedExpr(expr);
+            return;
+        }
+
+        if (auto compoundStmt = dyn_cast<CompoundStmt>(stmt))
+        {
+            // Local arrays are freed at the end of the block that declares
+            // them. A function's body does this for all of its blocks at once,
+            // as the function's frame is restored when it returns.
+            std::string frame;
+            if (LinearMemory && stmt != functionBody && AllocatesOnStack(stmt, false, heapLocals))
+            {
+                frame = "_frame" + std::to_string(++frameCounter);
+                Emit(MakeLocal(frame, MakeCall(MakeMember("heap", "enter"))));
+            }
+
+            for (auto stmt : compoundStmt->body())
+                TraverseBlockItem(stmt);
+
+            if (!frame.empty())
+                EmitLeaveFrame(frame);
+            return;
+        }
+
+        if (auto ifStmt = dyn_cast<IfStmt>(stmt))
+        {
+            auto luaIf = lua::Make<lua::If>();
+            auto current = luaIf.get();
+            Stmt* elseStmt = ifStmt;
+            while (auto elseIfStmt = dyn_cast_or_null<IfStmt>(elseStmt))
+            {
+                lua::IfClause clause;
+                if (current->clauses.empty())
+                {
+                    clause.cond = TraverseCondition(elseIfStmt->getCond());
+                }
+                else
+                {
+                    // An elseif condition can't hoist past the earlier conditions, so
+                    // continue the chain in a nested if when it needs statements
+                    lua::Block pre;
+                    clause.cond = TraverseConditionInto(elseIfStmt->getCond(), pre);
+                    if (!pre.stmts.empty())
+                    {
+                        auto nestedIf = lua::Make<lua::If>();
+                        auto nested = nestedIf.get();
+                        current->elseBody = std::move(pre);
+                        current->elseBody.stmts.push_back(std::move(nestedIf));
+                        current = nested;
+                    }
+                }
+                TraverseNewScope(elseIfStmt->getThen(), clause.body);
+                current->clauses.push_back(std::move(clause));
+
+                elseStmt = elseIfStmt->getElse();
+            }
+
+            if (elseStmt)
+                TraverseNewScope(elseStmt, current->elseBody);
+
+            Emit(std::move(luaIf));
+            return;
+        }
+
+        if (auto switchStmt = dyn_cast<SwitchStmt>(stmt))
+        {
+            TraverseSwitch(switchStmt);
+            return;
+        }
+
+        if (auto doStmt = dyn_cast<DoStmt>(stmt))
+        {
+            auto repeat = lua::Make<lua::Repeat>();
+            TraverseLoopBody(doStmt->getBody(), repeat->body);
+            // `until` can see the body's locals, so the condition's statements can
+            // simply go at the end of the body
+            repeat->cond = lua::Negate(TraverseConditionInto(doStmt->getCond(), repeat->body));
+            Emit(std::move(repeat));
+            return;
+        }
+
+        if (auto whileStmt = dyn_cast<WhileStmt>(stmt))
+        {
+            auto luaWhile = MakeWhile(whileStmt->getCond());
+            TraverseLoopBody(whileStmt->getBody(), luaWhile->body);
+            Emit(std::move(luaWhile));
+            return;
+        }
+
+        // Counting loops become numeric fors. Everything else is lowered to a
+        // while loop, because C is a wonderful language in which anything can
+        // happen in a for loop's expressions >_>
+        if (auto forStmt = dyn_cast<ForStmt>(stmt))
+        {
+            if (TraverseNumericFor(forStmt))
+                return;
+
+            TraverseStmt(forStmt->getInit());
+
+            auto luaWhile = MakeWhile(forStmt->getCond());
+            TraverseLoopBody(forStmt->getBody(), luaWhile->body);
+            TraverseNewScope(forStmt->getInc(), luaWhile->body);
+            Emit(std::move(luaWhile));
+            return;
+        }
+
+        if (auto returnStmt = dyn_cast<ReturnStmt>(stmt))
+        {
+            auto luaReturn = lua::Make<lua::Return>();
+            auto value = returnStmt->getRetValue();
+
+            // A struct whose arrays are on the function's stack is copied
+            // down to the caller's part of it once the frame is left, which
+            // is safe as the copy is made in ascending order
+            bool relocate =
+                LinearMemory && value && !functionFrame.empty() && HasHeapArrays(value->getType());
+            if (relocate)
+            {
+                auto castExpr = dyn_cast<ImplicitCastExpr>(value);
+                if (castExpr && castExpr->getCastKind() == CK_LValueToRValue)
+                    value = castExpr->getSubExpr();
+            }
+
+            if (value)
+                luaReturn->values.push_back(TraverseExpr(value));
+
+            // The value may be read from the local arrays, and is part of
+            // the function's time, so it's evaluated before either ends
+            if (!luaReturn->values.empty() && (!functionFrame.empty() || !functionTimer.empty()))
+                Reuse(luaReturn->values.back());
+            EmitFunctionExit(true);
+
+            if (relocate)
+            {
+                auto& returned = luaReturn->values.back();
+                returned = MakeCopy(value->getType(), std::move(returned));
+            }
+
+            Emit(std::move(luaReturn));
+            return;
+        }
+
+        if (isa<BreakStmt>(stmt))
+        {
+            if (breakTargets.empty() || breakTargets.back().isLoop)
+                Emit(lua::Make<lua::Break>());
+            else if (!breakTargets.back().label.empty())
+                Emit(lua::Make<lua::Goto>(breakTargets.back().label));
+            // Otherwise it ends a case of an if/elseif chain, and needs nothing
+            return;
+        }
+
+        if (auto declStmt = dyn_cast<DeclStmt>(stmt))
+        {
+            if (declStmt->isSingleDecl())
+            {
+                auto decl = declStmt->getSingleDecl();
+
+                if (isa<EnumDecl>(decl))
+                {
+                    TraverseDecl(decl);
+                    return;
+                }
+            }
+
+            std::vector<VarDecl*> varDecls;
+            for (auto decl : declStmt->decls())
+            {
+                if (auto varDecl = dyn_cast<VarDecl>(decl))
+                {
+                    if (!GetNameForVarDecl(varDecl).empty())
+                        varDecls.push_back(varDecl);
+                }
+                else
+                {
+                    TraverseDecl(decl);
+                }
+            }
+
+            if (varDecls.empty())
+                return;
+
+            // Static locals are globals that are only initialised once
+            if (varDecls.front()->isStaticLocal())
+            {
+                auto luaIf = lua::Make<lua::If>();
+                lua::IfClause clause;
+                for (auto varDecl : varDecls)
+                {
+                    // The initialiser only runs once, so anything it hoists goes in here too
+                    auto parent = block;
+                    block = &clause.body;
+                    isStaticInit = true;
+                    for (auto& var : TraverseVarInits(varDecl))
+                    {
+                        lua::ExprPtr isNil = lua::Make<lua::Binary>(
+                            lua::BinaryOp::Eq, lua::Make<lua::Name>(var.first), lua::Make<lua::Nil>());
+                        if (clause.cond)
+                            clause.cond = lua::Make<lua::Binary>(
+                                lua::BinaryOp::Or, std::move(clause.cond), std::move(isNil));
+                        else
+                            clause.cond = std::move(isNil);
+
+                        Emit(lua::Make<lua::Assign>(lua::Make<lua::Name>(var.first), std::move(var.second)));
+                    }
+                    isStaticInit = false;
+                    block = parent;
+                }
+                luaIf->clauses.push_back(std::move(clause));
+                Emit(std::move(luaIf));
+                return;
+            }
+
+            // One local per declarator: each initialiser may hoist statements,
+            // and may refer to the variables declared before it
+            for (auto varDecl : varDecls)
+            {
+                for (auto& var : TraverseVarInits(varDecl))
+                    Emit(MakeLocal(var.first, std::move(var.second)));
+            }
+            return;
+        }
+    }
+
+    // Lowers `for (i = a; i < b; i += c)` to `for i = a, b - 1, c do` when that
+    // is exact: i is an integer local, b is an integer in the range of i's type
+    // that doesn't change while the loop runs, c is a constant stepping
+    // towards b, and only the increment writes i.
+    // Returns false without emitting anything for any other loop.
+    bool TraverseNumericFor(ForStmt* forStmt)
+    {
+        VarDecl* var = nullptr;
+        Expr* start = nullptr;
+        if (auto declStmt = dyn_cast_or_null<DeclStmt>(forStmt->getInit()))
+        {
+            if (!declStmt->isSingleDecl())
+                return false;
+
+            var = dyn_cast<VarDecl>(declStmt->getSingleDecl());
+            if (!var || var->isStaticLocal())
+                return false;
+
+            start = var->getInit();
+        }
+        else if (auto init = dyn_cast_or_null<BinaryOperator>(forStmt->getInit()))
+        {
+            if (init->getOpcode() != BO_Assign)
+                return false;
+
+            // Lua's loop variable is local to the loop, so the C variable must
+            // not be read after it (or anywhere else)
+            var = GetReferencedVar(init->getLHS());
+            if (!var || !functionBody || ReferencesVar(functionBody, var, forStmt))
+                return false;
+
+            start = init->getRHS();
+        }
+
+        if (!var || !start || !var->hasLocalStorage() || !var->getType()->isIntegerType())
+            return false;
+
+        // Condition: i < b, i <= b, i > b or i >= b (either way around)
+        auto cond = dyn_cast_or_null<BinaryOperator>(
+            forStmt->getCond() ? forStmt->getCond()->IgnoreParenImpCasts() : nullptr);
+        if (!cond)
+            return false;
+
+        auto opcode = cond->getOpcode();
+        Expr* limit = nullptr;
+        if (GetReferencedVar(cond->getLHS()) == var)
+        {
+            limit = cond->getRHS();
+        }
+        else if (GetReferencedVar(cond->getRHS()) == var)
+        {
+            limit = cond->getLHS();
+            opcode = BinaryOperator::reverseComparisonOp(opcode);
+        }
+        else
+        {
+            return false;
+        }
+
+        // C converts i and b to a common type before comparing them, which
+        // only leaves both unchanged if b is an integer that i's type can
+        // hold: not e.g. n / 2.0 or 2.5, or an unsigned n as wide as a signed i
+        auto limitType = limit->IgnoreParenImpCasts()->getType();
+        if (!limitType->isIntegerType() ||
+            (!IsRangeContained(limitType, var->getType(), *context) &&
+             !IsKnownToFit(limit, var->getType(), *context)))
+            return false;
+
+        // Increment: ++i, i++, --i, i--, i += c or i -= c
+        auto inc = forStmt->getInc() ? forStmt->getInc()->IgnoreParens() : nullptr;
+        int64_t step = 0;
+        if (auto unaryOperator = dyn_cast_or_null<UnaryOperator>(inc))
+        {
+            if (unaryOperator->isIncrementDecrementOp() &&
+                GetReferencedVar(unaryOperator->getSubExpr()) == var)
+                step = unaryOperator->isIncrementOp() ? 1 : -1;
+        }
+        else if (auto compoundAssign = dyn_cast_or_null<CompoundAssignOperator>(inc))
+        {
+            llvm::APSInt value;
+            auto incOpcode = compoundAssign->getOpcode();
+            if ((incOpcode == BO_AddAssign || incOpcode == BO_SubAssign) &&
+                GetReferencedVar(compoundAssign->getLHS()) == var &&
+                compoundAssign->getRHS()->EvaluateAsInt(value, *context))
+            {
+                step = value.getSExtValue();
+                if (incOpcode == BO_SubAssign)
+                    step = -step;
+            }
+        }
+
+        // Lua's limit is inclusive, and the step has to head towards it
+        int64_t limitAdjustment;
+        switch (opcode)
+        {
+        case BO_LT:
+            limitAdjustment = -1;
+            break;
+        case BO_LE:
+            limitAdjustment = 0;
+            break;
+        case BO_GT:
+            limitAdjustment = 1;
+            break;
+        case BO_GE:
+            limitAdjustment = 0;
+            break;
+        default:
+            return false;
+        }
+
+        bool ascending = opcode == BO_LT || opcode == BO_LE;
+        if (step == 0 || (step > 0) != ascending)
+            return false;
+
+        // A variable in the heap could be written through a pointer, and Lua's
+        // loop variable has no address
+        auto body = forStmt->getBody();
+        if (WritesVar(body, var) || ReferencesVar(limit, var) || !IsLoopInvariant(limit, body) ||
+            ReferencesAnyVar(limit, heapLocals) || heapLocals.count(var->getCanonicalDecl()))
+            return false;
+
+        auto numericFor = lua::Make<lua::NumericFor>(GetNameForVarDecl(var));
+        numericFor->start = TraverseExpr(start);
+        numericFor->limit = AddConstant(TraverseExpr(limit), limitAdjustment);
+        if (step != 1)
+            numericFor->step = lua::Make<lua::Number>(std::to_string(step));
+        TraverseLoopBody(body, numericFor->body);
+        Emit(std::move(numericFor));
+        return true;
+    }
+
+    // Switches become an if/elseif chain when no case falls through into the
+    // next, and a ladder of gotos otherwise:
+    //   if _switchN == 1 then goto _switchN_case1 elseif ... end
+    //   ::_switchN_case1:: ... goto _switchN_end ...
+    //   ::_switchN_end::
+    // Large switches dispatch with a binary search instead of testing every
+    // case in turn. Either way the condition is evaluated once, and nothing
+    // is allocated.
+    void TraverseSwitch(SwitchStmt* switchStmt)
+    {
+        auto sections = GetSwitchSections(switchStmt);
+        auto id = "_switch" + std::to_string(++switchCounter);
+
+        // More cases than this are dispatched with a binary search
+        size_t const binarySearchThreshold = 8;
+
+        bool fallsThrough = false;
+        bool hasRanges = false;
+        size_t caseCount = 0;
+        for (size_t i = 0; i < sections.size(); ++i)
+        {
+            auto& stmts = sections[i].stmts;
+            for (size_t j = 0; j < stmts.size(); ++j)
+                fallsThrough |= HasNonTailBreak(stmts[j], j + 1 == stmts.size());
+
+            if (i + 1 < sections.size() && (stmts.empty() || !EndsWithJump(stmts.back())))
+                fallsThrough = true;
+
+            for (auto caseStmt : sections[i].cases)
+                hasRanges |= caseStmt->getRHS() != nullptr;
+            caseCount += sections[i].cases.size();
+        }
+        // Lua 5.1 has no goto, so its ladder tests every case in turn
+        bool binarySearch = !hasRanges && caseCount > binarySearchThreshold &&
+                            Target != LuaTarget::Lua51;
+
+        if (!fallsThrough && !binarySearch)
+        {
+            auto value = GetSwitchValue(switchStmt, id);
+            breakTargets.push_back(BreakTarget{false, ""});
+
+            auto luaIf = lua::Make<lua::If>();
+            SwitchSection* defaultSection = nullptr;
+            for (auto& section : sections)
+            {
+                if (section.isDefault)
+                {
+                    defaultSection = &section;
+                    continue;
+                }
+
+                lua::IfClause clause;
+                clause.cond = MakeSectionMatch(value, section);
+                TraverseSectionInto(section, clause.body);
+                luaIf->clauses.push_back(std::move(clause));
+            }
+            if (defaultSection)
+                TraverseSectionInto(*defaultSection, luaIf->elseBody);
+
+            breakTargets.pop_back();
+
+            // A switch with nothing but a default always runs it
+            if (luaIf->clauses.empty())
+            {
+                auto doStmt = lua::Make<lua::Do>();
+                doStmt->body = std::move(luaIf->elseBody);
+                Emit(std::move(doStmt));
+            }
+            else
+            {
+                Emit(std::move(luaIf));
+            }
+            return;
+        }
+
+        if (Target == LuaTarget::Lua51)
+        {
+            TraverseSwitchWithoutGoto(switchStmt, sections, id);
+            return;
+        }
+
+        // The end label has to be the last statement of its block, so the
+        // ladder gets a block of its own
+        auto wrapper = lua::Make<lua::Do>();
+        auto parent = block;
+        block = &wrapper->body;
+
+        auto value = GetSwitchValue(switchStmt, id);
+        auto endLabel = id + "_end";
+        auto defaultLabel = endLabel;
+        std::vector<std::string> labels;
+        for (size_t i = 0; i < sections.size(); ++i)
+        {
+            labels.push_back(id + (sections[i].isDefault ? "_default" : "_case" + std::to_string(i + 1)));
+            if (sections[i].isDefault)
+                defaultLabel = labels.back();
+        }
+
+        if (binarySearch)
+        {
+            std::vector<CaseTarget> cases;
+            for (size_t i = 0; i < sections.size(); ++i)
+            {
+                for (auto caseStmt : sections[i].cases)
+                {
+                    llvm::APSInt caseValue;
+                    caseStmt->getLHS()->EvaluateAsInt(caseValue, *context);
+                    cases.push_back(CaseTarget{caseValue.getExtValue(), caseStmt, labels[i]});
+                }
+            }
+            std::sort(cases.begin(), cases.end(),
+                      [](CaseTarget const& a, CaseTarget const& b) { return a.value < b.value; });
+            EmitBinaryDispatch(value, cases, 0, cases.size());
+            Emit(lua::Make<lua::Goto>(defaultLabel));
+        }
+        else
+        {
+            auto dispatch = lua::Make<lua::If>();
+            for (size_t i = 0; i < sections.size(); ++i)
+            {
+                if (sections[i].isDefault)
+                    continue;
+
+                lua::IfClause clause;
+                clause.cond = MakeSectionMatch(value, sections[i]);
+                clause.body.stmts.push_back(lua::Make<lua::Goto>(labels[i]));
+                dispatch->clauses.push_back(std::move(clause));
+            }
+            dispatch->elseBody.stmts.push_back(lua::Make<lua::Goto>(defaultLabel));
+
+            if (dispatch->clauses.empty())
+                Emit(lua::Make<lua::Goto>(defaultLabel));
+            else
+                Emit(std::move(dispatch));
+        }
+
+        breakTargets.push_back(BreakTarget{false, endLabel});
+        for (size_t i = 0; i < sections.size(); ++i)
+        {
+            Emit(lua::Make<lua::Label>(labels[i]));
+
+            // A goto can't jump into the scope of a local, so a case that
+            // declares any keeps them to itself
+            lua::Block body;
+            TraverseSectionInto(sections[i], body);
+            bool declaresLocals = false;
+            for (auto& stmt : body.stmts)
+                declaresLocals |= isa<lua::Local>(stmt.get());
+
+            if (declaresLocals)
+            {
+                auto doStmt = lua::Make<lua::Do>();
+                doStmt->body = std::move(body);
+                Emit(std::move(doStmt));
+            }
+            else
+            {
+                for (auto& stmt : body.stmts)
+                    Emit(std::move(stmt));
+            }
+        }
+        breakTargets.pop_back();
+
+        // Breaking out of the last case just falls through to the end
+        auto& stmts = wrapper->body.stmts;
+        if (!stmts.empty())
+        {
+            auto lastGoto = dyn_cast<lua::Goto>(stmts.back().get());
+            if (lastGoto && lastGoto->label == endLabel)
+                stmts.pop_back();
+        }
+        Emit(lua::Make<lua::Label>(endLabel));
+
+        block = parent;
+        Emit(std::move(wrapper));
+    }
+
+    // Lua 5.1 has no goto, so a switch that falls through becomes
+    //   repeat
+    //       local _switchN_fall = false
+    //       if _switchN_fall or _switchN == 1 then _switchN_fall = true ... end
+    //       ...
+    //   until true
+    // where break leaves the repeat. The default case runs when falling into
+    // it or when none of the other cases match.
+    void TraverseSwitchWithoutGoto(SwitchStmt* switchStmt,
+                                   std::vector<SwitchSection> const& sections,
+                                   std::string const& id)
+    {
+        auto repeat = lua::Make<lua::Repeat>();
+        repeat->cond = lua::Make<lua::Boolean>(true);
+        auto parent = block;
+        block = &repeat->body;
+
+        auto value = GetSwitchValue(switchStmt, id);
+        auto fallFlag = id + "_fall";
+        Emit(MakeLocal(fallFlag, lua::Make<lua::Boolean>(false)));
+
+        breakTargets.push_back(BreakTarget{true, ""});
+        for (size_t i = 0; i < sections.size(); ++i)
+        {
+            lua::ExprPtr match;
+            if (sections[i].isDefault)
+            {
+                for (auto& other : sections)
+                {
+                    if (other.isDefault)
+                        continue;
+
+                    auto otherMatch = MakeSectionMatch(value, other);
+                    if (match)
+                        match = lua::Make<lua::Binary>(lua::BinaryOp::Or, std::move(match),
+                                                       std::move(otherMatch));
+                    else
+                        match = std::move(otherMatch);
+                }
+                if (match)
+                    match = lua::Negate(std::move(match));
+                else
+                    match = lua::Make<lua::Boolean>(true);
+            }
+            else
+            {
+                match = MakeSectionMatch(value, sections[i]);
+            }
+
+            lua::IfClause clause;
+            if (i == 0)
+                clause.cond = std::move(match);
+            else
+                clause.cond = lua::Make<lua::Binary>(lua::BinaryOp::Or,
+                                                     lua::Make<lua::Name>(fallFlag), std::move(match));
+            if (i + 1 < sections.size())
+                clause.body.stmts.push_back(lua::Make<lua::Assign>(
+                    lua::Make<lua::Name>(fallFlag), lua::Make<lua::Boolean>(true)));
+            TraverseSectionInto(sections[i], clause.body);
+
+            auto luaIf = lua::Make<lua::If>();
+            luaIf->clauses.push_back(std::move(clause));
+            Emit(std::move(luaIf));
+        }
+        breakTargets.pop_back();
+
+        block = parent;
+        Emit(std::move(repeat));
+    }
+
+    // The name the switch condition can be read from. Anything other than a
+    // plain variable is stored in a local first, so it is only evaluated once
+    std::string GetSwitchValue(SwitchStmt* switchStmt, std::string const& id)
+    {
+        auto cond = TraverseExpr(switchStmt->getCond());
+        if (auto name = dyn_cast<lua::Name>(cond.get()))
+            return name->name;
+
+        Emit(MakeLocal(id, std::move(cond)));
+        return id;
+    }
+
+    // value == a or value == b ..., with GNU case ranges as a bounds check
+    lua::ExprPtr MakeSectionMatch(std::string const& value, SwitchSection const& section)
+    {
+        lua::ExprPtr match;
+        for (auto caseStmt : section.cases)
+        {
+            lua::ExprPtr caseMatch;
+            if (caseStmt->getRHS())
+            {
+                caseMatch = lua::Make<lua::Binary>(
+                    lua::BinaryOp::And,
+                    lua::Make<lua::Binary>(lua::BinaryOp::Ge, lua::Make<lua::Name>(value),
+                                           TraverseExpr(caseStmt->getLHS())),
+                    lua::Make<lua::Binary>(lua::BinaryOp::Le, lua::Make<lua::Name>(value),
+                                           TraverseExpr(caseStmt->getRHS())));
+            }
+            else
+            {
+                caseMatch = lua::Make<lua::Binary>(lua::BinaryOp::Eq, lua::Make<lua::Name>(value),
+                                                   TraverseExpr(caseStmt->getLHS()));
+            }
+
+            if (match)
+                match = lua::Make<lua::Binary>(lua::BinaryOp::Or, std::move(match),
+                                               std::move(caseMatch));
+            else
+                match = std::move(caseMatch);
+        }
+        return match;
+    }
+
+    // Emits nested ifs that jump to the label of the case matching value, for
+    // cases sorted by value. Falls through when none of them match.
+    void EmitBinaryDispatch(std::string const& value, std::vector<CaseTarget> const& cases,
+                            size_t begin, size_t end)
+    {
+        if (begin == end)
+            return;
+
+        if (end - begin <= 3)
+        {
+            auto luaIf = lua::Make<lua::If>();
+            for (auto i = begin; i < end; ++i)
+            {
+                lua::IfClause clause;
+                clause.cond = lua::Make<lua::Binary>(lua::BinaryOp::Eq, lua::Make<lua::Name>(value),
+                                                     TraverseExpr(cases[i].caseStmt->getLHS()));
+                clause.body.stmts.push_back(lua::Make<lua::Goto>(cases[i].label));
+                luaIf->clauses.push_back(std::move(clause));
+            }
+            Emit(std::move(luaIf));
+            return;
+        }
+
+        auto middle = begin + (end - begin) / 2;
+        auto luaIf = lua::Make<lua::If>();
+        lua::IfClause clause;
+        clause.cond = lua::Make<lua::Binary>(lua::BinaryOp::Lt, lua::Make<lua::Name>(value),
+                                             TraverseExpr(cases[middle].caseStmt->getLHS()));
+
+        auto parent = block;
+        block = &clause.body;
+        EmitBinaryDispatch(value, cases, begin, middle);
+        block = &luaIf->elseBody;
+        EmitBinaryDispatch(value, cases, middle, end);
+        block = parent;
+
+        luaIf->clauses.push_back(std::move(clause));
+        Emit(std::move(luaIf));
+    }
+
+    void TraverseSectionInto(SwitchSection const& section, lua::Block& target)
+    {
+        auto parent = block;
+        block = &target;
+        for (auto stmt : section.stmts)
+            TraverseBlockItem(stmt);
+        block = parent;
+    }
+
+    // Lowers an expression whose value is unused
+    void TraverseDiscardedExpr(Expr* expr)
+    {
+        expr = expr->IgnoreParenCasts();
+
+        if (auto binaryOperator = dyn_cast<BinaryOperator>(expr))
+        {
+            if (binaryOperator->isAssignmentOp())
+            {
+                TraverseAssignment(binaryOperator, false);
+                return;
+            }
+
+            if (binaryOperator->getOpcode() == BO_Comma)
+            {
+                TraverseDiscardedExpr(binaryOperator->getLHS());
+                TraverseDiscardedExpr(binaryOperator->getRHS());
+                return;
+            }
+        }
+
+        if (auto unaryOperator = dyn_cast<UnaryOperator>(expr))
+        {
+            if (unaryOperator->isIncrementDecrementOp())
+            {
+                TraverseIncrement(unaryOperator, false);
+                return;
+            }
+        }
+
+        // Lua only allows calls and assignments as statements
+        auto value = TraverseExpr(expr);
+        if (isa<lua::Call>(value.get()))
+        {
+            Emit(lua::Make<lua::CallStmt>(std::move(value)));
+        }
+        else
+        {
+            Emit(MakeLocal("_", std::move(value)));
+        }
+    }
+
+    // Emits an assignment. With isValueUsed, returns an expression that
+    // reads the assigned value back; otherwise null.
+    lua::ExprPtr TraverseAssignment(BinaryOperator* binaryOperator, bool isValueUsed)
+    {
+        if (binaryOperator->getType()->isRecordType())
+        {
+            auto target = TraverseStructAssignment(binaryOperator);
+            return isValueUsed ? std::move(target) : nullptr;
+        }
+
+        auto value = TraverseExpr(binaryOperator->getRHS());
+        auto compoundAssign = dyn_cast<CompoundAssignOperator>(binaryOperator);
+        auto target = compoundAssign || isValueUsed ? TraverseLValue(binaryOperator->getLHS())
+                                                    : TraverseExpr(binaryOperator->getLHS());
+        if (compoundAssign)
+        {
+            // The operation is done in the common type of both sides, and
+            // converted back to the LHS's type (e.g. `i *= 0.5` truncates)
+            value = MakeBinary(binaryOperator, lua::Clone(*target), std::move(value));
+            value = MakeConversion(compoundAssign->getComputationResultType(),
+                                   binaryOperator->getType(), std::move(value));
+        }
+
+        auto result = isValueUsed ? lua::Clone(*target) : nullptr;
+        Emit(lua::Make<lua::Assign>(std::move(target), std::move(value)));
+        return result;
+    }
+
+    // Emits `x = x + 1` (or `- 1`), wrapped into x's type, for ++/--. With
+    // isValueUsed, returns an expression holding the result, which is read
+    // into a temporary (the old value, or for a prefix operator on anything
+    // but a name, the new one) rather than by reading an element of a table
+    // again; otherwise null.
+    lua::ExprPtr TraverseIncrement(UnaryOperator* unaryOperator, bool isValueUsed)
+    {
+        auto op = unaryOperator->isIncrementOp() ? lua::BinaryOp::Add : lua::BinaryOp::Sub;
+
+        // Pointers move by the size of what they point to
+        int64_t step = 1;
+        auto type = unaryOperator->getSubExpr()->getType();
+        if (LinearMemory && type->isPointerType())
+            step = GetPointeeSize(type);
+
+        auto target = TraverseLValue(unaryOperator->getSubExpr());
+        auto current = lua::Clone(*target);
+        lua::ExprPtr result;
+        if (isValueUsed && unaryOperator->isPostfix())
+        {
+            auto name = NewTemporary();
+            Emit(MakeLocal(name, std::move(current)));
+            current = lua::Make<lua::Name>(name);
+            result = lua::Make<lua::Name>(name);
+        }
+
+        lua::ExprPtr value = lua::Make<lua::Binary>(op, std::move(current),
+                                                    lua::Make<lua::Number>(std::to_string(step)));
+
+        // The result is converted back to the operand's type, as for x += 1,
+        // and unsigned arithmetic wraps: unsigned char 255 + 1 is 0, and so
+        // is unsigned UINT_MAX + 1
+        if (type->isIntegerType() && !type->isBooleanType() && !type->isEnumeralType())
+        {
+            if (type->isUnsignedIntegerType())
+                value = WrapInteger(std::move(value), context->getIntWidth(type), true);
+            else if (context->isPromotableIntegerType(type))
+                value = MakeConversion(context->getPromotedIntegerType(type), type, std::move(value));
+        }
+        if (isValueUsed && unaryOperator->isPrefix())
+        {
+            if (isa<lua::Name>(target.get()))
+            {
+                result = lua::Clone(*target);
+            }
+            else
+            {
+                auto name = NewTemporary();
+                Emit(MakeLocal(name, std::move(value)));
+                value = lua::Make<lua::Name>(name);
+                result = lua::Make<lua::Name>(name);
+            }
+        }
+
+        Emit(lua::Make<lua::Assign>(std::move(target), std::move(value)));
+        return result;
+    }
+
+    // Lowers an lvalue that's read as well as written (by ++, --, a compound
+    // assignment, or an assignment whose value is used), so that the result
+    // can be cloned. The table and key it indexes are stored in temporaries,
+    // unless they're cheap to repeat, so that they're only evaluated once:
+    // `hist[data[i]]++` reads data[i] once, and `a[f()] += x` calls f once.
+    lua::ExprPtr TraverseLValue(Expr* expr)
+    {
+        auto lvalue = TraverseExpr(expr->IgnoreParens());
+        if (auto index = dyn_cast<lua::Index>(lvalue.get()))
+        {
+            if (!IsCheapToRepeat(*index->object))
+                Reuse(index->object);
+            if (!IsCheapToRepeat(*index->key))
+                Reuse(index->key);
+        }
+        return lvalue;
+    }
+
+    lua::ExprPtr TraverseVarInit(VarDecl* varDecl)
+    {
+        auto type = varDecl->getType();
+        if (type->isConstantArrayType() && IsInHeap(type))
+            return TraverseHeapArrayInit(varDecl);
+        if (heapLocals.count(varDecl->getCanonicalDecl()))
+            return MakeHeapLocal(type, varDecl->getInit() ? TraverseExpr(varDecl->getInit()) : nullptr);
+
+        if (!varDecl->getInit())
+            return MakeZeroValue(type);
+
+        auto value = TraverseExpr(varDecl->getInit());
+        if (auto constantArrayType = context->getAsConstantArrayType(type))
+            return MakeArray(constantArrayType, std::move(value));
+
+        return value;
+    }
+
+    // The Lua variables a C variable is lowered to, with their initial values.
+    // That's just the one, unless it's an array of structs that is split into
+    // an array per field.
+    std::vector<std::pair<std::string, lua::ExprPtr>> TraverseVarInits(VarDecl* varDecl)
+    {
+        std::vector<std::pair<std::string, lua::ExprPtr>> vars;
+        if (!IsStructOfArrays(varDecl))
+        {
+            vars.emplace_back(GetNameForVarDecl(varDecl), TraverseVarInit(varDecl));
+            return vars;
+        }
+
+        auto arrayType = context->getAsConstantArrayType(varDecl->getType());
+        auto record = arrayType->getElementType()->getAs<RecordType>()->getDecl();
+        auto initListExpr = dyn_cast_or_null<InitListExpr>(varDecl->getInit());
+        for (auto field : record->fields())
+        {
+            // The initialiser is transposed: ps_x = {ps[0].x, ps[1].x, ...}
+            lua::ExprPtr initializer;
+            if (initListExpr)
+            {
+                auto table = lua::Make<lua::Table>();
+                for (unsigned i = 0; i < initListExpr->getNumInits(); ++i)
+                {
+                    auto element = dyn_cast<InitListExpr>(initListExpr->getInit(i)->IgnoreParenImpCasts());
+                    auto index = field->getFieldIndex();
+                    if (element && index < element->getNumInits() && element->getInit(index))
+                        table->items.push_back(TraverseExpr(element->getInit(index)));
+                    else
+                        table->items.push_back(MakeZeroValue(field->getType()));
+                }
+                initializer = std::move(table);
+            }
+
+            vars.emplace_back(GetFieldArrayName(varDecl, field),
+                              MakeTableArray(field->getType(), arrayType->getSize().getLimitedValue(),
+                                             std::move(initializer)));
+        }
+        return vars;
+    }
+
+    // True if varDecl is an array of structs that is split into an array per
+    // field, so that ps[i].x becomes ps_x[i]. Every use of the array has to
+    // access a member of an element, and its initialiser (if any) has to list
+    // the members of each element.
+    bool IsStructOfArrays(VarDecl* varDecl)
+    {
+        if (!IsSplittableStructArray(varDecl->getType(), *context) ||
+            wholeArrayUses.count(varDecl->getCanonicalDecl()))
+            return false;
+
+        // Another file could use a global whole, unless this file has main()
+        // and is the only one being transpiled, and so is the whole program
+        if (varDecl->isExternallyVisible() && !(definesMain && WholeProgram))
+            return false;
+
+        if (auto init = varDecl->getAnyInitializer())
+        {
+            auto initListExpr = dyn_cast<InitListExpr>(init->IgnoreParenImpCasts());
+            if (!initListExpr || init->HasSideEffects(*context))
+                return false;
+
+            for (unsigned i = 0; i < initListExpr->getNumInits(); ++i)
+            {
+                auto element = initListExpr->getInit(i)->IgnoreParenImpCasts();
+                if (!isa<InitListExpr>(element) && !isa<ImplicitValueInitExpr>(element))
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    std::string GetFieldArrayName(VarDecl* varDecl, ValueDecl* field)
+    {
+        return GetNameForVarDecl(varDecl) + "_" + field->getNameAsString();
+    }
+
+    // True if objects of type are stored in the heap under -linear-memory.
+    // Structs, and arrays of them, are always tables.
+    bool IsInHeap(QualType type)
+    {
+        return LinearMemory && !context->getBaseElementType(type)->isRecordType();
+    }
+
+    // A new array, holding initializer's values (a table or a string) followed
+    // by zeros. In the heap, an array in a struct that's made in a function is
+    // on the stack, and freed with the block that makes it.
+    lua::ExprPtr MakeArray(ConstantArrayType const* arrayType, lua::ExprPtr initializer)
+    {
+        QualType type(arrayType, 0);
+        if (!IsInHeap(type))
+            return MakeTableArray(arrayType->getElementType(), arrayType->getSize().getLimitedValue(),
+                                  std::move(initializer));
+
+        auto elementSize = GetTypeSize(context->getBaseElementType(type));
+        lua::ExprList args;
+        args.push_back(lua::Make<lua::Number>(std::to_string(GetTypeSize(type) / elementSize)));
+        args.push_back(lua::Make<lua::Number>(std::to_string(elementSize)));
+        if (initializer)
+            args.push_back(std::move(initializer));
+        auto allocator = functionBody && !isStaticInit ? "stack_array" : "new_array";
+        return lua::Make<lua::Call>(MakeMember("heap", allocator), std::move(args));
+    }
+
+    // A table, or an FFI array for -array-backend=ffi. Each struct in an array
+    // of structs is a table of its own, made by a constructor function.
+    lua::ExprPtr MakeTableArray(QualType elementType, uint64_t size, lua::ExprPtr initializer)
+    {
+        lua::ExprList args;
+        args.push_back(lua::Make<lua::Number>(std::to_string(size)));
+
+        auto constructor = GetFFIArrayConstructor(elementType, *context);
+        if (elementType->isRecordType())
+        {
+            auto function = lua::Make<lua::Function>();
+            function->body.stmts.push_back(lua::Make<lua::Return>(MakeZeroValue(elementType)));
+            args.push_back(std::move(function));
+            constructor = "make_array_of";
+        }
+        else if (constructor.empty())
+        {
+            constructor = "make_array";
+        }
+
+        if (initializer)
+            args.push_back(std::move(initializer));
+        return lua::Make<lua::Call>(MakeMember("mem", constructor), std::move(args));
+    }
+
+    // The value of a variable without an initialiser, or of a member left out
+    // of one
+    lua::ExprPtr MakeZeroValue(QualType type)
+    {
+        if (auto recordType = type->getAs<RecordType>())
+        {
+            auto table = lua::Make<lua::Table>();
+            for (auto field : recordType->getDecl()->fields())
+            {
+                if (field->getName().empty())
+                    continue;
+
+                table->keys.push_back(field->getNameAsString());
+                table->items.push_back(MakeZeroValue(field->getType()));
+            }
+            return std::move(table);
+        }
+
+        if (auto arrayType = context->getAsConstantArrayType(type))
+            return MakeArray(arrayType, nullptr);
+
+        return lua::Make<lua::Number>("0");
+    }
+
+    // {x = a, y = b}. Members left out get their zero value, and arrays are
+    // created as they are for a variable.
+    lua::ExprPtr TraverseStructInit(InitListExpr* initListExpr, RecordDecl* record)
+    {
+        auto table = lua::Make<lua::Table>();
+        for (auto field : record->fields())
+        {
+            if (field->getName().empty())
+                continue;
+
+            // Only one member of a union is initialised
+            if (record->isUnion() && field != initListExpr->getInitializedFieldInUnion())
+                continue;
+
+            auto index = record->isUnion() ? 0 : field->getFieldIndex();
+            Expr* init = index < initListExpr->getNumInits() ? initListExpr->getInit(index) : nullptr;
+
+            lua::ExprPtr value;
+            if (!init || isa<ImplicitValueInitExpr>(init))
+                value = MakeZeroValue(field->getType());
+            else if (auto arrayType = context->getAsConstantArrayType(field->getType()))
+                value = MakeArray(arrayType, TraverseExpr(init));
+            else
+                value = TraverseExpr(init);
+
+            table->keys.push_back(field->getNameAsString());
+            table->items.push_back(std::move(value));
+        }
+        return std::move(table);
+    }
+
+    // A copy of a struct, as C copies them where Lua would share the table:
+    // {x = s.x, y = s.y}. Arrays in it are copied too, onto the heap's stack
+    // if they're in the heap.
+    lua::ExprPtr MakeCopy(QualType type, lua::ExprPtr value)
+    {
+        if (auto recordType = type->getAs<RecordType>())
+        {
+            Reuse(value);
+            auto table = lua::Make<lua::Table>();
+            for (auto field : recordType->getDecl()->fields())
+            {
+                if (field->getName().empty())
+                    continue;
+
+                auto name = field->getNameAsString();
+                table->keys.push_back(name);
+                table->items.push_back(MakeCopy(
+                    field->getType(), lua::Make<lua::Index>(lua::Clone(*value), lua::Make<lua::String>(name))));
+            }
+            return std::move(table);
+        }
+
+        auto arrayType = context->getAsConstantArrayType(type);
+        if (!arrayType)
+            return value;
+
+        lua::ExprList args;
+        args.push_back(std::move(value));
+        if (IsInHeap(type))
+        {
+            auto elementSize = GetTypeSize(context->getBaseElementType(type));
+            args.push_back(lua::Make<lua::Number>(std::to_string(GetTypeSize(type) / elementSize)));
+            args.push_back(lua::Make<lua::Number>(std::to_string(elementSize)));
+            return lua::Make<lua::Call>(MakeMember("heap", "stack_copy"), std::move(args));
+        }
+
+        args.push_back(lua::Make<lua::Number>(std::to_string(arrayType->getSize().getLimitedValue())));
+
+        // Elements that are tables themselves are copied one by one
+        auto elementType = arrayType->getElementType();
+        if (elementType->isRecordType() || elementType->isConstantArrayType())
+        {
+            auto function = lua::Make<lua::Function>();
+            function->params.push_back("element");
+
+            auto parent = block;
+            block = &function->body;
+            auto copy = MakeCopy(elementType, lua::Make<lua::Name>("element"));
+            Emit(lua::Make<lua::Return>(std::move(copy)));
+            block = parent;
+
+            args.push_back(std::move(function));
+        }
+        return lua::Make<lua::Call>(MakeMember("mem", "copy_array"), std::move(args));
+    }
+
+    // Copies a struct into the table it's assigned to, one member at a time,
+    // so that pointers to it see the new value: a.x, a.y = b.x, b.y. Returns
+    // the table.
+    lua::ExprPtr TraverseStructAssignment(BinaryOperator* binaryOperator)
+    {
+        // The source is only read, so it doesn't need to be copied first
+        auto rhs = binaryOperator->getRHS();
+        auto castExpr = dyn_cast<ImplicitCastExpr>(rhs);
+        if (castExpr && castExpr->getCastKind() == CK_LValueToRValue)
+            rhs = castExpr->getSubExpr();
+
+        auto source = TraverseExpr(rhs);
+        Reuse(source);
+        auto target = TraverseExpr(binaryOperator->getLHS());
+        auto targetCopy = Reuse(target);
+
+        auto assign = lua::Make<lua::Assign>();
+        lua::Block heapCopies;
+        AddMemberCopies(binaryOperator->getType(), *target, *source, *assign, heapCopies);
+        if (!assign->targets.empty())
+            Emit(std::move(assign));
+        for (auto& copy : heapCopies.stmts)
+            Emit(std::move(copy));
+        return targetCopy;
+    }
+
+    // Arrays in the heap are copied into the target's own, with heap.copy
+    // calls added to heapCopies, rather than replaced by new ones
+    void AddMemberCopies(QualType type, lua::Expr const& target, lua::Expr const& source,
+                         lua::Assign& assign, lua::Block& heapCopies)
+    {
+        for (auto field : type->getAs<RecordType>()->getDecl()->fields())
+        {
+            if (field->getName().empty())
+                continue;
+
+            auto name = field->getNameAsString();
+            auto targetMember = lua::Make<lua::Index>(lua::Clone(target), lua::Make<lua::String>(name));
+            auto sourceMember = lua::Make<lua::Index>(lua::Clone(source), lua::Make<lua::String>(name));
+            if (field->getType()->isRecordType())
+            {
+                AddMemberCopies(field->getType(), *targetMember, *sourceMember, assign, heapCopies);
+                continue;
+            }
+
+            if (field->getType()->isConstantArrayType() && IsInHeap(field->getType()))
+            {
+                auto elementSize = GetTypeSize(context->getBaseElementType(field->getType()));
+                auto count = GetTypeSize(field->getType()) / elementSize;
+                lua::ExprList args;
+                args.push_back(std::move(targetMember));
+                args.push_back(std::move(sourceMember));
+                args.push_back(lua::Make<lua::Number>(std::to_string(count)));
+                args.push_back(lua::Make<lua::Number>(std::to_string(elementSize)));
+                auto copy = lua::Make<lua::Call>(MakeMember("heap", "copy"), std::move(args));
+                heapCopies.stmts.push_back(lua::Make<lua::CallStmt>(std::move(copy)));
+                continue;
+            }
+
+            assign.targets.push_back(std::move(targetMember));
+            assign.values.push_back(MakeCopy(field->getType(), std::move(sourceMember)));
+        }
+    }
+
+    // A scalar local whose address is taken, on the heap's stack: the Lua
+    // local holds the address of a cell initialised to value (or zero)
+    lua::ExprPtr MakeHeapLocal(QualType type, lua::ExprPtr value)
+    {
+        lua::ExprList args;
+        args.push_back(lua::Make<lua::Number>("1"));
+        args.push_back(lua::Make<lua::Number>(std::to_string(GetTypeSize(type))));
+        if (value)
+        {
+            auto table = lua::Make<lua::Table>();
+            table->items.push_back(std::move(value));
+            args.push_back(std::move(table));
+        }
+        return lua::Make<lua::Call>(MakeMember("heap", "stack_array"), std::move(args));
+    }
+
+    // With -linear-memory, arrays are allocated in the heap: local ones on
+    // its stack, and the rest with malloc. Arrays of arrays are laid out flat,
+    // so the allocation is for the innermost element type.
+    lua::ExprPtr TraverseHeapArrayInit(VarDecl* varDecl)
+    {
+        auto type = varDecl->getType();
+        auto elementSize = GetTypeSize(context->getBaseElementType(type));
+        auto count = GetTypeSize(type) / elementSize;
+
+        lua::ExprPtr initializer;
+        if (auto init = varDecl->getInit())
+        {
+            if (isa<InitListExpr>(init->IgnoreParenImpCasts()))
+            {
+                auto table = lua::Make<lua::Table>();
+                FlattenInitializer(init, type, table->items, false);
+                initializer = std::move(table);
+            }
+            else
+            {
+                initializer = TraverseExpr(init);
+            }
+        }
+
+        lua::ExprList args;
+        args.push_back(lua::Make<lua::Number>(std::to_string(count)));
+        args.push_back(lua::Make<lua::Number>(std::to_string(elementSize)));
+        if (initializer)
+            args.push_back(std::move(initializer));
+
+        auto allocator = varDecl->hasLocalStorage() ? "stack_array" : "new_array";
+        return lua::Make<lua::Call>(MakeMember("heap", allocator), std::move(args));
+    }
+
+    // Appends the innermost initialisers of an array in memory order. A row
+    // that is followed by another is padded with zeros up to its full size,
+    // so every value lands at its element's offset.
+    void FlattenInitializer(Expr* init, QualType type, lua::ExprList& values, bool pad)
+    {
+        auto arrayType = context->getAsConstantArrayType(type);
+        auto initList = dyn_cast<InitListExpr>(init->IgnoreParenImpCasts());
+        if (!arrayType || !initList)
+        {
+            values.push_back(TraverseExpr(init));
+            return;
+        }
+
+        auto start = values.size();
+        auto initCount = initList->getNumInits();
+        for (unsigned i = 0; i < initCount; ++i)
+            FlattenInitializer(initList->getInit(i), arrayType->getElementType(), values, i + 1 < initCount);
+
+        if (pad)
+        {
+            auto count = GetTypeSize(type) / GetTypeSize(context->getBaseElementType(type));
+            while (values.size() < start + count)
+                values.push_back(lua::Make<lua::Number>("0"));
+        }
+    }
+
+    int64_t GetTypeSize(QualType type)
+    {
+        if (type->isVoidType() || type->isFunctionType())
+            return 1;
+        return context->getTypeSizeInChars(type).getQuantity();
+    }
+
+    // The size of the objects a pointer points to, which pointer arithmetic
+    // is scaled by
+    int64_t GetPointeeSize(QualType pointerType)
+    {
+        return GetTypeSize(pointerType->getPointeeType());
+    }
+
+    // address + index * elementSize, folding whatever is constant
+    lua::ExprPtr MakeAddress(lua::ExprPtr address, lua::ExprPtr index, int64_t elementSize)
+    {
+        auto offset = ScaleOffset(std::move(index), elementSize);
+        int64_t value;
+        if (GetIntegerValue(*offset, value))
+            return AddConstant(std::move(address), value);
+
+        return lua::Make<lua::Binary>(lua::BinaryOp::Add, std::move(address), std::move(offset));
+    }
+
+    lua::ExprPtr ScaleOffset(lua::ExprPtr index, int64_t elementSize)
+    {
+        int64_t value;
+        if (GetIntegerValue(*index, value))
+            return lua::Make<lua::Number>(std::to_string(value * elementSize));
+        if (elementSize == 1)
+            return index;
+
+        return lua::Make<lua::Binary>(lua::BinaryOp::Mul, std::move(index),
+                                      lua::Make<lua::Number>(std::to_string(elementSize)));
+    }
+
+    // HEAP[address]. An array isn't loaded, as it decays to its address.
+    lua::ExprPtr MakeLoad(lua::ExprPtr address, QualType type)
+    {
+        if (type->isArrayType())
+            return address;
+
+        return lua::Make<lua::Index>(lua::Make<lua::Name>("HEAP"), std::move(address));
+    }
+
+    // The address of an lvalue under -linear-memory, or null if it isn't in
+    // the heap (e.g. a global scalar, which is a Lua global, or a member of a
+    // struct, which is a table)
+    lua::ExprPtr TraverseAddress(Expr* expr)
+    {
+        expr = expr->IgnoreParens();
+
+        if (expr->getType()->isArrayType())
+            return TraverseExpr(expr);
+
+        if (auto arraySubscriptExpr = dyn_cast<ArraySubscriptExpr>(expr))
+        {
+            return MakeAddress(TraverseExpr(arraySubscriptExpr->getBase()),
+                               TraverseExpr(arraySubscriptExpr->getIdx()),
+                               GetTypeSize(arraySubscriptExpr->getType()));
+        }
+
+        auto unaryOperator = dyn_cast<UnaryOperator>(expr);
+        if (unaryOperator && unaryOperator->getOpcode() == UO_Deref)
+            return TraverseExpr(unaryOperator->getSubExpr());
+
+        // A local in the heap holds its own address
+        auto varDecl = GetReferencedVar(expr);
+        if (varDecl && heapLocals.count(varDecl->getCanonicalDecl()))
+            return lua::Make<lua::Name>(GetNameForVarDecl(varDecl));
+
+        return nullptr;
+    }
+
+    // Whether the block being emitted ends with a jump, after which nothing
+    // is reachable
+    bool BlockEndsWithJump() const
+    {
+        if (block->stmts.empty())
+            return false;
+        auto last = block->stmts.back().get();
+        return isa<lua::Return>(last) || isa<lua::Break>(last) || isa<lua::Goto>(last);
+    }
+
+    // Frees the function's local arrays and stops its timer, if it has
+    // either, before a return or at the end of the function
+    void EmitFunctionExit(bool isReturn)
+    {
+        if (!isReturn && BlockEndsWithJump())
+            return;
+
+        if (!functionFrame.empty())
+        {
+            Emit(lua::Make<lua::CallStmt>(
+                MakeCall(MakeMember("heap", "leave"), lua::Make<lua::Name>(functionFrame))));
+        }
+        if (!functionTimer.empty())
+        {
+            Emit(lua::Make<lua::CallStmt>(MakeCall(MakeMember("instrument", "leave"),
+                                                   lua::Make<lua::String>(scopeStack.back()),
+                                                   lua::Make<lua::Name>(functionTimer))));
+        }
+    }
+
+    // Frees the local arrays allocated since frame was saved, unless the
+    // block has already been left
+    void EmitLeaveFrame(std::string const& frame)
+    {
+        if (BlockEndsWithJump())
+            return;
+
+        Emit(lua::Make<lua::CallStmt>(MakeCall(MakeMember("heap", "leave"), lua::Make<lua::Name>(frame))));
+    }
+
+    lua::ExprPtr TraverseExpr(Expr* expr)
+    {
+        if (!expr)
+            return lua::Make<lua::Nil>();
+
+        if (auto constant = FoldConstant(expr))
+            return constant;
+
+        if (auto callExpr = dyn_cast<CallExpr>(expr))
+        {
+            auto callee = TraverseExpr(callExpr->getCallee());
+            lua::ExprList args;
+            for (auto arg : callExpr->arguments())
+                args.push_back(TraverseExpr(arg));
+
+            return lua::Make<lua::Call>(std::move(callee), std::move(args));
+        }
+
+        if (auto arraySubscriptExpr = dyn_cast<ArraySubscriptExpr>(expr))
+        {
+            auto base = TraverseExpr(arraySubscriptExpr->getBase());
+            auto index = TraverseExpr(arraySubscriptExpr->getIdx());
+
+            // Arrays of structs are tables of tables, as structs aren't laid
+            // out in the heap
+            if (LinearMemory && !arraySubscriptExpr->getType()->isRecordType())
+            {
+                return MakeLoad(MakeAddress(std::move(base), std::move(index),
+                                            GetTypeSize(arraySubscriptExpr->getType())),
+                                arraySubscriptExpr->getType());
+            }
+
+            // Add 1 to compensate for 1-based indexing, unless the array is an
+            // FFI array. The element type decides that, so it's the same
+            // wherever the array is used.
+            bool isFFIArray = !GetFFIArrayConstructor(arraySubscriptExpr->getType(), *context).empty();
+            return lua::Make<lua::Index>(std::move(base), AddConstant(std::move(index), isFFIArray ? 0 : 1));
+        }
+
+        if (auto memberExpr = dyn_cast<MemberExpr>(expr))
+        {
+            auto field = memberExpr->getMemberDecl();
+
+            // An array of structs split into an array per field
+            auto array = GetArrayOfMember(memberExpr);
+            if (array && IsStructOfArrays(array))
+            {
+                auto arraySubscriptExpr = cast<ArraySubscriptExpr>(memberExpr->getBase()->IgnoreParens());
+                auto index = TraverseExpr(arraySubscriptExpr->getIdx());
+                bool isFFIArray = !GetFFIArrayConstructor(field->getType(), *context).empty();
+                return lua::Make<lua::Index>(lua::Make<lua::Name>(GetFieldArrayName(array, field)),
+                                             AddConstant(std::move(index), isFFIArray ? 0 : 1));
+            }
+
+            // A pointer to a struct is a reference to its table, so -> and .
+            // are the same
+            return lua::Make<lua::Index>(TraverseExpr(memberExpr->getBase()),
+                                         lua::Make<lua::String>(field->getNameAsString()));
+        }
+
+        if (auto unaryOperator = dyn_cast<UnaryOperator>(expr))
+            return TraverseUnaryOperator(unaryOperator);
+
+        if (auto binaryOperator = dyn_cast<BinaryOperator>(expr))
+            return TraverseBinaryOperator(binaryOperator);
+
+        if (auto conditionalOperator = dyn_cast<ConditionalOperator>(expr))
+            return TraverseConditionalOperator(conditionalOperator);
+
+        if (auto parenExpr = dyn_cast<ParenExpr>(expr))
+        {
+            // Parentheses around something that was hoisted (e.g. `(c = getchar())`)
+            // are left wrapping a single name, and serve no purpose
+            auto value = TraverseExpr(parenExpr->getSubExpr());
+            if (isa<lua::Name>(value.get()))
+                return value;
+
+            return lua::Make<lua::Paren>(std::move(value));
+        }
+
+        if (auto castExpr = dyn_cast<CastExpr>(expr))
+        {
+            auto subExpr = castExpr->getSubExpr();
+
+            // Reading a struct copies it
+            if (castExpr->getCastKind() == CK_LValueToRValue && castExpr->getType()->isRecordType())
+                return MakeCopy(castExpr->getType(), TraverseExpr(subExpr));
+
+            return MakeConversion(subExpr->getType(), castExpr->getType(), TraverseExpr(subExpr), subExpr);
+        }
+
+        if (auto initListExpr = dyn_cast<InitListExpr>(expr))
+        {
+            if (auto recordType = initListExpr->getType()->getAs<RecordType>())
+                return TraverseStructInit(initListExpr, recordType->getDecl());
+
+            auto table = lua::Make<lua::Table>();
+            for (unsigned i = 0; i < initListExpr->getNumInits(); ++i)
+                table->items.push_back(TraverseExpr(initListExpr->getInit(i)));
+
+            return std::move(table);
+        }
+
+        if (auto stringLiteral = dyn_cast<StringLiteral>(expr))
+            return lua::Make<lua::String>(stringLiteral->getString().str());
+
+        // Members and elements left out of an initialiser
+        if (isa<ImplicitValueInitExpr>(expr))
+            return MakeZeroValue(expr->getType());
+
+        // Literals that couldn't be folded, e.g. an infinite float
+        if (auto floatingLiteral = dyn_cast<FloatingLiteral>(expr))
+            return MakeNumber(floatingLiteral->getValueAsApproximateDouble());
+
+        if (auto declRefExpr = dyn_cast<DeclRefExpr>(expr))
+        {
+            auto decl = declRefExpr->getDecl();
+
+            // Anything declared outside the main file is defined by a shim
+            auto& sourceManager = context->getSourceManager();
+            bool isShim = sourceManager.getFileID(decl->getLocation()) != sourceManager.getMainFileID();
+            if (isShim && (isa<FunctionDecl>(decl) || isa<VarDecl>(decl)))
+                shimGlobals.insert(decl->getNameAsString());
+
+            if (auto varDecl = dyn_cast<VarDecl>(decl))
+            {
+                // A local in the heap holds its address
+                auto name = lua::Make<lua::Name>(GetNameForVarDecl(varDecl));
+                if (heapLocals.count(varDecl->getCanonicalDecl()))
+                    return MakeLoad(std::move(name), varDecl->getType());
+                return std::move(name);
+            }
+
+            return lua::Make<lua::Name>(decl->getNameAsString());
+        }
+
+        // Pass through wrappers we don't care about (e.g. ExprWithCleanups)
+        Expr* onlyChild = nullptr;
+        for (auto child : expr->children())
+        {
+            if (!child)
+                continue;
+
+            if (onlyChild || !isa<Expr>(child))
+                return lua::Make<lua::Nil>();
+
+            onlyChild = cast<Expr>(child);
+        }
+
+        return onlyChild ? TraverseExpr(onlyChild) : lua::Make<lua::Nil>();
+    }
+
+    // Folds a constant expression (literals, character literals, enumerators,
+    // sizeof, and any arithmetic on them) into a single number. Comparisons and
+    // logical operators are left alone, as their result has to stay a Lua
+    // boolean; conditions are folded by TraverseCondition instead.
+    lua::ExprPtr FoldConstant(Expr* expr)
+    {
+        if (expr->isValueDependent() || IsTruthValue(expr))
+            return nullptr;
+
+        auto type = expr->getType();
+        if (type->isIntegerType())
+        {
+            llvm::APSInt value;
+            if (!expr->EvaluateAsInt(value, *context))
+                return nullptr;
+
+            // Lua 5.3 reads a decimal above 2^63 - 1, e.g. ULONG_MAX, as a
+            // float, but wraps a hexadecimal one to the integer with its bits
+            if (Target == LuaTarget::Lua53 && value.isUnsigned() && value.getActiveBits() > 63 &&
+                value.getActiveBits() <= 64)
+                return lua::Make<lua::Number>("0x" + value.toString(16));
+            return lua::Make<lua::Number>(value.toString(10));
+        }
+        else if (type->isRealFloatingType())
+        {
+            Expr::EvalResult result;
+            if (expr->EvaluateAsRValue(result, *context) && !result.HasSideEffects &&
+                result.Val.isFloat())
+            {
+                auto value = result.Val.getFloat();
+                bool losesInfo;
+                value.convert(llvm::APFloat::IEEEdouble, llvm::APFloat::rmNearestTiesToEven,
+                              &losesInfo);
+                if (std::isfinite(value.convertToDouble()))
+                    return MakeNumber(value.convertToDouble());
+            }
+        }
+
+        return nullptr;
+    }
+
+    // Lower the ternary operator to `c and a or b` when a can't be falsy, and to
+    // an if statement assigning a temporary otherwise:
+    //   local _tmpN; if c then _tmpN = a else _tmpN = b end
+    lua::ExprPtr TraverseConditionalOperator(ConditionalOperator* conditionalOperator)
+    {
+        auto cond = TraverseCondition(conditionalOperator->getCond());
+
+        lua::Block trueBody;
+        lua::Block falseBody;
+        auto trueValue = TraverseExprInto(conditionalOperator->getTrueExpr(), trueBody);
+        auto falseValue = TraverseExprInto(conditionalOperator->getFalseExpr(), falseBody);
+
+        if (trueBody.stmts.empty() && falseBody.stmts.empty() && lua::IsAlwaysTruthy(*trueValue))
+        {
+            return lua::Make<lua::Binary>(
+                lua::BinaryOp::Or,
+                lua::Make<lua::Binary>(lua::BinaryOp::And, std::move(cond), std::move(trueValue)),
+                std::move(falseValue));
+        }
+
+        auto name = NewTemporary();
+        auto local = lua::Make<lua::Local>();
+        local->names.push_back(name);
+        Emit(std::move(local));
+
+        auto luaIf = lua::Make<lua::If>();
+        lua::IfClause clause;
+        clause.cond = std::move(cond);
+        clause.body = std::move(trueBody);
+        clause.body.stmts.push_back(
+            lua::Make<lua::Assign>(lua::Make<lua::Name>(name), std::move(trueValue)));
+        luaIf->clauses.push_back(std::move(clause));
+
+        luaIf->elseBody = std::move(falseBody);
+        luaIf->elseBody.stmts.push_back(
+            lua::Make<lua::Assign>(lua::Make<lua::Name>(name), std::move(falseValue)));
+        Emit(std::move(luaIf));
+
+        return lua::Make<lua::Name>(name);
+    }
+
+    lua::ExprPtr TraverseUnaryOperator(UnaryOperator* unaryOperator)
+    {
+        auto subExpr = unaryOperator->getSubExpr();
+        switch (unaryOperator->getOpcode())
+        {
+        case UO_Minus:
+        {
+            // Negating an unsigned value wraps around
+            auto negated = lua::Make<lua::Unary>(lua::UnaryOp::Neg, TraverseExpr(subExpr));
+            auto type = unaryOperator->getType();
+            if (type->isUnsignedIntegerType())
+                return WrapInteger(std::move(negated), context->getIntWidth(type), true);
+            return std::move(negated);
+        }
+        case UO_Plus:
+            return TraverseExpr(subExpr);
+        case UO_Not:
+            return MakeBitNot(unaryOperator->getType(), TraverseExpr(subExpr), *context);
+        case UO_LNot:
+            if (IsNullZero(subExpr->IgnoreParenImpCasts()->getType()))
+                return lua::Make<lua::Binary>(lua::BinaryOp::Eq, TraverseExpr(subExpr),
+                                              lua::Make<lua::Number>("0"));
+            return lua::Make<lua::Unary>(lua::UnaryOp::Not, TraverseExpr(subExpr));
+        case UO_AddrOf:
+        {
+            if (subExpr->getType()->isRecordType())
+                return TraverseExpr(subExpr);
+            if (!LinearMemory)
+                break;
+
+            auto address = TraverseAddress(subExpr);
+            if (address)
+                return address;
+
+            ReportError(unaryOperator->getExprLoc(),
+                        "can't take the address of an object outside the heap with -linear-memory");
+            break;
+        }
+        case UO_Deref:
+        {
+            if (unaryOperator->getType()->isRecordType())
+                return TraverseExpr(subExpr);
+            if (LinearMemory && !subExpr->getType()->isFunctionPointerType())
+                return MakeLoad(TraverseExpr(subExpr), unaryOperator->getType());
+
+            // Special case based on RHS type
+            auto declRefExpr = RecurseUntilType<DeclRefExpr>(subExpr);
+            if (!declRefExpr)
+                break;
+
+            auto decl = declRefExpr->getDecl();
+            auto& type = *decl->getType();
+            if (type.isFunctionPointerType())
+            {
+                // Emit the decl: no dereferencing required
+                return lua::Make<lua::Name>(decl->getNameAsString());
+            }
+            break;
+        }
+        // Hoist pre/post operators used as values out of the expression
+        // Pre: x = x OP 1, then use x; t[k] is read into a temporary:
+        //   local _tmpN = t[k] OP 1; t[k] = _tmpN, then use _tmpN
+        // Post: local _tmpN = expr; expr = _tmpN OP 1, then use _tmpN
+        case UO_PreDec:
+        case UO_PreInc:
+        case UO_PostDec:
+        case UO_PostInc:
+            return TraverseIncrement(unaryOperator, true);
+        default:
+            break;
+        }
+        return lua::Make<lua::Nil>();
+    }
+
+    lua::ExprPtr TraverseBinaryOperator(BinaryOperator* binaryOperator)
+    {
+        // Assignments are statements in Lua, so hoist the assignment and
+        // read the assigned value back
+        if (binaryOperator->isAssignmentOp())
+            return TraverseAssignment(binaryOperator, true);
+
+        // The LHS is evaluated for its side effects before the RHS
+        if (binaryOperator->getOpcode() == BO_Comma)
+        {
+            TraverseDiscardedExpr(binaryOperator->getLHS());
+            return TraverseExpr(binaryOperator->getRHS());
+        }
+
+        auto lhs = TraverseExpr(binaryOperator->getLHS());
+
+        if (!binaryOperator->isLogicalOp())
+        {
+            auto rhs = TraverseExpr(binaryOperator->getRHS());
+            return MakeBinary(binaryOperator, std::move(lhs), std::move(rhs));
+        }
+
+        // The RHS of && and || is only conditionally evaluated, so any statements
+        // it needs have to be guarded:
+        //   local _tmpN = lhs; if _tmpN then <statements> _tmpN = rhs end
+        lua::Block rhsBody;
+        auto rhs = TraverseExprInto(binaryOperator->getRHS(), rhsBody);
+        if (rhsBody.stmts.empty())
+            return MakeBinary(binaryOperator, std::move(lhs), std::move(rhs));
+
+        auto name = NewTemporary();
+        Emit(MakeLocal(name, std::move(lhs)));
+
+        auto luaIf = lua::Make<lua::If>();
+        lua::IfClause clause;
+        clause.cond = lua::Make<lua::Name>(name);
+        if (binaryOperator->getOpcode() == BO_LOr)
+            clause.cond = lua::Negate(std::move(clause.cond));
+        clause.body = std::move(rhsBody);
+        clause.body.stmts.push_back(
+            lua::Make<lua::Assign>(lua::Make<lua::Name>(name), std::move(rhs)));
+        luaIf->clauses.push_back(std::move(clause));
+        Emit(std::move(luaIf));
+
+        return lua::Make<lua::Name>(name);
+    }
+
+    // Also used for compound assignments, which share the lowering of
+    // their non-assigning counterpart
+    lua::ExprPtr MakeBinary(BinaryOperator* binaryOperator, lua::ExprPtr lhs, lua::ExprPtr rhs)
+    {
+        auto opcode = binaryOperator->getOpcode();
+        auto type = binaryOperator->getType();
+        if (auto compoundAssign = dyn_cast<CompoundAssignOperator>(binaryOperator))
+            type = compoundAssign->getComputationResultType();
+
+        bool isAdditive = binaryOperator->isAdditiveOp() || opcode == BO_AddAssign ||
+                          opcode == BO_SubAssign;
+        if (LinearMemory && isAdditive)
+        {
+            auto lhsType = binaryOperator->getLHS()->getType();
+            auto rhsType = binaryOperator->getRHS()->getType();
+            if (lhsType->isPointerType() && rhsType->isPointerType())
+                return MakePointerDifference(std::move(lhs), std::move(rhs), GetPointeeSize(lhsType));
+            if (lhsType->isPointerType())
+                rhs = ScaleOffset(std::move(rhs), GetPointeeSize(lhsType));
+            else if (rhsType->isPointerType())
+                lhs = ScaleOffset(std::move(lhs), GetPointeeSize(rhsType));
+        }
+
+        switch (opcode)
+        {
+        case BO_Shl:
+        case BO_ShlAssign:
+        case BO_Shr:
+        case BO_ShrAssign:
+        case BO_And:
+        case BO_AndAssign:
+        case BO_Xor:
+        case BO_XorAssign:
+        case BO_Or:
+        case BO_OrAssign:
+            return MakeBitwise(opcode, type, std::move(lhs), std::move(rhs), *context);
+        default:
+            break;
+        }
+
+        lua::BinaryOp op;
+        switch (opcode)
+        {
+        case BO_Mul:
+        case BO_MulAssign:
+            op = lua::BinaryOp::Mul;
+            break;
+        case BO_Div:
+        case BO_DivAssign:
+            if (type->isIntegerType())
+                return MakeIntegerDivision(binaryOperator, std::move(lhs), std::move(rhs));
+
+            op = lua::BinaryOp::Div;
+            break;
+        case BO_Rem:
+        case BO_RemAssign:
+            if (!HasNonNegativeOperands(binaryOperator))
+                return MakeCall(MakeMember("math", "fmod"), std::move(lhs), std::move(rhs));
+
+            op = lua::BinaryOp::Mod;
+            break;
+        case BO_Add:
+        case BO_AddAssign:
+            op = lua::BinaryOp::Add;
+            break;
+        case BO_Sub:
+        case BO_SubAssign:
+            op = lua::BinaryOp::Sub;
+            break;
+        case BO_LT:
+            op = lua::BinaryOp::Lt;
+            break;
+        case BO_GT:
+            op = lua::BinaryOp::Gt;
+            break;
+        case BO_LE:
+            op = lua::BinaryOp::Le;
+            break;
+        case BO_GE:
+            op = lua::BinaryOp::Ge;
+            break;
+        case BO_EQ:
+            op = lua::BinaryOp::Eq;
+            break;
+        case BO_NE:
+            op = lua::BinaryOp::Ne;
+            break;
+        case BO_LAnd:
+            op = lua::BinaryOp::And;
+            break;
+        case BO_LOr:
+            op = lua::BinaryOp::Or;
+            break;
+        default:
+            return lua::Make<lua::Nil>();
+        }
+
+        return lua::Make<lua::Binary>(op, std::move(lhs), std::move(rhs));
+    }
+
+    // p - q counts elements, and addresses count bytes. The difference is
+    // always a whole number of elements, so plain division is exact.
+    lua::ExprPtr MakePointerDifference(lua::ExprPtr lhs, lua::ExprPtr rhs, int64_t elementSize)
+    {
+        auto difference = lua::Make<lua::Binary>(lua::BinaryOp::Sub, std::move(lhs), std::move(rhs));
+        if (elementSize == 1)
+            return std::move(difference);
+
+        auto op = Target == LuaTarget::Lua53 ? lua::BinaryOp::IDiv : lua::BinaryOp::Div;
+        return lua::Make<lua::Binary>(op, std::move(difference),
+                                      lua::Make<lua::Number>(std::to_string(elementSize)));
+    }
+
+    bool HasNonNegativeOperands(BinaryOperator* binaryOperator)
+    {
+        return IsKnownNonNegative(binaryOperator->getLHS(), *context) &&
+               IsKnownNonNegative(binaryOperator->getRHS(), *context);
+    }
+
+    // C's integer division truncates towards zero. For non-negative operands
+    // that's the same as flooring: a // b on Lua 5.3, and math.floor(a / b)
+    // elsewhere. Otherwise it's (a - math.fmod(a, b)) // b on Lua 5.3, and
+    // (math.modf(a / b)) elsewhere, as the quotient of two integers that fit
+    // in a double truncates to the right integer.
+    lua::ExprPtr MakeIntegerDivision(BinaryOperator* binaryOperator, lua::ExprPtr lhs,
+                                     lua::ExprPtr rhs)
+    {
+        bool isNonNegative = HasNonNegativeOperands(binaryOperator);
+
+        if (Target == LuaTarget::Lua53)
+        {
+            if (isNonNegative)
+                return lua::Make<lua::Binary>(lua::BinaryOp::IDiv, std::move(lhs), std::move(rhs));
+
+            auto lhsCopy = Reuse(lhs);
+            auto rhsCopy = Reuse(rhs);
+            auto remainder = MakeCall(MakeMember("math", "fmod"), std::move(lhsCopy), std::move(rhsCopy));
+            auto exact = lua::Make<lua::Binary>(lua::BinaryOp::Sub, std::move(lhs), std::move(remainder));
+            return lua::Make<lua::Binary>(lua::BinaryOp::IDiv, std::move(exact), std::move(rhs));
+        }
+
+        auto quotient = lua::Make<lua::Binary>(lua::BinaryOp::Div, std::move(lhs), std::move(rhs));
+        if (isNonNegative)
+            return MakeCall(MakeMember("math", "floor"), std::move(quotient));
+
+        // The parentheses drop modf's second result
+        return lua::Make<lua::Paren>(MakeCall(MakeMember("math", "modf"), std::move(quotient)));
+    }
+
+    // Converts value from one arithmetic type to another. Only conversions
+    // that can change the value need any code: truncating a float to an
+    // integer, and converting an integer to a type it might not fit in.
+    // source is the expression being converted, if there is one.
+    lua::ExprPtr MakeConversion(QualType from, QualType to, lua::ExprPtr value,
+                                Expr* source = nullptr)
+    {
+        if (!to->isIntegerType() || to->isBooleanType() || to->isEnumeralType())
+            return value;
+
+        // Comparisons are Lua booleans rather than numbers
+        if (source && IsTruthValue(source))
+            return value;
+
+        if (from->isRealFloatingType())
+        {
+            // The parentheses drop modf's second result
+            auto truncated = lua::Make<lua::Paren>(MakeCall(MakeMember("math", "modf"), std::move(value)));
+            if (Target == LuaTarget::Lua53)
+                return MakeCall(MakeMember("math", "tointeger"), std::move(truncated));
+            return std::move(truncated);
+        }
+
+        if (!from->isIntegerType() || from->isEnumeralType() || IsRangeContained(from, to, *context))
+            return value;
+        if (source && IsKnownToFit(source, to, *context))
+            return value;
+
+        return WrapInteger(std::move(value), context->getIntWidth(to), to->isUnsignedIntegerType());
+    }
+
+    // Returns a copy of expr to evaluate it a second time. Anything but a
+    // name or a number is stored in a temporary first.
+    lua::ExprPtr Reuse(lua::ExprPtr& expr)
+    {
+        if (!isa<lua::Name>(expr.get()) && !isa<lua::Number>(expr.get()))
+        {
+            auto name = NewTemporary();
+            Emit(MakeLocal(name, std::move(expr)));
+            expr = lua::Make<lua::Name>(name);
+        }
+        return lua::Clone(*expr);
+    }
+
+    void TraverseDecl(Decl* decl)
+    {
+        LineScope lineScope(*this, decl->getLocation());
+        if (auto functionDecl = dyn_cast<FunctionDecl>(decl))
+        {
+            // Skip over function declarations
+            if (!functionDecl->doesThisDeclarationHaveABody())
+                return;
+
+            if (functionDecl->isMain())
+                foundMain = true;
+
+            if (functionDecl->isExternallyVisible())
+                exportedNames.insert(functionDecl->getNameAsString());
+
+            scopeStack.push_back(functionDecl->getNameAsString());
+
+            auto function = lua::Make<lua::FunctionDecl>(functionDecl->getNameAsString());
+            for (auto param : functionDecl->params())
+                function->params.push_back(param->getNameAsString());
+
+            if (functionDecl->hasBody())
+            {
+                functionBody = functionDecl->getBody();
+
+                if (Instrument)
+                {
+                    functionTimer = "_timer";
+                    function->body.stmts.push_back(MakeLocal(
+                        functionTimer, MakeCall(MakeMember("instrument", "enter"),
+                                                lua::Make<lua::String>(function->name))));
+                }
+
+                // The local arrays are freed when the function returns
+                bool hasHeapParam = false;
+                for (auto param : functionDecl->params())
+                {
+                    if (heapLocals.count(param->getCanonicalDecl()))
+                        hasHeapParam = true;
+                }
+                if (LinearMemory &&
+                    (AllocatesOnStack(functionBody, true, heapLocals) || hasHeapParam))
+                {
+                    functionFrame = "_frame";
+                    function->body.stmts.push_back(
+                        MakeLocal(functionFrame, MakeCall(MakeMember("heap", "enter"))));
+                }
+
+                // A parameter whose address is taken is copied into the heap
+                for (auto param : functionDecl->params())
+                {
+                    if (!heapLocals.count(param->getCanonicalDecl()))
+                        continue;
+
+                    auto name = param->getNameAsString();
+                    function->body.stmts.push_back(lua::Make<lua::Assign>(
+                        lua::Make<lua::Name>(name),
+                        MakeHeapLocal(param->getType(), lua::Make<lua::Name>(name))));
+                }
+
+                TraverseNewScope(functionBody, function->body);
+                auto parent = block;
+                block = &function->body;
+                EmitFunctionExit(false);
+                block = parent;
+
+                functionBody = nullptr;
+                functionFrame.clear();
+                functionTimer.clear();
+            }
+
+            Emit(std::move(function));
+
+            scopeStack.pop_back();
+            return;
+        }
+
+        // Global variables; locals are handled by DeclStmt
+        if (auto varDecl = dyn_cast<VarDecl>(decl))
+        {
+            if (GetNameForVarDecl(varDecl).empty())
+                return;
+
+            for (auto& var : TraverseVarInits(varDecl))
+            {
+                if (varDecl->isExternallyVisible())
+                    exportedNames.insert(var.first);
+                Emit(lua::Make<lua::Assign>(lua::Make<lua::Name>(var.first), std::move(var.second)));
+            }
+            return;
+        }
+
+        if (auto enumDecl = dyn_cast<EnumDecl>(decl))
+        {
+            Emit(lua::Make<lua::Comment>(enumDecl->getNameAsString()));
+            for (auto decl : enumDecl->decls())
+                TraverseDecl(decl);
+            return;
+        }
+
+        if (auto enumConstantDecl = dyn_cast<EnumConstantDecl>(decl))
+        {
+            Emit(MakeLocal(enumConstantDecl->getNameAsString(),
+                           lua::Make<lua::Number>(enumConstantDecl->getInitVal().toString(10, true))));
+            return;
+        }
+    }
+
+    // Whether an array of structs can be split depends on all of its uses, so
+    // the main file is looked at as a whole before any of it is lowered
+    void AnalyzeDecls(DeclContext::decl_range decls)
+    {
+        auto& sourceManager = context->getSourceManager();
+        for (auto decl : decls)
+        {
+            if (sourceManager.getFileID(decl->getLocation()) != sourceManager.getMainFileID())
+                continue;
+
+            if (auto functionDecl = dyn_cast<FunctionDecl>(decl))
+            {
+                if (!functionDecl->doesThisDeclarationHaveABody())
+                    continue;
+
+                if (functionDecl->isMain())
+                    definesMain = true;
+                FindWholeArrayUses(functionDecl->getBody(), wholeArrayUses);
+                if (LinearMemory)
+                    FindAddressTakenLocals(functionDecl->getBody(), heapLocals);
+            }
+            else if (auto varDecl = dyn_cast<VarDecl>(decl))
+            {
+                FindWholeArrayUses(varDecl->getInit(), wholeArrayUses);
+            }
+        }
+    }
+
+    // Statements are stamped with the line of the C being lowered, for the
+    // source map
+    void Emit(lua::StmtPtr stmt)
+    {
+        if (!stmt->line)
+            stmt->line = currentLine;
+        block->stmts.push_back(std::move(stmt));
+    }
+
+    bool HasFoundMain() { return foundMain; }
+
+    // The functions and globals other files could use, which are kept even if
+    // this file doesn't use them. A file with main() that's transpiled alone
+    // is taken to be the whole program, as when splitting arrays of structs;
+    // alongside other files, they could still call into it.
+    std::set<std::string> GetExportedNames() const
+    {
+        return foundMain && WholeProgram ? std::set<std::string>() : exportedNames;
+    }
+
+    // The shim globals the lowered code refers to, including the tables that
+    // the lowering itself calls into
+    std::set<std::string> GetShimGlobals() const
+    {
+        auto globals = shimGlobals;
+        globals.insert("mem");
+        globals.insert("math");
+        globals.insert("heap");
+        globals.insert("HEAP");
+        globals.insert(GetBitLibrary());
+        if (Instrument)
+            globals.insert("instrument");
+        if (Profile)
+            globals.insert("profile");
+        return globals;
+    }
+
+  private:
+    // Sets the line statements are emitted with to that of location until it
+    // goes out of scope
+    class LineScope
+    {
+      public:
+        LineScope(DumpVisitor& visitor, SourceLocation location)
+            : visitor(visitor), outerLine(visitor.currentLine)
+        {
+            if (location.isValid())
+                visitor.currentLine = visitor.context->getSourceManager().getExpansionLineNumber(location);
+        }
+
+        ~LineScope() { visitor.currentLine = outerLine; }
+
+      private:
+        DumpVisitor& visitor;
+        uint32_t outerLine;
+    };
+
+    ASTContext* context;
+    lua::Block* block;
+    uint32_t currentLine = 0;
+    Stmt* functionBody = nullptr;
+    // Set while a static local's initialiser is lowered, so its arrays are
+    // allocated for good rather than on the stack
+    bool isStaticInit = false;
+    bool foundMain = false;
+    uint32_t switchCounter = 0;
+    uint32_t temporaryCounter = 0;
+    uint32_t frameCounter = 0;
+    std::string functionFrame;
+    std::string functionTimer;
+    bool definesMain = false;
+    std::set<VarDecl*> wholeArrayUses;
+    // Scalar locals and parameters whose address is taken, which are kept in
+    // the heap under -linear-memory
+    std::set<VarDecl*> heapLocals;
+    std::set<std::string> exportedNames;
+    std::deque<std::string> scopeStack;
+    std::set<std::string> shimGlobals;
+
+    // What a C break leaves: the innermost loop, or the innermost switch, left
+    // with a goto to label (or, in an if/elseif chain, by reaching the end of
+    // the case when label is empty)
+    struct BreakTarget
+    {
+        bool isLoop;
+        std::string label;
+    };
+    std::vector<BreakTarget> breakTargets;
+};
+
+// Where transpiling a file spends its time, for -time-report: the wall time
+// and peak RSS of each phase, and the time taken and bytes emitted to lower
+// each function
+class TimeReport
+{
+  public:
+    explicit TimeReport(std::string const& path) : path(path), startSeconds(GetSeconds())
+    {
+        for (auto name : {"cache", "clang", "includes", "lower", "passes", "print", "bytecode"})
+            phases.push_back(Phase{name, 0, 0, false});
+    }
+
+    static double GetSeconds()
+    {
+        using namespace std::chrono;
+        return duration_cast<duration<double>>(steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Adds seconds to the phase, and records the peak RSS by the end of it.
+    // The peak is the whole process's, so with -j it covers every file being
+    // transpiled at the time.
+    void AddPhase(char const* name, double seconds)
+    {
+        auto phase = std::find_if(phases.begin(), phases.end(),
+                                  [&](Phase const& phase) { return phase.name == name; });
+        phase->seconds += seconds;
+        phase->maxRSS = GetMaxRSS();
+        phase->recorded = true;
+    }
+
+    // Clang calls back into the other phases, so its time is from the start
+    // of the frontend until the AST is complete, less the time they took
+    void BeginFrontend()
+    {
+        frontendStart = GetSeconds();
+        frontendNested = GetTotalSeconds();
+    }
+
+    void EndFrontend()
+    {
+        if (frontendStart < 0)
+            return;
+        AddPhase("clang", GetSeconds() - frontendStart - (GetTotalSeconds() - frontendNested));
+        frontendStart = -1;
+    }
+
+    void AddFunction(std::string const& name, double seconds, size_t bytes)
+    {
+        functions.push_back(Function{name, seconds, bytes});
+    }
+
+    // Records the total time since the report was created
+    void Finish() { totalSeconds = GetSeconds() - startSeconds; }
+
+    // Prints the phases, and the slowest functions to lower
+    void Print(llvm::raw_ostream& out) const
+    {
+        out << "Time report for " << path << ":\n";
+        for (auto& phase : phases)
+        {
+            if (phase.recorded)
+                out << llvm::format("  %-10s %9.4f s %9ld KiB peak\n", phase.name, phase.seconds, phase.maxRSS);
+        }
+        out << llvm::format("  %-10s %9.4f s\n", "total", totalSeconds);
+
+        auto slowest = GetFunctionsBySeconds();
+        if (slowest.size() > 10)
+            slowest.resize(10);
+        if (!slowest.empty())
+            out << "  Slowest functions to lower:\n";
+        for (auto function : slowest)
+        {
+            out << llvm::format("  %9.4f s %9zu bytes  ", function->seconds, function->bytes)
+                << function->name << "\n";
+        }
+    }
+
+    void PrintJSON(llvm::raw_ostream& out) const
+    {
+        out << "{\"path\": ";
+        PrintJSONString(out, path);
+        out << ", \"seconds\": " << llvm::format("%.6f", totalSeconds) << ", \"phases\": [";
+        bool first = true;
+        for (auto& phase : phases)
+        {
+            if (!phase.recorded)
+                continue;
+            out << (first ? "" : ", ") << "{\"name\": \"" << phase.name << "\", \"seconds\": "
+                << llvm::format("%.6f", phase.seconds) << ", \"max_rss_kib\": " << phase.maxRSS << "}";
+            first = false;
+        }
+        out << "], \"functions\": [";
+        first = true;
+        for (auto function : GetFunctionsBySeconds())
+        {
+            out << (first ? "" : ", ") << "{\"name\": ";
+            PrintJSONString(out, function->name);
+            out << ", \"seconds\": " << llvm::format("%.6f", function->seconds)
+                << ", \"bytes\": " << function->bytes << "}";
+            first = false;
+        }
+        out << "]}";
+    }
+
+  private:
+    struct Phase
+    {
+        char const* name;
+        double seconds;
+        long maxRSS;
+        bool recorded;
+    };
+
+    struct Function
+    {
+        std::string name;
+        double seconds;
+        size_t bytes;
+    };
+
+    // In KiB
+    static long GetMaxRSS()
+    {
+        struct rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) != 0)
+            return 0;
+        return usage.ru_maxrss;
+    }
+
+    static void PrintJSONString(llvm::raw_ostream& out, llvm::StringRef text)
+    {
+        out << '"';
+        for (unsigned char c : text)
+        {
+            if (c == '"' || c == '\\')
+                out << '\\' << c;
+            else if (c < 0x20)
+                out << llvm::format("\\u%04x", c);
+            else
+                out << c;
+        }
+        out << '"';
+    }
+
+    double GetTotalSeconds() const
+    {
+        double seconds = 0;
+        for (auto& phase : phases)
+            seconds += phase.seconds;
+        return seconds;
+    }
+
+    std::vector<Function const*> GetFunctionsBySeconds() const
+    {
+        std::vector<Function const*> sorted;
+        for (auto& function : functions)
+            sorted.push_back(&function);
+        std::stable_sort(sorted.begin(), sorted.end(),
+                         [](Function const* a, Function const* b) { return a->seconds > b->seconds; });
+        return sorted;
+    }
+
+    std::string path;
+    std::vector<Phase> phases;
+    std::vector<Function> functions;
+    double startSeconds;
+    double totalSeconds = 0;
+    double frontendStart = -1;
+    double frontendNested = 0;
+};
+
+// Adds the time until it is stopped or goes out of scope to a phase of the
+// report, if there is one
+class PhaseTimer
+{
+  public:
+    PhaseTimer(TimeReport* report, char const* phase)
+        : report(report), phase(phase), start(report ? TimeReport::GetSeconds() : 0)
+    {
+    }
+
+    ~PhaseTimer() { Stop(); }
+
+    void Stop()
+    {
+        if (report)
+            report->AddPhase(phase, TimeReport::GetSeconds() - start);
+        report = nullptr;
+    }
+
+  private:
+    TimeReport* report;
+    char const* phase;
+    double start;
+};
+
+class DumpConsumer : public ASTConsumer
+{
+  public:
+    DumpConsumer(CompilerInstance& compiler, lua::Block& chunk, llvm::raw_ostream& out,
+                 TimeReport* report, std::string* sourceMap)
+        : visitor(&compiler.getASTContext(), body)
+        , sourceManager(compiler.getSourceManager())
+        , chunk(chunk)
+        , out(out)
+        , report(report)
+        , sourceMap(sourceMap)
+    {
+    }
+
+    virtual void HandleTranslationUnit(ASTContext& context) override
+    {
+        if (report)
+            report->EndFrontend();
+
+        PhaseTimer lowerTimer(report, "lower");
+        auto decls = context.getTranslationUnitDecl()->decls();
+        visitor.AnalyzeDecls(decls);
+        for (auto decl : decls)
+        {
+            auto const& fileId = sourceManager.getFileID(decl->getLocation());
+            if (fileId != sourceManager.getMainFileID())
+                continue;
+
+            auto function = dyn_cast<FunctionDecl>(decl);
+            if (!report || !function || !function->doesThisDeclarationHaveABody())
             {
-                TraverseStmt(binaryOperator->getLHS());
-                std::cout << " = ";
+                visitor.TraverseDecl(decl);
+                continue;
             }
 
-            auto opcode = binaryOperator->getOpcode();
+            auto start = TimeReport::GetSeconds();
+            auto firstStmt = body.stmts.size();
+            visitor.TraverseDecl(decl);
+            report->AddFunction(function->getNameAsString(), TimeReport::GetSeconds() - start,
+                                GetPrintedSize(firstStmt));
+        }
 
-            // Lua doesn't have native bitwise operators, so these need to be lowered
-            // to function calls
-            bool normalBinaryOperator = false;
-            switch (opcode)
+        // Pass args to main(), and call it
+        if (visitor.HasFoundMain())
+        {
+            auto function = lua::Make<lua::Function>();
+            lua::ExprList insertArgs;
+            insertArgs.push_back(lua::Make<lua::Name>("arg"));
+            insertArgs.push_back(lua::Make<lua::Number>("1"));
+            insertArgs.push_back(
+                lua::Make<lua::Index>(lua::Make<lua::Name>("arg"), lua::Make<lua::Number>("0")));
+            function->body.stmts.push_back(lua::Make<lua::CallStmt>(
+                lua::Make<lua::Call>(MakeMember("table", "insert"), std::move(insertArgs))));
+
+            // With -linear-memory, argv is an array of pointers in the heap
+            lua::ExprPtr argv = lua::Make<lua::Name>("arg");
+            if (LinearMemory)
             {
-            case BO_Shl:
-            case BO_ShlAssign:
-                std::cout << "bit._shl(";
-                break;
-            case BO_Shr:
-            case BO_ShrAssign:
-                std::cout << "bit._shr(";
-                break;
-            case BO_And:
-            case BO_AndAssign:
-                std::cout << "bit._and(";
-                break;
-            case BO_Xor:
-            case BO_XorAssign:
-                std::cout << "bit._xor(";
-                break;
-            case BO_Or:
-            case BO_OrAssign:
-                std::cout << "bit._or(";
-                break;
-            default:
-                normalBinaryOperator = true;
-                break;
+                lua::ExprList args;
+                args.push_back(lua::Make<lua::Unary>(lua::UnaryOp::Len, lua::Make<lua::Name>("arg")));
+                args.push_back(lua::Make<lua::Number>(
+                    std::to_string(context.getTypeSizeInChars(context.VoidPtrTy).getQuantity())));
+                args.push_back(std::move(argv));
+                argv = lua::Make<lua::Call>(MakeMember("heap", "new_array"), std::move(args));
             }
 
-            if (!normalBinaryOperator)
+            // With -profile, the sampler reads the source map next to the
+            // script, and writes the stacks next to it once main returns
+            auto nextToScript = [](char const* extension)
             {
-                TraverseStmt(binaryOperator->getLHS());
-                std::cout << ", ";
-                TraverseStmt(binaryOperator->getRHS());
-                std::cout << ")";
-                return true;
+                return lua::Make<lua::Binary>(
+                    lua::BinaryOp::Concat,
+                    lua::Make<lua::Index>(lua::Make<lua::Name>("arg"), lua::Make<lua::Number>("0")),
+                    lua::Make<lua::String>(extension));
+            };
+            if (Profile)
+            {
+                function->body.stmts.push_back(lua::Make<lua::CallStmt>(
+                    MakeCall(MakeMember("profile", "start"), nextToScript(".map"))));
             }
 
-            TraverseStmt(binaryOperator->getLHS());
-            switch (opcode)
+            auto callMain = MakeCall(lua::Make<lua::Name>("main"),
+                                     lua::Make<lua::Unary>(lua::UnaryOp::Len, lua::Make<lua::Name>("arg")),
+                                     std::move(argv));
+
+            // With -instrument, the totals are printed once main returns
+            if (Instrument || Profile)
             {
-            case BO_Mul:
-            case BO_MulAssign:
-                std::cout << " * ";
-                break;
-            case BO_Div:
-            case BO_DivAssign:
-                std::cout << " / ";
-                break;
-            case BO_Rem:
-            case BO_RemAssign:
-                std::cout << " % ";
-                break;
-            case BO_Add:
-            case BO_AddAssign:
-                std::cout << " + ";
-                break;
-            case BO_Sub:
-            case BO_SubAssign:
-                std::cout << " - ";
-                break;
-            case BO_LT:
-                std::cout << " < ";
-                break;
-            case BO_GT:
-                std::cout << " > ";
-                break;
-            case BO_LE:
-                std::cout << " <= ";
-                break;
-            case BO_GE:
-                std::cout << " >= ";
-                break;
-            case BO_EQ:
-                std::cout << " == ";
-                break;
-            case BO_NE:
-                std::cout << " ~= ";
-                break;
-            case BO_LAnd:
-                std::cout << " and ";
-                break;
-            case BO_LOr:
-                std::cout << " or ";
-                break;
-            case BO_Comma:
-                std::cout << ", ";
-                break;
-            case BO_Assign:
-                std::cout << " = ";
-                break;
-            default:
-                break;
+                function->body.stmts.push_back(MakeLocal("_result", std::move(callMain)));
+                callMain = lua::Make<lua::Name>("_result");
             }
-            TraverseStmt(binaryOperator->getRHS());
-
-            if (binaryOperator->isAssignmentOp() && handlingAssignmentInCondition)
+            if (Instrument)
             {
-                std::cout << "; return ";
-                TraverseStmt(binaryOperator->getLHS());
-                std::cout << " end)()";
+                function->body.stmts.push_back(
+                    lua::Make<lua::CallStmt>(MakeCall(MakeMember("instrument", "report"))));
+            }
+            if (Profile)
+            {
+                function->body.stmts.push_back(lua::Make<lua::CallStmt>(
+                    MakeCall(MakeMember("profile", "stop"), nextToScript(".folded"))));
             }
 
-            return true;
+            function->body.stmts.push_back(lua::Make<lua::Return>(std::move(callMain)));
+            body.stmts.push_back(lua::Make<lua::Return>(MakeClosureCall(std::move(function))));
         }
 
-        // Lower ternary operator to a closure
-        if (auto conditionalOperator = dyn_cast<ConditionalOperator>(stmt))
+        lowerTimer.Stop();
+
+        // The passes only see the main file, as the shims are included above it
+        PhaseTimer passesTimer(report, "passes");
+        lua::PassManager passManager;
+        // -instrument counts the calls to each function, which inlining
+        // would hide
+        if (InlineLimit && !Instrument)
         {
-            std::cout << "(function() if ";
-            TraverseCondition(conditionalOperator->getCond());
-            std::cout << " then return ";
-            TraverseStmt(conditionalOperator->getTrueExpr());
-            std::cout << " else return ";
-            TraverseStmt(conditionalOperator->getFalseExpr());
-            std::cout << " end end)()";
-            return true;
+            passManager.AddPass(std::unique_ptr<lua::Pass>(
+                new lua::InlineFunctions(visitor.GetExportedNames(), InlineLimit)));
+        }
+        if (!KeepUnused)
+            passManager.AddPass(std::unique_ptr<lua::Pass>(new lua::RemoveUnusedDecls(visitor.GetExportedNames())));
+        passManager.AddPass(std::unique_ptr<lua::Pass>(new lua::CacheGlobals(visitor.GetShimGlobals())));
+        passManager.Run(body);
+
+        chunk.stmts.push_back(lua::Make<lua::Comment>("main file"));
+        for (auto& stmt : body.stmts)
+            chunk.stmts.push_back(std::move(stmt));
+
+        // Which shim definitions are used is only known once the main file
+        // is final
+        if (!KeepUnused)
+        {
+            lua::PassManager chunkPassManager;
+            chunkPassManager.AddPass(std::unique_ptr<lua::Pass>(new lua::RemoveUnusedShimCode()));
+            chunkPassManager.Run(chunk);
         }
+        passesTimer.Stop();
+
+        PhaseTimer printTimer(report, "print");
+        std::vector<lua::SourceMapping> mappings;
+        lua::Printer printer(out);
+        if (sourceMap)
+            printer.SetSourceMap(&mappings);
+        printer.PrintChunk(chunk);
 
-        if (auto parenExpr = dyn_cast<ParenExpr>(stmt))
+        if (sourceMap)
+            PrintSourceMap(mappings);
+    }
+
+  private:
+    // Each line of the map is a line of the script that starts a statement,
+    // a tab, and then file:line:function of the C it was lowered from, or
+    // nothing if it wasn't
+    void PrintSourceMap(std::vector<lua::SourceMapping> const& mappings)
+    {
+        std::string fileName = sourceManager.getFileEntryForID(sourceManager.getMainFileID())->getName();
+        llvm::raw_string_ostream stream(*sourceMap);
+        stream << "-- Source map for " << fileName << ": <script line>\t<file>:<line>:<function>\n";
+        for (auto& mapping : mappings)
         {
-            std::cout << "(";
-            TraverseStmt(parenExpr->getSubExpr());
-            std::cout << ")";
-            return true;
+            stream << mapping.outputLine << "\t";
+            if (mapping.sourceLine)
+                stream << fileName << ":" << mapping.sourceLine << ":" << mapping.function;
+            stream << "\n";
         }
+    }
 
-        if (auto declStmt = dyn_cast<DeclStmt>(stmt))
+    // The size of the source printed for the statements in body from first
+    // on, which are those a declaration was just lowered to
+    size_t GetPrintedSize(size_t first)
+    {
+        lua::Block lowered;
+        std::move(body.stmts.begin() + first, body.stmts.end(), std::back_inserter(lowered.stmts));
+
+        std::string text;
+        llvm::raw_string_ostream stream(text);
+        lua::Printer printer(stream);
+        printer.PrintChunk(lowered);
+        stream.flush();
+
+        std::move(lowered.stmts.begin(), lowered.stmts.end(), body.stmts.begin() + first);
+        return text.size();
+    }
+
+    lua::Block body;
+    DumpVisitor visitor;
+    SourceManager& sourceManager;
+    lua::Block& chunk;
+    llvm::raw_ostream& out;
+    TimeReport* report;
+    std::string* sourceMap;
+};
+
+class DumpAction : public ASTFrontendAction
+{
+  public:
+    DumpAction(llvm::raw_ostream& out, TimeReport* report, std::string* sourceMap)
+        : out(out), report(report), sourceMap(sourceMap)
+    {
+    }
+
+    virtual bool BeginSourceFileAction(CompilerInstance& compiler, StringRef) override
+    {
         {
-            bool first = true;
+            PhaseTimer includesTimer(report, "includes");
+            for (auto path : GetAlwaysIncludedFiles())
+                IncludeFile(path, chunk);
+        }
 
-            if (declStmt->isSingleDecl())
+        class PrintIncludes : public PPCallbacks
+        {
+        public:
+            PrintIncludes(SourceManager& sourceManager, lua::Block& chunk, TimeReport* report)
+                : sourceManager(sourceManager), chunk(chunk), report(report)
             {
-                auto decl = declStmt->getSingleDecl();
-
-                if (isa<EnumDecl>(decl))
-                {
-                    TraverseDecl(decl);
-                    return true;
-                }
             }
 
-            struct InitDecl
+            virtual void InclusionDirective(SourceLocation location, Token const&, StringRef fileName,
+                                            bool isAngled, CharSourceRange, FileEntry const*,
+                                            StringRef, StringRef, Module const*) override
             {
-                VarDecl* decl = nullptr;
-                size_t size = 0;
-            };
+                // Skip over includes that are not from the main file
+                if (sourceManager.getFileID(location) != sourceManager.getMainFileID())
+                    return;
 
-            std::vector<InitDecl> initDecls;
-            bool isStatic = false;
-            for (auto decl : declStmt->decls())
-            {
-                if (auto varDecl = dyn_cast<VarDecl>(decl))
-                {
-                    if (first)
-                    {
-                        isStatic = varDecl->isStaticLocal();
+                PhaseTimer includesTimer(report, "includes");
+                IncludeFile(GetLuaPathForInclude(fileName, isAngled), chunk);
+            }
+
+            SourceManager& sourceManager;
+            lua::Block& chunk;
+            TimeReport* report;
+        };
+
+        std::unique_ptr<PrintIncludes> callback(
+            new PrintIncludes(compiler.getSourceManager(), chunk, report));
+        auto& preprocessor = compiler.getPreprocessor();
+        preprocessor.addPPCallbacks(std::move(callback));
+
+        return true;
+    }
+
+    virtual std::unique_ptr<ASTConsumer> CreateASTConsumer(CompilerInstance& compiler,
+                                                           llvm::StringRef inFile) override
+    {
+        return std::unique_ptr<ASTConsumer>(new DumpConsumer(compiler, chunk, out, report, sourceMap));
+    }
+
+  private:
+    lua::Block chunk;
+    llvm::raw_ostream& out;
+    TimeReport* report;
+    std::string* sourceMap;
+};
+
+// Creates a DumpAction per source file, all printing to the same stream, and
+// timing into the same report and mapping into the same source map if there
+// are any
+class DumpActionFactory : public FrontendActionFactory
+{
+  public:
+    DumpActionFactory(llvm::raw_ostream& out, TimeReport* report, std::string* sourceMap)
+        : out(out), report(report), sourceMap(sourceMap)
+    {
+    }
+
+    virtual FrontendAction* create() override { return new DumpAction(out, report, sourceMap); }
+
+  private:
+    llvm::raw_ostream& out;
+    TimeReport* report;
+    std::string* sourceMap;
+};
+
+bool WriteOutputFile(std::string const& path, llvm::StringRef contents)
+{
+    std::error_code error;
+    llvm::raw_fd_ostream file(path, error, llvm::sys::fs::F_None);
+    if (error)
+    {
+        llvm::errs() << "Failed to open " << path << ": " << error.message() << "\n";
+        return false;
+    }
+
+    file << contents;
+    return true;
+}
+
+// Writes a precompiled header of the file being compiled to outputFile
+class GenerateShimPCHAction : public GeneratePCHAction
+{
+  public:
+    explicit GenerateShimPCHAction(std::string const& outputFile) : outputFile(outputFile) {}
+
+    virtual bool BeginSourceFileAction(CompilerInstance& compiler, StringRef fileName) override
+    {
+        compiler.getFrontendOpts().OutputFile = outputFile;
+        return GeneratePCHAction::BeginSourceFileAction(compiler, fileName);
+    }
+
+  private:
+    std::string outputFile;
+};
+
+class GenerateShimPCHActionFactory : public FrontendActionFactory
+{
+  public:
+    explicit GenerateShimPCHActionFactory(std::string const& outputFile) : outputFile(outputFile) {}
+
+    virtual FrontendAction* create() override { return new GenerateShimPCHAction(outputFile); }
+
+  private:
+    std::string outputFile;
+};
+
+// Precompiles every header in shim/c into one precompiled header, so that
+// each source file doesn't have to parse them again. It is named after a hash
+// of the headers, the compiler flags and the Clang version, which means
+// changing any of them results in a new precompiled header instead of a stale
+// one. Returns its path, or an empty string if it couldn't be built.
+std::string GetShimPrecompiledHeader(CompilationDatabase const& compilations)
+{
+    std::error_code error;
+    std::vector<std::string> headers;
+    for (llvm::sys::fs::directory_iterator it("shim/c", error), end; !error && it != end;
+         it.increment(error))
+    {
+        if (llvm::sys::path::extension(it->path()) == ".h")
+            headers.push_back(it->path());
+    }
+
+    if (error)
+    {
+        llvm::errs() << "Failed to list shim/c: " << error.message() << "\n";
+        return "";
+    }
+
+    std::sort(headers.begin(), headers.end());
+
+    llvm::MD5 hash;
+    hash.update(getClangFullVersion());
+
+    std::string umbrella;
+    for (auto& header : headers)
+    {
+        auto contents = ReadIncludeFile(header);
+        if (!contents)
+            return "";
+
+        hash.update(header);
+        hash.update(*contents);
+        umbrella += "#include <" + llvm::sys::path::filename(header).str() + ">\n";
+    }
+
+    for (auto& command : compilations.getCompileCommands("irradiant-shims.h"))
+    {
+        for (auto& argument : command.CommandLine)
+            hash.update(argument);
+    }
+
+    llvm::MD5::MD5Result result;
+    hash.final(result);
+    llvm::SmallString<32> digest;
+    llvm::MD5::stringifyResult(result, digest);
+
+    llvm::SmallString<128> base;
+    llvm::sys::path::system_temp_directory(true, base);
+    llvm::sys::path::append(base, "irradiant-shims-" + digest.str());
+    auto umbrellaPath = (base.str() + ".h").str();
+    auto precompiledHeaderPath = (base.str() + ".pch").str();
+
+    if (llvm::sys::fs::exists(precompiledHeaderPath))
+        return precompiledHeaderPath;
 
-                        if (!isStatic)
-                            std::cout << "local ";
-                        else
-                            std::cout << "if ";
-                    }
-                    else
-                    {
-                        if (!isStatic)
-                            std::cout << ", ";
-                        else
-                            std::cout << " or ";
-                    }
+    // The header has to exist on disk, as Clang checks that a precompiled
+    // header's inputs haven't changed whenever it is used
+    if (!WriteOutputFile(umbrellaPath, umbrella))
+        return "";
 
-                    auto name = GetNameForVarDecl(varDecl);
-                    if (name.empty())
-                        continue;
+    ClangTool tool(compilations, umbrellaPath);
+    GenerateShimPCHActionFactory factory(precompiledHeaderPath);
+    if (tool.run(&factory) != 0)
+        return "";
 
-                    std::cout << name;
+    return precompiledHeaderPath;
+}
 
-                    if (isStatic)
-                        std::cout << " == nil";
+void UsePrecompiledHeader(ClangTool& tool, std::string const& precompiledHeader)
+{
+    if (precompiledHeader.empty())
+        return;
 
-                    InitDecl initDecl;
-                    initDecl.decl = varDecl;
+    tool.appendArgumentsAdjuster([precompiledHeader](CommandLineArguments const& arguments)
+    {
+        auto adjusted = arguments;
+        adjusted.push_back("-include-pch");
+        adjusted.push_back(precompiledHeader);
+        return adjusted;
+    });
+}
 
-                    auto constantArrayType = dyn_cast<ConstantArrayType>(varDecl->getType());
-                    if (constantArrayType)
-                        initDecl.size = constantArrayType->getSize().getLimitedValue();
+// Identifies this build of Irradiant, so that a rebuild invalidates the cache
+static std::string ExecutableVersion;
 
-                    initDecls.push_back(initDecl);
-                }
-                else
-                {
-                    TraverseDecl(decl);
-                }
-                first = false;
-            }
+static std::atomic<unsigned> CacheHits(0);
+static std::atomic<unsigned> CacheMisses(0);
+
+// Feeds everything the preprocessor produces for a file into a hash: its
+// tokens, and with -source-map the lines they're on; where each included
+// file starts and ends (which decides whether a declaration belongs to the
+// main file); and the include directives that become Lua includes
+class HashPreprocessedAction : public PreprocessorFrontendAction
+{
+  public:
+    explicit HashPreprocessedAction(llvm::MD5& hash) : hash(hash) {}
+
+  protected:
+    virtual void ExecuteAction() override
+    {
+        class HashIncludes : public PPCallbacks
+        {
+        public:
+            explicit HashIncludes(llvm::MD5& hash) : hash(hash) {}
 
-            if (isStatic)
+            virtual void FileChanged(SourceLocation, FileChangeReason reason,
+                                     SrcMgr::CharacteristicKind, FileID) override
             {
-                std::cout << " then\n";
-                depth++;
+                if (reason == EnterFile)
+                    hash.update("<enter>");
+                else if (reason == ExitFile)
+                    hash.update("<exit>");
             }
 
-            if (initDecls.size())
+            virtual void InclusionDirective(SourceLocation, Token const&, StringRef fileName,
+                                            bool isAngled, CharSourceRange, FileEntry const*,
+                                            StringRef, StringRef, Module const*) override
             {
-                bool first = true;
-                if (!isStatic)
-                    std::cout << " = ";
+                auto path = GetLuaPathForInclude(fileName, isAngled);
+                hash.update("<include " + path + ">");
 
-                for (auto initDecl : initDecls)
+                // Baked includes put the file's contents in the output
+                if (BakeIncludes)
                 {
-                    auto varDecl = initDecl.decl;
-                    auto expr = varDecl->getInit();
-
-                    if (isStatic)
-                    {
-                        auto name = GetNameForVarDecl(varDecl);
-                        if (name.empty())
-                            continue;
+                    auto contents = ReadIncludeFile(path);
+                    hash.update(contents ? *contents : "");
+                }
+            }
 
-                        WriteDepth();
-                        std::cout << name << " = ";
-                    }
-                    else
-                    {
-                        if (!first)
-                            std::cout << ", ";
-                    }
+            llvm::MD5& hash;
+        };
 
-                    if (initDecl.size)
-                        std::cout << "mem.make_array(" << initDecl.size << ", ";
+        auto& preprocessor = getCompilerInstance().getPreprocessor();
+        preprocessor.addPPCallbacks(std::unique_ptr<PPCallbacks>(new HashIncludes(hash)));
+        preprocessor.EnterMainSourceFile();
 
-                    if (expr == nullptr)
-                        std::cout << "0";
-                    else
-                        TraverseStmt(expr);
+        auto& sourceManager = preprocessor.getSourceManager();
+        Token token;
+        do
+        {
+            preprocessor.Lex(token);
+            hash.update(preprocessor.getSpelling(token));
+
+            // The source map records the line each statement came from
+            auto location = token.getLocation();
+            if (SourceMapOption && location.isValid())
+                hash.update(" " + std::to_string(sourceManager.getExpansionLineNumber(location)));
+            hash.update("\n");
+        } while (token.isNot(tok::eof));
+    }
 
-                    if (initDecl.size)
-                        std::cout << ")";
+  private:
+    llvm::MD5& hash;
+};
 
-                    if (isStatic)
-                        std::cout << "\n";
+class HashPreprocessedActionFactory : public FrontendActionFactory
+{
+  public:
+    explicit HashPreprocessedActionFactory(llvm::MD5& hash) : hash(hash) {}
 
-                    first = false;
-                }
-            }
+    virtual FrontendAction* create() override { return new HashPreprocessedAction(hash); }
 
-            if (isStatic)
-            {
-                depth--;
-                WriteDepth();
-                std::cout << "end";
-            }
+  private:
+    llvm::MD5& hash;
+};
 
-            return true;
-        }
+// Hashes the options that change the script printed for a file
+void HashOutputOptions(llvm::MD5& hash)
+{
+    hash.update("-target=" + std::to_string(static_cast<int>(Target.getValue())));
+    hash.update("-array-backend=" + std::to_string(static_cast<int>(ArrayBackendOption.getValue())));
+    if (LinearMemory)
+        hash.update("-linear-memory");
+    if (KeepUnused)
+        hash.update("-keep-unused");
+    hash.update("-inline-limit=" + std::to_string(InlineLimit));
+    if (WholeProgram)
+        hash.update("whole program");
+    if (Instrument)
+        hash.update("-instrument");
+    if (Profile)
+        hash.update("-profile");
+    if (SourceMapOption)
+        hash.update("-source-map");
+    if (EmitOption == EmitKind::Bytecode)
+        hash.update("-emit=bytecode " + GetLuaCompiler());
 
-        if (auto initListExpr = dyn_cast<InitListExpr>(stmt))
+    if (BakeIncludes)
+    {
+        hash.update("-bake-includes");
+        for (auto path : GetAlwaysIncludedFiles())
         {
-            bool first = true;
-            std::cout << "{";
-            for (auto expr : *initListExpr)
-            {
-                if (!first)
-                    std::cout << ", ";
-
-                TraverseStmt(expr);
-                first = false;
-            }
-            std::cout << "}";
-            return true;
+            auto contents = ReadIncludeFile(path);
+            hash.update(contents ? *contents : "");
         }
-
-        return RecursiveASTVisitor::TraverseStmt(stmt);
     }
+}
 
-    bool TraverseDecl(Decl* decl)
+// Returns where the script for a file is cached: <cache-dir>/ab/cdef....lua,
+// named after a hash of its preprocessed source, the options and compiler
+// flags it is transpiled with, and the version of Irradiant and Clang. Returns
+// an empty string if the file can't be preprocessed.
+std::string GetCachePath(CompilationDatabase const& compilations, std::string const& path,
+                         std::string const& precompiledHeader)
+{
+    llvm::MD5 hash;
+    hash.update(getClangFullVersion());
+    hash.update(ExecutableVersion);
+    HashOutputOptions(hash);
+    for (auto& command : compilations.getCompileCommands(path))
     {
-        if (auto functionDecl = dyn_cast<FunctionDecl>(decl))
-        {
-            // Skip over function declarations
-            if (!functionDecl->doesThisDeclarationHaveABody())
-                return true;
+        for (auto& argument : command.CommandLine)
+            hash.update(argument + "\n");
+    }
+    hash.update(precompiledHeader);
+
+    ClangTool tool(compilations, path);
+    UsePrecompiledHeader(tool, precompiledHeader);
+    HashPreprocessedActionFactory factory(hash);
+    if (tool.run(&factory) != 0)
+        return "";
+
+    llvm::MD5::MD5Result result;
+    hash.final(result);
+    llvm::SmallString<32> digest;
+    llvm::MD5::stringifyResult(result, digest);
+
+    llvm::SmallString<128> cachePath(CacheDirectory.getValue());
+    llvm::sys::path::append(cachePath, digest.substr(0, 2), digest.substr(2) + ".lua");
+    return cachePath.str();
+}
 
-            if (functionDecl->isMain())
-                foundMain = true;
+// Writes to a temporary file first, so that another process reading the
+// cache at the same time never sees half a script
+void StoreInCache(std::string const& path, llvm::StringRef contents)
+{
+    if (llvm::sys::fs::create_directories(llvm::sys::path::parent_path(path)))
+        return;
 
-            scopeStack.push_back(functionDecl->getNameAsString());
+    int fd;
+    llvm::SmallString<128> temporaryPath;
+    if (llvm::sys::fs::createUniqueFile(path + "-%%%%%%%%.tmp", fd, temporaryPath))
+        return;
 
-            WriteDepth();
-            std::cout << "function " << functionDecl->getNameAsString();
-            std::cout << "(";
-            bool first = true;
-            for (auto param : functionDecl->params())
-            {
-                if (!first)
-                    std::cout << ", ";
+    {
+        llvm::raw_fd_ostream file(fd, true);
+        file << contents;
+    }
 
-                std::cout << param->getNameAsString();
-                first = false;
-            }
-            std::cout << ")";
-            std::cout << "\n";
+    if (llvm::sys::fs::rename(temporaryPath, path))
+        llvm::sys::fs::remove(temporaryPath);
+}
 
-            if (functionDecl->hasBody())
-                TraverseStmt(functionDecl->getBody());
+// The compiler -emit=bytecode runs, which has to be for the same version of
+// Lua as the target, as the bytecode format changes between versions
+std::string GetLuaCompiler()
+{
+    if (!LuaCompiler.empty())
+        return LuaCompiler;
 
-            WriteDepth();
-            std::cout << "end\n\n";
+    switch (Target)
+    {
+    case LuaTarget::Lua51:
+        return "luac5.1";
+    case LuaTarget::Lua52:
+        return "luac5.2";
+    case LuaTarget::Lua53:
+        return "luac5.3";
+    case LuaTarget::LuaJIT:
+        return "luajit";
+    }
+    return "luac";
+}
 
-            scopeStack.pop_back();
-            return true;
-        }
+// Replaces the script in output with stripped bytecode, compiled by the Lua
+// compiler through a pair of temporary files. Returns false, having printed
+// why, if it couldn't be compiled.
+bool CompileToBytecode(std::string const& path, llvm::SmallVectorImpl<char>& output)
+{
+    auto compiler = GetLuaCompiler();
+    auto program = llvm::sys::findProgramByName(compiler);
+    if (!program)
+    {
+        llvm::errs() << "Failed to find " << compiler << " for -emit=bytecode; use -luac to set it\n";
+        return false;
+    }
 
-        // Duplicated from TraverseStmt: required to catch
-        // unhandled var decls (see: global scope)
-        if (auto varDecl = dyn_cast<VarDecl>(decl))
-        {
-            auto name = GetNameForVarDecl(varDecl);
-            if (name.empty())
-                return true;
+    int fd;
+    llvm::SmallString<128> sourcePath;
+    llvm::SmallString<128> bytecodePath;
+    if (llvm::sys::fs::createTemporaryFile("irradiant", "lua", fd, sourcePath))
+    {
+        llvm::errs() << "Failed to create a temporary file for " << path << "\n";
+        return false;
+    }
+    {
+        llvm::raw_fd_ostream file(fd, true);
+        file << llvm::StringRef(output.data(), output.size());
+    }
+    if (llvm::sys::fs::createTemporaryFile("irradiant", "luac", bytecodePath))
+    {
+        llvm::sys::fs::remove(sourcePath);
+        llvm::errs() << "Failed to create a temporary file for " << path << "\n";
+        return false;
+    }
 
-            std::cout << name;
+    // luac -s -o <bytecode> <source>, or luajit -b -s <source> <bytecode>.
+    // The line numbers the source map refers to are only kept without -s.
+    std::vector<char const*> args;
+    args.push_back(program->c_str());
+    if (Target == LuaTarget::LuaJIT && LuaCompiler.empty())
+    {
+        args.push_back("-b");
+        if (!SourceMapOption)
+            args.push_back("-s");
+        args.push_back(sourcePath.c_str());
+        args.push_back(bytecodePath.c_str());
+    }
+    else
+    {
+        if (!SourceMapOption)
+            args.push_back("-s");
+        args.push_back("-o");
+        args.push_back(bytecodePath.c_str());
+        args.push_back(sourcePath.c_str());
+    }
+    args.push_back(nullptr);
 
-            if (varDecl->hasInit())
-            {
-                std::cout << " = ";
-                TraverseStmt(varDecl->getInit());
-            }
+    std::string error;
+    auto status = llvm::sys::ExecuteAndWait(*program, args.data(), nullptr, nullptr, 0, 0, &error);
+    auto bytecode = llvm::MemoryBuffer::getFile(bytecodePath);
+    llvm::sys::fs::remove(sourcePath);
+    llvm::sys::fs::remove(bytecodePath);
 
-            return true;
-        }
+    if (status != 0 || !bytecode)
+    {
+        llvm::errs() << "Failed to compile " << path << " to bytecode with " << *program;
+        if (!error.empty())
+            llvm::errs() << ": " << error;
+        llvm::errs() << "\n";
+        return false;
+    }
 
-        if (auto enumDecl = dyn_cast<EnumDecl>(decl))
+    auto buffer = bytecode.get()->getBuffer();
+    output.assign(buffer.begin(), buffer.end());
+    return true;
+}
+
+// Transpiles a single source file, printing the result into output, timing
+// each phase into report and printing the source map into sourceMap, if
+// they aren't null
+int TranspileFile(CompilationDatabase const& compilations, std::string const& path,
+                  std::string const& precompiledHeader, llvm::SmallVectorImpl<char>& output,
+                  TimeReport* report, std::string* sourceMap)
+{
+    std::string cachePath;
+    if (!CacheDirectory.empty())
+    {
+        PhaseTimer cacheTimer(report, "cache");
+        cachePath = GetCachePath(compilations, path, precompiledHeader);
+        if (!cachePath.empty())
         {
-            std::cout << "-- " << enumDecl->getNameAsString();
-            for (auto decl : enumDecl->decls())
+            // The source map is cached next to the script, and stored first,
+            // so a script without one is only ever half stored
+            auto cached = llvm::MemoryBuffer::getFile(cachePath);
+            std::unique_ptr<llvm::MemoryBuffer> cachedMap;
+            if (cached && sourceMap)
             {
-                std::cout << "\n";
-                WriteDepth();
-                TraverseDecl(decl);
+                if (auto map = llvm::MemoryBuffer::getFile(cachePath + ".map"))
+                    cachedMap = std::move(map.get());
             }
-            return true;
-        }
 
-        if (auto enumConstantDecl = dyn_cast<EnumConstantDecl>(decl))
-        {
-            std::cout << "local "
-                      << enumConstantDecl->getNameAsString() << " = "
-                      << enumConstantDecl->getInitVal().toString(10, true);
-            return true;
+            if (cached && (!sourceMap || cachedMap))
+            {
+                auto buffer = cached.get()->getBuffer();
+                output.append(buffer.begin(), buffer.end());
+                if (sourceMap)
+                    *sourceMap = cachedMap->getBuffer();
+                ++CacheHits;
+                return 0;
+            }
         }
+        ++CacheMisses;
+    }
 
-        return RecursiveASTVisitor::TraverseDecl(decl);
+    llvm::raw_svector_ostream stream(output);
+    ClangTool tool(compilations, path);
+    UsePrecompiledHeader(tool, precompiledHeader);
+    DumpActionFactory factory(stream, report, sourceMap);
+    if (report)
+        report->BeginFrontend();
+    auto result = tool.run(&factory);
+    stream.flush();
+    // Clang never reaches the consumer if the file doesn't compile
+    if (report)
+        report->EndFrontend();
+
+    if (result == 0 && EmitOption == EmitKind::Bytecode)
+    {
+        PhaseTimer bytecodeTimer(report, "bytecode");
+        if (!CompileToBytecode(path, output))
+            result = 1;
     }
 
-    bool VisitStmt(Stmt* stmt)
+    if (result == 0 && !cachePath.empty())
     {
-        if (auto stringLiteral = dyn_cast<StringLiteral>(stmt))
-        {
-            std::cout << '"' << EscapeString(stringLiteral->getString().str()) << '"';
-            return true;
-        }
+        PhaseTimer cacheTimer(report, "cache");
+        if (sourceMap)
+            StoreInCache(cachePath + ".map", *sourceMap);
+        StoreInCache(cachePath, llvm::StringRef(output.data(), output.size()));
+    }
 
-        if (auto characterLiteral = dyn_cast<CharacterLiteral>(stmt))
-        {
-            // Unlikely to be portable, but works well enough for our purposes
-            auto value = static_cast<wchar_t>(characterLiteral->getValue());
-            std::wcout << L"string.byte(\"" << value << L"\")";
-            return true;
-        }
+    return result;
+}
 
-        if (auto integerLiteral = dyn_cast<IntegerLiteral>(stmt))
-        {
-            std::cout << integerLiteral->getValue().toString(10, true);
-            return true;
-        }
+// foo/bar.c becomes <output-dir>/foo/bar.lua, or bar.luac for bytecode
+std::string GetOutputPathForSource(std::string const& source)
+{
+    llvm::SmallString<128> path(OutputDirectory.getValue());
+    llvm::sys::path::append(path, llvm::sys::path::relative_path(source));
+    llvm::sys::path::replace_extension(path, EmitOption == EmitKind::Bytecode ? "luac" : "lua");
+    return path.str();
+}
+
+int main(int argc, char const** argv)
+{
+    llvm::cl::OptionCategory category("irradiant");
+    // Ugly hack to get around there being no easy way of adding arguments
+    std::vector<char const*> arguments(argv, argv + argc);
+    if (strcmp(arguments.back(), "--") == 0)
+        arguments.pop_back();
+    arguments.push_back("-extra-arg=-fno-builtin");
+    arguments.push_back("-extra-arg=-nostdlib");
+    arguments.push_back("-extra-arg=-nostdinc");
+    arguments.push_back("-extra-arg=-Ishim/c");
+    arguments.push_back("--");
+
+    int size = arguments.size();
+    CommonOptionsParser parser(size, arguments.data(), category);
+
+    if (!OutputFilename.empty() && !OutputDirectory.empty())
+    {
+        llvm::errs() << "-o and -output-dir can't be used together\n";
+        return 1;
+    }
 
-        if (auto floatingLiteral = dyn_cast<FloatingLiteral>(stmt))
+    // Bytecode is a single chunk per file, which can't be concatenated, and
+    // has no use for shims loaded with dofile at runtime
+    if (EmitOption == EmitKind::Bytecode)
+    {
+        if (parser.getSourcePathList().size() > 1 && OutputDirectory.empty())
         {
-            std::cout << floatingLiteral->getValueAsApproximateDouble();
-            return true;
+            llvm::errs() << "-emit=bytecode needs -output-dir for more than one file\n";
+            return 1;
         }
+        BakeIncludes = true;
+    }
 
-        if (auto declRefExpr = dyn_cast<DeclRefExpr>(stmt))
+    // The source map is written next to the script, so it needs one
+    if (Profile)
+        SourceMapOption = true;
+    if (SourceMapOption)
+    {
+        if (OutputFilename.empty() && OutputDirectory.empty())
         {
-            auto decl = declRefExpr->getDecl();
-            if (auto varDecl = cast<VarDecl>(decl))
-                std::cout << GetNameForVarDecl(varDecl);
-            else
-                std::cout << decl->getNameAsString();
-            return true;
+            llvm::errs() << "-source-map and -profile need -o or -output-dir\n";
+            return 1;
         }
-
-        if (auto returnStmt = dyn_cast<ReturnStmt>(stmt))
+        if (parser.getSourcePathList().size() > 1 && OutputDirectory.empty())
         {
-            std::cout << "return";
-            if (returnStmt->getRetValue())
-                std::cout << " ";
-
-            return true;
+            llvm::errs() << "-source-map and -profile need -output-dir for more than one file\n";
+            return 1;
         }
-
-        return true;
     }
 
-    void WriteDepth()
+    if (ArrayBackendOption == ArrayBackend::FFI && LinearMemory)
     {
-        for (uint32_t i = 0; i < depth * 4; ++i)
-            std::cout << ' ';
+        llvm::errs() << "-array-backend=ffi and -linear-memory can't be used together\n";
+        return 1;
     }
 
-    bool HasFoundMain() { return foundMain; }
-
-  private:
-    ASTContext* context;
-    uint32_t depth = 0;
-    bool foundMain = false;
-    bool handlingAssignmentInCondition = false;
-    uint32_t counter = 0;
-    std::deque<std::string> scopeStack;
-};
+    if (ArrayBackendOption == ArrayBackend::FFI && Target != LuaTarget::LuaJIT)
+    {
+        llvm::errs() << "-array-backend=ffi needs -target=luajit\n";
+        return 1;
+    }
 
-class DumpConsumer : public ASTConsumer
-{
-  public:
-    explicit DumpConsumer(CompilerInstance& compiler)
-        : visitor(&compiler.getASTContext()), sourceManager(compiler.getSourceManager())
+    // Any rebuild of Irradiant should invalidate the cache, so it is versioned
+    // on the executable itself
+    auto executable = llvm::sys::fs::getMainExecutable(
+        argv[0], reinterpret_cast<void*>(&GetLuaPathForInclude));
+    llvm::sys::fs::file_status executableStatus;
+    if (!llvm::sys::fs::status(executable, executableStatus))
     {
+        ExecutableVersion = executable + ":" + std::to_string(executableStatus.getSize()) + ":" +
+                            std::to_string(executableStatus.getLastModificationTime().toEpochTime());
     }
 
-    virtual void HandleTranslationUnit(ASTContext& context) override
+    std::string precompiledHeader;
+    if (PrecompileShims)
     {
-        auto entry = sourceManager.getFileEntryForID(sourceManager.getMainFileID());
-        std::cout << "-- main file\n";
+        precompiledHeader = GetShimPrecompiledHeader(parser.getCompilations());
+        if (precompiledHeader.empty())
+            llvm::errs() << "Failed to precompile the shim headers, parsing them for every file\n";
+    }
 
-        auto decls = context.getTranslationUnitDecl()->decls();
-        for (auto decl : decls)
+    // Each file is printed into memory, and written out in one go once it is
+    // done. With -output-dir that happens straight away; otherwise the files
+    // are concatenated in the order they were given.
+    auto& sources = parser.getSourcePathList();
+    WholeProgram = sources.size() == 1;
+    std::vector<llvm::SmallString<0>> outputs(sources.size());
+    std::vector<int> results(sources.size());
+    std::vector<std::unique_ptr<TimeReport>> reports(sources.size());
+    bool timeReport = TimeReportOption || !TimeReportFile.empty();
+    std::vector<std::string> sourceMaps(sources.size());
+
+    std::atomic<size_t> nextSource(0);
+    auto worker = [&]()
+    {
+        for (size_t i = nextSource++; i < sources.size(); i = nextSource++)
         {
-            auto const& fileId = sourceManager.getFileID(decl->getLocation());
-            if (fileId != sourceManager.getMainFileID())
+            if (timeReport)
+                reports[i].reset(new TimeReport(sources[i]));
+            results[i] = TranspileFile(parser.getCompilations(), sources[i], precompiledHeader,
+                                       outputs[i], reports[i].get(),
+                                       SourceMapOption ? &sourceMaps[i] : nullptr);
+            if (timeReport)
+                reports[i]->Finish();
+            if (OutputDirectory.empty())
                 continue;
 
-            visitor.TraverseDecl(decl);
+            auto path = GetOutputPathForSource(sources[i]);
+            auto error = llvm::sys::fs::create_directories(llvm::sys::path::parent_path(path));
+            if (error)
+            {
+                llvm::errs() << "Failed to create the directory for " << path << ": "
+                             << error.message() << "\n";
+                results[i] = 1;
+            }
+            else if (!WriteOutputFile(path, outputs[i]) ||
+                     (SourceMapOption && !WriteOutputFile(path + ".map", sourceMaps[i])))
+            {
+                results[i] = 1;
+            }
+            outputs[i].clear();
         }
+    };
 
-        // Pass args to main(), and call it
-        if (visitor.HasFoundMain())
+    unsigned jobs = Jobs ? Jobs : std::thread::hardware_concurrency();
+    jobs = std::max(1u, std::min<unsigned>(jobs, sources.size()));
+
+    // ClangTool::run changes the working directory of the whole process to
+    // that of each compile command, so files can only be transpiled at once
+    // when their commands all use the same one
+    if (jobs > 1)
+    {
+        std::set<std::string> directories;
+        for (auto& source : sources)
+        {
+            for (auto& command : parser.getCompilations().getCompileCommands(source))
+                directories.insert(command.Directory);
+        }
+        if (directories.size() > 1)
         {
-            std::cout << "return (function() "
-                      << "table.insert(arg, 1, arg[0]); "
-                      << "return main(#arg, arg) end)()\n";
+            llvm::errs() << "-j needs the compile command of every file to use one directory\n";
+            return 1;
         }
     }
 
-  private:
-    DumpVisitor visitor;
-    SourceManager& sourceManager;
-};
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < jobs; ++i)
+        workers.emplace_back(worker);
+    worker();
+    for (auto& thread : workers)
+        thread.join();
 
-class DumpAction : public ASTFrontendAction
-{
-  public:
-    virtual bool BeginSourceFileAction(CompilerInstance& compiler, StringRef) override
+    int result = 0;
+    for (auto fileResult : results)
     {
-        IncludeFile("shim/lua/memory.lua");
-        IncludeFile("shim/lua/bitwise.lua");
-
-        class PrintIncludes : public PPCallbacks
-        {
-        public:
-            PrintIncludes(SourceManager& sourceManager)
-                : sourceManager(sourceManager)
-            {
-            }
-
-            virtual void InclusionDirective(SourceLocation location, Token const&, StringRef fileName,
-                                            bool isAngled, CharSourceRange, FileEntry const*,
-                                            StringRef, StringRef, Module const*) override
-            {
-                // Skip over includes that are not from the main file
-                if (sourceManager.getFileID(location) != sourceManager.getMainFileID())
-                    return;
-
-                auto newFileName = fileName.str();
-                newFileName = newFileName.substr(0, newFileName.find_last_of('.'));
-                newFileName += ".lua";
-
-                if (isAngled)
-                    newFileName = "shim/lua/" + newFileName;
-
-                IncludeFile(newFileName);
-            }
-
-            SourceManager& sourceManager;
-        };
+        if (fileResult)
+            result = fileResult;
+    }
 
-        std::unique_ptr<PrintIncludes> callback(
-            new PrintIncludes(compiler.getSourceManager()));
-        auto& preprocessor = compiler.getPreprocessor();
-        preprocessor.addPPCallbacks(std::move(callback));
+    if (!CacheDirectory.empty())
+        llvm::errs() << "Cache: " << CacheHits << " hits, " << CacheMisses << " misses\n";
 
-        return true;
+    if (TimeReportOption)
+    {
+        for (auto& report : reports)
+            report->Print(llvm::errs());
     }
 
-    virtual std::unique_ptr<ASTConsumer> CreateASTConsumer(CompilerInstance& compiler,
-                                                           llvm::StringRef inFile) override
+    if (!TimeReportFile.empty())
     {
-        return std::unique_ptr<ASTConsumer>(new DumpConsumer(compiler));
+        std::string json;
+        llvm::raw_string_ostream stream(json);
+        stream << "{\"files\": [";
+        for (size_t i = 0; i < reports.size(); ++i)
+        {
+            stream << (i ? ",\n  " : "\n  ");
+            reports[i]->PrintJSON(stream);
+        }
+        stream << "\n]}\n";
+        stream.flush();
+        if (!WriteOutputFile(TimeReportFile, json))
+            result = 1;
     }
-};
 
-int main(int argc, char const** argv)
-{
-    llvm::cl::OptionCategory category("irradiant");
-    // Ugly hack to get around there being no easy way of adding arguments
-    std::vector<char const*> arguments(argv, argv + argc);
-    if (strcmp(arguments.back(), "--") == 0)
-        arguments.pop_back();
-    arguments.push_back("-extra-arg=-fno-builtin");
-    arguments.push_back("-extra-arg=-nostdlib");
-    arguments.push_back("-extra-arg=-nostdinc");
-    arguments.push_back("-extra-arg=-Ishim/c");
-    arguments.push_back("--");
+    if (!OutputDirectory.empty())
+        return result;
 
-    int size = arguments.size();
-    CommonOptionsParser parser(size, arguments.data(), category);
+    llvm::SmallString<0> output;
+    for (auto& fileOutput : outputs)
+        output.append(fileOutput.begin(), fileOutput.end());
+
+    if (OutputFilename.empty())
+    {
+        llvm::outs() << output;
+        return result;
+    }
 
-    ClangTool tool(parser.getCompilations(), parser.getSourcePathList());
-    return tool.run(newFrontendActionFactory<DumpAction>().get());
+    if (!WriteOutputFile(OutputFilename, output))
+        return 1;
+    if (SourceMapOption && !WriteOutputFile(OutputFilename + ".map", sourceMaps.front()))
+        return 1;
+    return result;
 }
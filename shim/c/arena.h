@@ -0,0 +1,4 @@
+#pragma once
+
+// Frees every block malloc has handed out at once. Needs -linear-memory.
+void arena_reset(void);
@@ -1,3 +1,5 @@
+#pragma once
+
 int islower(int);
 int isupper(int);
 int isalpha(int);
@@ -1,3 +1,5 @@
+#pragma once
+
 // Character size
 #define CHAR_BIT 8
 
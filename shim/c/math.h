@@ -1 +1,3 @@
+#pragma once
+
 float floor(float);
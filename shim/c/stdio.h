@@ -1,3 +1,5 @@
+#pragma once
+
 typedef struct {} FILE;
 
 int printf(char const*, ...);
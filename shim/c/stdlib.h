@@ -1,4 +1,18 @@
+#pragma once
+
+typedef unsigned long size_t;
+
+#ifndef NULL
+#define NULL ((void*)0)
+#endif
+
 int atoi(char const*);
 
+// Need -linear-memory
+void* malloc(size_t);
+void* calloc(size_t, size_t);
+void* realloc(void*, size_t);
+void free(void*);
+
 #define EXIT_SUCCESS 0
 #define EXIT_FAILURE 1
@@ -1 +1,3 @@
+#pragma once
+
 int strcmp(char const*, char const*);
@@ -0,0 +1,3 @@
+function arena_reset()
+    heap.reset()
+end
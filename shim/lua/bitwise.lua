@@ -1,8 +1,3 @@
--- Lua 5.2-compatible shim
-bit = {}
-bit._and = bit32.band
-bit._not = bit32.bnot
-bit._or  = bit32.bor
-bit._xor = bit32.bxor
-bit._shl = bit32.lshift
-bit._shr = bit32.rshift
\ No newline at end of file
+-- Lua 5.1 shim: the bitwise operators are lowered to the bit library, which
+-- LuaJIT has built in and the LuaBitOp module provides for Lua 5.1
+bit = bit or require("bit")
@@ -0,0 +1,39 @@
+-- LuaJIT shim for -array-backend=ffi: arrays of numbers are FFI arrays,
+-- which hold their elements unboxed and are indexed from 0, as in C
+local ffi = require("ffi")
+
+local function make_typed_array(element_type)
+	local array_type = ffi.typeof(element_type .. "[?]")
+	return function(size, initializer)
+		-- FFI arrays start out zeroed
+		local ret = array_type(size)
+
+		if initializer ~= nil and type(initializer) == "table" then
+			for i, v in ipairs(initializer) do
+				ret[i - 1] = v
+			end
+		end
+
+		return ret
+	end
+end
+
+mem.int8_array = make_typed_array("int8_t")
+mem.uint8_array = make_typed_array("uint8_t")
+mem.int16_array = make_typed_array("int16_t")
+mem.uint16_array = make_typed_array("uint16_t")
+mem.int32_array = make_typed_array("int32_t")
+mem.uint32_array = make_typed_array("uint32_t")
+mem.float_array = make_typed_array("float")
+mem.double_array = make_typed_array("double")
+
+local copy_table_array = mem.copy_array
+function mem.copy_array(array, size, copy_element)
+	if type(array) == "cdata" then
+		local ret = ffi.new(ffi.typeof(array), size)
+		ffi.copy(ret, array, ffi.sizeof(array))
+		return ret
+	end
+
+	return copy_table_array(array, size, copy_element)
+end
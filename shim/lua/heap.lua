@@ -0,0 +1,197 @@
+-- Shim for -linear-memory: C pointers are byte addresses into HEAP, a single
+-- flat table that holds each object's value at the address of its first
+-- byte. Address 0 is NULL.
+HEAP = {}
+heap = {}
+
+local ALIGNMENT = 8
+local HEAP_BASE = 8
+-- Local arrays are allocated on a stack well above anything malloc returns
+local STACK_BASE = 1099511627776
+
+-- malloc keeps a free list per power-of-two size class. Blocks larger than
+-- the largest class are rounded up to the alignment, and kept in a list of
+-- their own that is searched first fit.
+local MIN_CLASS = 3
+local MAX_CLASS = 16
+local class_sizes = {}
+do
+	local size = 8
+	for class = MIN_CLASS, MAX_CLASS do
+		class_sizes[class] = size
+		size = size * 2
+	end
+end
+
+local break_address
+local free_lists
+local large_free
+local block_sizes
+local stack_top = STACK_BASE
+
+-- Frees everything malloc has handed out at once, like resetting an arena.
+-- The stack is left alone.
+function heap.reset()
+	break_address = HEAP_BASE
+	free_lists = {}
+	for class = MIN_CLASS, MAX_CLASS do
+		free_lists[class] = {}
+	end
+	large_free = {}
+	block_sizes = {}
+end
+heap.reset()
+
+local function size_class(size)
+	for class = MIN_CLASS, MAX_CLASS do
+		if size <= class_sizes[class] then
+			return class
+		end
+	end
+	return nil
+end
+
+function malloc(size)
+	if size < 1 then
+		size = 1
+	end
+
+	local address
+	local class = size_class(size)
+	if class then
+		size = class_sizes[class]
+		local list = free_lists[class]
+		local count = #list
+		if count > 0 then
+			address = list[count]
+			list[count] = nil
+		end
+	else
+		size = size + (-size) % ALIGNMENT
+		for i = 1, #large_free do
+			local block = large_free[i]
+			if block.size >= size then
+				table.remove(large_free, i)
+				address = block.address
+				size = block.size
+				break
+			end
+		end
+	end
+
+	if address == nil then
+		address = break_address
+		break_address = break_address + size
+	end
+
+	block_sizes[address] = size
+	return address
+end
+
+function free(address)
+	local size = block_sizes[address]
+	if size == nil then
+		return
+	end
+	block_sizes[address] = nil
+
+	local class = size_class(size)
+	if class then
+		local list = free_lists[class]
+		list[#list + 1] = address
+	else
+		large_free[#large_free + 1] = {address = address, size = size}
+	end
+end
+
+function calloc(count, size)
+	local bytes = count * size
+	local address = malloc(bytes)
+	for offset = 0, bytes - 1 do
+		HEAP[address + offset] = 0
+	end
+	return address
+end
+
+function realloc(address, size)
+	if address == 0 then
+		return malloc(size)
+	end
+
+	local old_size = block_sizes[address]
+	if old_size == nil then
+		return 0
+	end
+	if size <= old_size then
+		return address
+	end
+
+	local new_address = malloc(size)
+	for offset = 0, old_size - 1 do
+		HEAP[new_address + offset] = HEAP[address + offset]
+	end
+	free(address)
+	return new_address
+end
+
+-- Stores the elements of an array, zeroing the rest. The initializer is a
+-- table of element values, or a string for a char array.
+local function initialize_array(address, count, element_size, initializer)
+	for i = 0, count - 1 do
+		HEAP[address + i * element_size] = 0
+	end
+
+	if type(initializer) == "table" then
+		for i, v in ipairs(initializer) do
+			HEAP[address + (i - 1) * element_size] = v
+		end
+	elseif type(initializer) == "string" then
+		for i = 1, #initializer do
+			HEAP[address + (i - 1) * element_size] = initializer:byte(i)
+		end
+	end
+
+	return address
+end
+
+-- An array with static storage
+function heap.new_array(count, element_size, initializer)
+	return initialize_array(malloc(count * element_size), count, element_size, initializer)
+end
+
+-- A local array, which lasts until the stack is restored with heap.leave
+function heap.stack_array(count, element_size, initializer)
+	local address = stack_top
+	local size = count * element_size
+	stack_top = stack_top + size + (-size) % ALIGNMENT
+	return initialize_array(address, count, element_size, initializer)
+end
+
+-- Saves the stack on entry to a scope that declares local arrays
+function heap.enter()
+	return stack_top
+end
+
+-- Frees the local arrays allocated since the matching heap.enter
+function heap.leave(saved_top)
+	stack_top = saved_top
+end
+
+-- Copies an array in a struct into the same array of another struct
+function heap.copy(destination, source, count, element_size)
+	for offset = 0, (count - 1) * element_size, element_size do
+		HEAP[destination + offset] = HEAP[source + offset]
+	end
+end
+
+-- A copy of an array in a struct on the stack, for a copy of the struct. The
+-- elements are copied in ascending order, so the source may overlap the copy
+-- from above: a struct being returned is copied down this way once the
+-- function's frame has been left.
+function heap.stack_copy(address, count, element_size)
+	local copy = stack_top
+	local size = count * element_size
+	stack_top = stack_top + size + (-size) % ALIGNMENT
+	heap.copy(copy, address, count, element_size)
+	return copy
+end
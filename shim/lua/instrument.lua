@@ -0,0 +1,49 @@
+-- Shim for -instrument: every function counts its calls with instrument.enter
+-- and times them with instrument.leave, and the main wrapper prints the
+-- totals to stderr with instrument.report once main returns.
+instrument = {}
+
+local clock = os.clock
+local calls = {}
+local seconds = {}
+local depth = {}
+
+-- Returns the time the call started, or nil for a recursive call, whose time
+-- is already counted by the outermost call
+function instrument.enter(name)
+	calls[name] = (calls[name] or 0) + 1
+	local level = depth[name] or 0
+	depth[name] = level + 1
+	if level == 0 then
+		return clock()
+	end
+	return nil
+end
+
+function instrument.leave(name, start)
+	depth[name] = depth[name] - 1
+	if start then
+		seconds[name] = (seconds[name] or 0) + clock() - start
+	end
+end
+
+-- Prints each function's calls and the CPU time spent in it, including the
+-- functions it calls, most time first
+function instrument.report()
+	local names = {}
+	for name in pairs(calls) do
+		names[#names + 1] = name
+	end
+	table.sort(names, function(a, b)
+		local sa, sb = seconds[a] or 0, seconds[b] or 0
+		if sa ~= sb then
+			return sa > sb
+		end
+		return a < b
+	end)
+
+	io.stderr:write(string.format("%12s %12s  %s\n", "calls", "seconds", "function"))
+	for _, name in ipairs(names) do
+		io.stderr:write(string.format("%12d %12.6f  %s\n", calls[name], seconds[name] or 0, name))
+	end
+end
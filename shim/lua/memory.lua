@@ -1,10 +1,41 @@
 -- Replace with more efficient method if available
 mem = {}
-function mem.make_array(size, initializer)
-	local ret = {}
+
+-- Tables filled one element at a time are resized log2(size) times on the
+-- way, so arrays are created at their full size instead: with table.new on
+-- LuaJIT, and elsewhere with a table constructor of that many zeros, which
+-- is compiled once per size
+local table_new = nil
+if jit then
+	local ok, new = pcall(require, "table.new")
+	if ok then
+		table_new = new
+	end
+end
+
+local load_source = loadstring or load
+local constructors = {}
+local max_constructor_size = 65536
+
+local function make_zeros(size)
+	if table_new == nil and size <= max_constructor_size then
+		local constructor = constructors[size]
+		if constructor == nil then
+			constructor = load_source("return {" .. string.rep("0,", size) .. "}")
+			constructors[size] = constructor
+		end
+		return constructor()
+	end
+
+	local ret = table_new and table_new(size, 0) or {}
 	for i = 1, size do
 		ret[i] = 0
 	end
+	return ret
+end
+
+function mem.make_array(size, initializer)
+	local ret = make_zeros(size)
 
 	if initializer ~= nil and type(initializer) == "table" then
 		for i, v in ipairs(initializer) do
@@ -13,4 +44,37 @@ function mem.make_array(size, initializer)
 	end
 
 	return ret
-end
\ No newline at end of file
+end
+
+-- An array of structs. Each element without an initializer gets a table of
+-- its own from make_element.
+function mem.make_array_of(size, make_element, initializer)
+	local ret = make_zeros(size)
+
+	for i = 1, size do
+		local value = initializer ~= nil and initializer[i] or nil
+		ret[i] = value ~= nil and value or make_element()
+	end
+
+	return ret
+end
+
+-- A copy of an array of size elements, for a struct that contains it. The
+-- elements of an array of structs are copied with copy_element. Strings
+-- can't be modified, so they're shared.
+function mem.copy_array(array, size, copy_element)
+	if type(array) ~= "table" then
+		return array
+	end
+
+	local ret = make_zeros(size)
+	for i = 1, size do
+		local value = array[i]
+		if copy_element ~= nil then
+			value = copy_element(value)
+		end
+		ret[i] = value
+	end
+
+	return ret
+end
@@ -0,0 +1,113 @@
+-- Shim for -profile: samples the stack every so many VM instructions with a
+-- count hook, and names each frame by the C file, line and function it was
+-- lowered from, using the source map Irradiant writes next to the script.
+-- The samples are written in the collapsed stack format flamegraph.pl reads.
+profile = {}
+
+-- VM instructions between samples; IRRADIANT_PROFILE_INTERVAL overrides it
+local DEFAULT_INTERVAL = 1000
+
+local getinfo = debug.getinfo
+local script_source
+local base_depth
+local labels = {}
+local samples = {}
+
+-- Reads the map into labels, indexed by line of the script. A line that
+-- doesn't start a statement belongs to the statement before it.
+local function read_source_map(path)
+	local file = io.open(path, "r")
+	if not file then
+		io.stderr:write("profile: no source map at " .. path .. ", reporting Lua lines\n")
+		return
+	end
+
+	local last_line, last_label = 1, nil
+	for entry in file:lines() do
+		local line, label = entry:match("^(%d+)\t(.*)$")
+		if line then
+			line = tonumber(line)
+			for i = last_line, line - 1 do
+				labels[i] = last_label
+			end
+			last_line = line
+			last_label = label ~= "" and label or nil
+		end
+	end
+	labels[last_line] = last_label
+	file:close()
+end
+
+local function get_label(info)
+	if info.what == "C" then
+		return "[C] " .. (info.name or "?")
+	end
+	if info.source == script_source then
+		local label = labels[info.currentline]
+		if label then
+			return label
+		end
+	end
+	return "[Lua] " .. (info.name or (info.short_src .. ":" .. info.linedefined))
+end
+
+local function sample()
+	-- Level 1 is this hook. profile.start's caller and the frames below it
+	-- are left out, as they're the same in every sample.
+	local depth = 2
+	while getinfo(depth, "l") do
+		depth = depth + 1
+	end
+
+	local frames = {}
+	for level = depth - base_depth - 1, 2, -1 do
+		local info = getinfo(level, "Sln")
+		if info.what ~= "tail" then
+			frames[#frames + 1] = get_label(info)
+		end
+	end
+
+	local stack = table.concat(frames, ";")
+	samples[stack] = (samples[stack] or 0) + 1
+end
+
+function profile.start(map_path)
+	read_source_map(map_path)
+	script_source = getinfo(2, "S").source
+
+	-- The caller's frame and those below it
+	base_depth = 0
+	while getinfo(base_depth + 2, "l") do
+		base_depth = base_depth + 1
+	end
+
+	-- LuaJIT only runs hooks in the interpreter
+	if jit then
+		jit.off()
+	end
+
+	local interval = tonumber(os.getenv("IRRADIANT_PROFILE_INTERVAL")) or DEFAULT_INTERVAL
+	debug.sethook(sample, "", interval)
+end
+
+-- Writes one line per distinct stack: the frames from the outermost in,
+-- separated by semicolons, then the number of samples
+function profile.stop(output_path)
+	debug.sethook()
+
+	local stacks = {}
+	for stack in pairs(samples) do
+		stacks[#stacks + 1] = stack
+	end
+	table.sort(stacks)
+
+	local file = io.open(output_path, "w")
+	if not file then
+		io.stderr:write("profile: failed to write " .. output_path .. "\n")
+		return
+	end
+	for _, stack in ipairs(stacks) do
+		file:write(stack, " ", samples[stack], "\n")
+	end
+	file:close()
+end
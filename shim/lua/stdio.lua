@@ -8,7 +8,7 @@ function getchar()
 end
 
 function putchar(char)
-    io.write(string.char(char))
+    io.write(string.char(char % 256))
 end
 
 function fprintf(file, str, ...)
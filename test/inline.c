@@ -0,0 +1,39 @@
+#include <stdio.h>
+
+static int calls;
+
+static int add(int a, int b)
+{
+    return a + b;
+}
+
+static int count(int x)
+{
+    ++calls;
+    return x;
+}
+
+static int clamp(int v, int lo, int hi)
+{
+    if (v < lo)
+        return lo;
+    if (v > hi)
+        return hi;
+    return v;
+}
+
+int main(void)
+{
+    int i, total = 0;
+
+    /* Inlinable calls whose results are discarded */
+    add(1, 2);
+    add(count(3), 4);
+    clamp(count(5), 0, 2);
+
+    for (i = -5; i < 300; i += 7)
+        total += clamp(add(i, count(i)), 0, 255);
+
+    printf("total %d, calls %d\n", total, calls);
+    return 0;
+}
@@ -0,0 +1,41 @@
+#include <stdio.h>
+
+static void swap(int* a, int* b)
+{
+    int t = *a;
+    *a = *b;
+    *b = t;
+}
+
+static void divide(int n, int d, int* quotient, int* remainder)
+{
+    *quotient = n / d;
+    *remainder = n % d;
+}
+
+static int bump(int n)
+{
+    int* p = &n;
+    *p += 10;
+    return n;
+}
+
+int main(void)
+{
+    int x = 1, y = 2;
+    int i, q, r, total = 0;
+
+    swap(&x, &y);
+    printf("%d %d\n", x, y);
+
+    for (i = 0; i < 1000; i++)
+    {
+        int step = i;
+        int* p = &step;
+        *p *= 2;
+        divide(step, 7, &q, &r);
+        total += q + r;
+    }
+    printf("%d %d\n", total, bump(5));
+    return 0;
+}
@@ -0,0 +1,105 @@
+#include <stdio.h>
+
+struct vec
+{
+    int n;
+    int v[8];
+};
+
+struct pair
+{
+    struct vec a;
+    struct vec b;
+};
+
+static int* last;
+
+/* True if the stack is higher than it was at the last call from the same
+   depth, i.e. something allocated on it since then hasn't been freed */
+static int stack_moved(void)
+{
+    int probe[1];
+    int moved = last != 0 && last != probe;
+    last = probe;
+    return moved;
+}
+
+static int sum(struct vec s)
+{
+    int i, total = 0;
+    for (i = 0; i < 8; i++)
+        total += s.v[i];
+    return total + s.n;
+}
+
+static struct vec shift(struct vec s)
+{
+    int i;
+    for (i = 7; i > 0; i--)
+        s.v[i] = s.v[i - 1];
+    s.v[0] = s.n++;
+    return s;
+}
+
+static struct pair swap(struct pair p)
+{
+    struct pair q;
+    q.a = p.b;
+    q.b = p.a;
+    return q;
+}
+
+static struct vec s = {1, {1, 2, 3, 4, 5, 6, 7, 8}};
+static struct vec t;
+static struct pair p;
+
+static void run(int phase)
+{
+    int i, total = 0;
+
+    switch (phase)
+    {
+    case 0:
+        for (i = 0; i < 10000; i++)
+        {
+            struct vec u = s;
+            u.v[i % 8] += i;
+            t = shift(u);
+            total += sum(t) % 1000;
+        }
+        printf("%d\n", total);
+        break;
+    case 1:
+        for (i = 0; i < 10000; i++)
+            s = shift(s);
+        printf("%d %d\n", s.n, sum(s));
+        break;
+    case 2:
+        p.a = s;
+        p.b = t;
+        for (i = 0; i < 1001; i++)
+            p = swap(p);
+        printf("%d %d %d\n", p.a.n, sum(p.a), sum(p.b));
+        break;
+    case 3:
+        /* Copies don't share their arrays */
+        t = s;
+        t.v[0] = -1;
+        printf("%d %d\n", s.v[0], t.v[0]);
+        break;
+    }
+}
+
+int main(void)
+{
+    int phase;
+
+    /* The stack is checked from the same place after each phase, so it
+       should be where it was before the first */
+    for (phase = 0; phase < 5; phase++)
+    {
+        printf("stack moved: %d\n", stack_moved());
+        run(phase);
+    }
+    return 0;
+}
@@ -0,0 +1,37 @@
+#include <stdio.h>
+
+int main(void)
+{
+    unsigned char c = 255;
+    unsigned char d = 0;
+    unsigned u = 0;
+    unsigned v = 4294967295u;
+    unsigned char bytes[2] = {255, 0};
+    int i;
+    unsigned a, b;
+
+    c++;
+    d--;
+    u--;
+    v++;
+    printf("%d %d %u %u\n", c, d, u, v);
+
+    /* As values, prefix and postfix, and on array elements */
+    a = ++c;
+    b = c--;
+    printf("%u %u %d\n", a, b, c);
+    a = --u;
+    b = u++;
+    printf("%u %u %u\n", a, b, u);
+    bytes[0]++;
+    --bytes[1];
+    printf("%d %d\n", bytes[0], bytes[1]);
+
+    /* Wrapping repeatedly */
+    for (i = 0; i < 300; i++)
+        c++;
+    for (i = 0; i < 5; i++)
+        u--;
+    printf("%d %u\n", c, u);
+    return 0;
+}